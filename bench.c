@@ -0,0 +1,815 @@
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <net/if.h>
+#include <linux/bpf.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>		/* __rdtsc() */
+#define HAVE_RDTSC 1
+#endif
+
+#include "csum.h"
+#include "dhcp.h"
+#include "dumphex.h"
+#include "fast.h"
+#include "ifc.h"
+#include "io.h"
+#include "loop.h"
+#include "pcap.h"
+#include "pkt.h"
+#include "stats.h"
+#include "txq.h"
+
+/*
+ * Offline microbenchmarks of the packet pipeline.
+ * Synthetic frames, and frames from any pcap files named on the
+ * command line, are fed through the relay's packet functions
+ * entirely in memory.
+ */
+
+#define lengthof(A) (sizeof (A) / sizeof (A)[0])
+
+/* Keeps results alive so the compiler cannot discard the work */
+static volatile uint32_t sink;
+
+struct result {
+	double ns;		/* per call */
+	double cycles;		/* per call, or 0 if unknown */
+};
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t
+cycles(void)
+{
+#ifdef HAVE_RDTSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* Runs fn(arg) until about 0.2s have passed */
+static struct result
+bench_run(void (*fn)(void *), void *arg)
+{
+	unsigned long n = 0, batch = 1;
+	double start = now_ns(), elapsed;
+	uint64_t c0 = cycles();
+
+	do {
+		for (unsigned long i = 0; i < batch; i++)
+			fn(arg);
+		n += batch;
+		batch *= 2;
+		elapsed = now_ns() - start;
+	} while (elapsed < 2e8);
+	return (struct result) {
+		.ns = elapsed / n,
+		.cycles = (double)(cycles() - c0) / n
+	};
+}
+
+static void
+bench_header(void)
+{
+	printf("%-24s %-10s %6s %10s %12s %11s\n", "benchmark", "frames",
+	    "bytes", "ns/pkt", "pkts/s", "cycles/pkt");
+}
+
+static void
+bench_report(const char *name, const char *frames, unsigned int bytes,
+	struct result r)
+{
+	printf("%-24s %-10s %6u %10.1f %12.0f", name, frames, bytes,
+	    r.ns, 1e9 / r.ns);
+	if (r.cycles)
+		printf(" %11.0f\n", r.cycles);
+	else
+		printf(" %11s\n", "-");
+}
+
+/* The original 16-bit word at a time sum, for comparison */
+static uint32_t
+sum16(const void *data, unsigned int len)
+{
+	uint32_t sum = 0;
+	const uint16_t *p = data;
+
+	while (len) {
+		sum += *p++;
+		len -= 2;
+	}
+	return sum;
+}
+
+static uint16_t
+sum16_checksum(const unsigned char *data, unsigned int len)
+{
+	uint32_t sum = sum16(data, len & ~1);
+	if (len & 1) {
+		unsigned char last[2] = { data[len - 1], 0 };
+		sum += sum16(last, sizeof last);
+	}
+	if (sum > 0xffff) {
+		sum = (sum & 0xffff) + (sum >> 16);
+		if (sum > 0xffff)
+			sum = (sum & 0xffff) + 1;
+	}
+	sum ^= 0xffff;
+	return sum ? sum : 0xffff;
+}
+
+struct csum_arg {
+	unsigned char *data;
+	unsigned int len;
+	uint16_t check;
+};
+
+static void
+do_sum16(void *arg)
+{
+	struct csum_arg *a = arg;
+	sink = sum16_checksum(a->data, a->len);
+}
+
+static void
+do_csum_partial(void *arg)
+{
+	struct csum_arg *a = arg;
+	sink = csum_finish(csum_partial(a->data, a->len, 0));
+}
+
+static void
+do_csum_replace(void *arg)
+{
+	struct csum_arg *a = arg;
+	/* Rewrite a 16-byte address, as for each SERVER interface */
+	a->data[0]++;
+	a->check = csum_replace(a->check, a->data + 16, a->data, 16);
+	sink = a->check;
+}
+
+static void
+bench_csum(void)
+{
+	static const unsigned int sizes[] = { 64, 128, 512, 1500, 9000 };
+
+	for (unsigned int i = 0; i < lengthof(sizes); i++) {
+		struct csum_arg a = { .len = sizes[i] };
+		a.data = malloc(a.len);
+		if (!a.data)
+			err(1, "malloc");
+		for (unsigned int j = 0; j < a.len; j++)
+			a.data[j] = rand();
+
+		/* The two sums must agree (including odd lengths) */
+		for (unsigned int len = 0; len <= a.len; len += 61)
+			if (sum16_checksum(a.data, len) !=
+			    csum_finish(csum_partial(a.data, len, 0)))
+				errx(1, "csum_partial mismatch at %u", len);
+
+		bench_report("csum sum16 (old)", "-", a.len,
+		    bench_run(do_sum16, &a));
+		bench_report("csum csum_partial", "-", a.len,
+		    bench_run(do_csum_partial, &a));
+		free(a.data);
+	}
+
+	struct csum_arg a = { .len = 32 };
+	unsigned char addrs[32] = { 0 };
+	a.data = addrs;
+	a.check = csum_finish(0);
+	bench_report("csum csum_replace", "-", 16,
+	    bench_run(do_csum_replace, &a));
+}
+
+/* An L2 frame to feed through the pipeline */
+struct frame {
+	unsigned int len;
+	char *data;
+};
+
+/* A set of frames, used round-robin, and the relay state they need */
+struct workload {
+	struct frame *frames;
+	unsigned int nframes;
+	unsigned int next;
+	unsigned long bytes;	/* Sum of frame lengths */
+	struct pkt *pkt;
+	struct ifc *client;	/* client, server are adjacent, for relay_loop() */
+	struct ifc *server;
+	struct ifc *loop_in;	/* Interface receiving in do_loop() */
+};
+
+static const unsigned char client_mac[6] = { 2, 0, 0, 0, 0, 1 };
+static const unsigned char server_mac[6] = { 2, 0, 0, 0, 0, 2 };
+static const unsigned char all_dhcp_mac[6] = { 0x33, 0x33, 0, 1, 0, 2 };
+static const struct in6_addr client_ll = {{{ 0xfe, 0x80, [15] = 1 }}};
+static const struct in6_addr server_ll = {{{ 0xfe, 0x80, [15] = 2 }}};
+/* The relay's own addresses on the client and server links */
+static const struct in6_addr relay_client_ll = {{{ 0xfe, 0x80, [15] = 3 }}};
+static const struct in6_addr relay_server_ll = {{{ 0xfe, 0x80, [15] = 4 }}};
+static const struct in6_addr all_dhcp = {{{ 0xff, 0x02, [13] = 1, [15] = 2 }}};
+
+/* Appends a DHCPv6 option with len bytes of filler data */
+static char *
+put_opt(char *p, unsigned int code, unsigned int len, const void *data)
+{
+	uint16_t h[2] = { htons(code), htons(len) };
+	memcpy(p, h, sizeof h);
+	if (data)
+		memcpy(p + sizeof h, data, len);
+	else
+		memset(p + sizeof h, code, len);
+	return p + sizeof h + len;
+}
+
+/* Builds a DHCPv6 message of about size bytes with nopts options */
+static unsigned int
+make_msg(char *p, unsigned int type, unsigned int size, unsigned int nopts)
+{
+	char *start = p;
+	unsigned int room = size > 4 + 4 * nopts ? size - 4 - 4 * nopts : 0;
+
+	*p++ = type;
+	*p++ = 0x12; *p++ = 0x34; *p++ = 0x56;	/* transaction-id */
+	for (unsigned int i = 0; i < nopts; i++)
+		p = put_opt(p, 100 + i, room / nopts +
+		    (i < room % nopts), NULL);
+	return p - start;
+}
+
+/* Builds an ethernet/IPv6/UDP frame around payload, with a valid
+ * checksum, and adds it to the workload. */
+static void
+add_frame(struct workload *w, const unsigned char *dmac,
+	const unsigned char *smac, const struct in6_addr *src,
+	const struct in6_addr *dst, const char *payload, unsigned int len)
+{
+	struct frame *f;
+	struct ip6_hdr ip6 = {
+		.ip6_flow = htonl(6 << 28),
+		.ip6_plen = htons(sizeof (struct udphdr) + len),
+		.ip6_nxt = IPPROTO_UDP,
+		.ip6_hlim = 1,
+		.ip6_src = *src,
+		.ip6_dst = *dst,
+	};
+	struct udphdr udp = {
+		.uh_sport = htons(546),
+		.uh_dport = htons(547),
+		.uh_ulen = ip6.ip6_plen,
+	};
+	uint16_t type = htons(ETH_P_IPV6);
+
+	/* Pseudo-header, UDP header and payload */
+	uint32_t sum = csum_partial(&ip6.ip6_src, 32, htons(IPPROTO_UDP));
+	sum = csum_partial(&ip6.ip6_plen, 2, sum);
+	sum = csum_partial(&udp, sizeof udp, sum);
+	udp.uh_sum = csum_finish(csum_partial(payload, len, sum));
+
+	w->frames = realloc(w->frames, (w->nframes + 1) * sizeof *w->frames);
+	if (!w->frames)
+		err(1, "realloc");
+	f = &w->frames[w->nframes++];
+	f->len = ETHER_HDR_LEN + sizeof ip6 + sizeof udp + len;
+	f->data = malloc(f->len);
+	if (!f->data)
+		err(1, "malloc");
+	memcpy(f->data, dmac, 6);
+	memcpy(f->data + 6, smac, 6);
+	memcpy(f->data + 12, &type, 2);
+	memcpy(f->data + ETHER_HDR_LEN, &ip6, sizeof ip6);
+	memcpy(f->data + ETHER_HDR_LEN + sizeof ip6, &udp, sizeof udp);
+	memcpy(f->data + ETHER_HDR_LEN + sizeof ip6 + sizeof udp, payload, len);
+	w->bytes += f->len;
+}
+
+/* A client SOLICIT, as received on a CLIENT interface */
+static void
+add_client_frame(struct workload *w, unsigned int size, unsigned int nopts)
+{
+	char msg[65536];
+	unsigned int len = make_msg(msg, 1, size, nopts);
+
+	add_frame(w, all_dhcp_mac, client_mac, &client_ll, &all_dhcp,
+	    msg, len);
+}
+
+/* A RELAY-REPL for the client interface, as received on a SERVER
+ * interface, with nopts other options around the RELAY_MSG */
+static void
+add_server_frame(struct workload *w, unsigned int size, unsigned int nopts)
+{
+	char msg[65536], *p = msg;
+	char inner[65536];
+	unsigned int inner_len = make_msg(inner, 7, size, 2);
+
+	*p++ = 13;			/* RELAY-REPL */
+	*p++ = 0;			/* hop-count */
+	memset(p, 0, 16); p += 16;	/* link-address */
+	memcpy(p, &client_ll, 16); p += 16;
+	p = put_opt(p, 18 /* INTERFACE_ID */,
+	    strlen(w->client->name), w->client->name);
+	for (unsigned int i = 0; i < nopts; i++)
+		p = put_opt(p, 200 + i, 8, NULL);
+	p = put_opt(p, 9 /* RELAY_MSG */, inner_len, inner);
+	add_frame(w, client_mac, server_mac, &server_ll, &relay_server_ll,
+	    msg, p - msg);
+}
+
+/* A client SOLICIT with nopts options, as relayed by depth relays
+ * before reaching a CLIENT interface, each RELAY-FORW having nopts
+ * options of its own around the RELAY_MSG */
+static void
+add_nested_frame(struct workload *w, unsigned int size, unsigned int nopts,
+	unsigned int depth)
+{
+	static char msg[2][65536];
+	unsigned int len = make_msg(msg[0], 1, size, nopts);
+
+	for (unsigned int d = 0; d < depth; d++) {
+		const char *inner = msg[d % 2];
+		char *p = msg[(d + 1) % 2];
+
+		*p++ = 12;			/* RELAY-FORW */
+		*p++ = d;			/* hop-count */
+		memset(p, 0, 16); p += 16;	/* link-address */
+		memcpy(p, &client_ll, 16); p += 16;
+		for (unsigned int i = 0; i < nopts; i++)
+			p = put_opt(p, 200 + i, 8, NULL);
+		p = put_opt(p, 9 /* RELAY_MSG */, len, inner);
+		len = p - msg[(d + 1) % 2];
+	}
+	add_frame(w, all_dhcp_mac, client_mac, &client_ll, &all_dhcp,
+	    msg[depth % 2], len);
+}
+
+/* Loads the next frame of the workload into its pkt, as if received */
+static struct pkt *
+load(struct workload *w)
+{
+	struct pkt *pkt = w->pkt;
+	struct frame *f = &w->frames[w->next];
+
+	if (++w->next == w->nframes)
+		w->next = 0;
+	pkt->raw = pkt->buf;
+	pkt->rawsize = sizeof pkt->buf;
+	pkt->rawoff = PKT_RXOFF;
+	pkt->rawlen = f->len;
+	memcpy(&pkt->raw[pkt->rawoff], f->data, f->len);
+	return pkt;
+}
+
+static void
+do_load(void *arg)
+{
+	sink = load(arg)->rawlen;
+}
+
+static void
+do_scan(void *arg)
+{
+	sink = pkt_scan_udp(load(arg));
+}
+
+static void
+do_index(void *arg)
+{
+	struct pkt *pkt = load(arg);
+
+	if (pkt_scan_udp(pkt) == -1)
+		errx(1, "scan failed");
+	sink = dhcp_index(pkt) + pkt->nopts;
+}
+
+static void
+do_wrap(void *arg)
+{
+	struct workload *w = arg;
+	struct pkt *pkt = load(w);
+
+	if (pkt_scan_udp(pkt) == -1 || dhcp_wrap(pkt, w->client) == -1)
+		errx(1, "wrap failed");
+	sink = pkt->udphdr->uh_sum;
+}
+
+static void
+do_unwrap(void *arg)
+{
+	struct workload *w = arg;
+	struct pkt *pkt = load(w);
+	char ifname[IFNAMSIZ];
+
+	if (pkt_scan_udp(pkt) == -1 || dhcp_unwrap(pkt, w->server, ifname) == -1)
+		errx(1, "unwrap failed");
+	sink = pkt->udphdr->uh_sum;
+}
+
+static void
+do_checksum(void *arg)
+{
+	struct workload *w = arg;
+	sink = udp6_checksum(w->pkt);
+}
+
+static void
+do_insert(void *arg)
+{
+	struct workload *w = arg;
+	struct pkt *pkt = w->pkt;
+	unsigned int off = pkt->datalen / 2;
+
+	/* Insert in the middle, then take it out again */
+	pkt_insert_udp_data(pkt, off, 64);
+	sink = (uintptr_t)pkt_insert_udp_data(pkt, off + 64, -64);
+}
+
+/* Exits unless a checksum that is claimed valid is what a full
+ * recompute gives */
+static void
+check_csum(const struct pkt *pkt, const char *desc, unsigned int f,
+	const char *what)
+{
+	uint16_t want;
+
+	if (pkt->csum_ok &&
+	    pkt->udphdr->uh_sum != (want = udp6_checksum(pkt)))
+		errx(1, "%s: frame %u: checksum after %s is %04x, not %04x",
+		    desc, f, what, ntohs(pkt->udphdr->uh_sum), ntohs(want));
+}
+
+/* Checks the checksums that dhcp_wrap() or dhcp_unwrap(), and then
+ * pkt_set_src(), adjust incrementally, on every frame of the workload */
+static void
+bench_check_csum(struct workload *w, const char *desc, int client)
+{
+	char ifname[IFNAMSIZ];
+
+	for (unsigned int f = 0; f < w->nframes; f++) {
+		struct pkt *pkt;
+
+		w->next = f;
+		pkt = load(w);
+		if (pkt_scan_udp(pkt) == -1 ||
+		    (client ? dhcp_wrap(pkt, w->client)
+			    : dhcp_unwrap(pkt, w->server, ifname)) == -1)
+			continue;
+		check_csum(pkt, desc, f, client ? "dhcp_wrap" : "dhcp_unwrap");
+		pkt_set_src(pkt, client ? &relay_server_ll : &relay_client_ll);
+		check_csum(pkt, desc, f, "pkt_set_src");
+	}
+}
+
+/* Relays frame f of the workload as relay_one() and relay_send() would,
+ * from the client ifc[0] or the server ifc[1], into buf[].
+ * Returns the frame's length, or 0 if it is dropped. */
+static unsigned int
+relay_frame(struct workload *w, const struct ifc ifc[2], unsigned int f,
+	int client, char *buf)
+{
+	char ifname[IFNAMSIZ];
+	struct iovec iov[2];
+	struct pkt *pkt;
+
+	w->next = f;
+	pkt = load(w);
+	if (pkt_scan_udp(pkt) == -1 ||
+	    (client ? dhcp_wrap(pkt, &ifc[0])
+		    : dhcp_unwrap(pkt, &ifc[1], ifname)) == -1)
+		return 0;
+	pkt_set_src(pkt, &ifc[client ? 1 : 0].addr);
+	if (!pkt->csum_ok)
+		pkt->udphdr->uh_sum = udp6_checksum(pkt);
+	pkt_iov(pkt, iov);
+	memcpy(buf, iov[0].iov_base, iov[0].iov_len);
+	memcpy(buf + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+	return iov[0].iov_len + iov[1].iov_len;
+}
+
+#define FAST_RUNS	100000	/* Program runs timed per workload */
+
+/* Checks what the kernel fast path makes of each frame of the workload
+ * against relay_frame(), and reports the time its program takes. The
+ * frames it leaves to userspace are not timed. */
+static void
+bench_fast(struct workload *w, const char *desc, unsigned int bytes,
+	int client)
+{
+	static int unavailable;
+	static char want[65536], got[65536];
+	struct ifc ifc[2];
+	unsigned int i = client ? 0 : 1;
+	unsigned int want_len, got_len, runs = 0;
+	uint32_t ns;
+	double total = 0;
+	int act;
+
+	if (unavailable)
+		return;
+	/* The program needs interface indexes, not real interfaces, and
+	 * addresses to send from */
+	memcpy(ifc, w->client, sizeof ifc);
+	ifc[0].index = 1;
+	ifc[0].addr = relay_client_ll;
+	ifc[1].index = 2;
+	ifc[1].addr = relay_server_ll;
+
+	for (unsigned int f = 0; f < w->nframes; f++) {
+		const struct frame *fr = &w->frames[f];
+
+		got_len = sizeof got;
+		act = fast_test(ifc, 2, i, fr->data, fr->len, got, &got_len,
+		    &ns);
+		if (act == -1 && errno == ENOENT)
+			return;
+		if (act == -1) {
+			warn("fast path not benchmarked");
+			unavailable = 1;
+			return;
+		}
+		if (act != XDP_REDIRECT)
+			continue;
+		want_len = relay_frame(w, ifc, f, client, want);
+		if (got_len != want_len || memcmp(got, want, want_len) != 0) {
+			dumphex(stderr, "frame", fr->data, fr->len);
+			dumphex(stderr, "userspace", want, want_len);
+			dumphex(stderr, "kernel", got, got_len);
+			errx(1, "%s: frame %u: fast path differs from %s",
+			    desc, f, client ? "dhcp_wrap" : "dhcp_unwrap");
+		}
+		runs++;
+	}
+	if (!runs)
+		return;
+
+	/* Time the frames that were relayed in the kernel */
+	runs = 0;
+	for (unsigned int k = 0; k < FAST_RUNS; k++) {
+		const struct frame *fr = &w->frames[k % w->nframes];
+
+		got_len = sizeof got;
+		act = fast_test(ifc, 2, i, fr->data, fr->len, got, &got_len,
+		    &ns);
+		if (act == XDP_REDIRECT) {
+			total += ns;
+			runs++;
+		}
+	}
+	bench_report(client ? "fast wrap (xdp)" : "fast unwrap (xdp)",
+	    desc, bytes, (struct result){ .ns = total / runs });
+}
+
+#define LOOP_FRAMES	1024	/* Frames per relay_loop() run */
+#define LOOP_BATCH	256	/* A -b batch of more than TXQ_MAX frames */
+#if LOOP_BATCH <= TXQ_MAX
+#error "LOOP_BATCH must exceed TXQ_MAX"
+#endif
+
+/* Replays LOOP_FRAMES frames of the workload through relay_loop(),
+ * from one interface's memory queue to the other's. */
+static void
+do_loop(void *arg)
+{
+	struct workload *w = arg;
+	struct ifc *in = w->loop_in, *out = in == w->client ? w->server
+							   : w->client;
+	struct memq *rx = io_mem_queue(in->name, 0);
+	struct memq *tx = io_mem_queue(out->name, 1);
+	char *buf = w->pkt->buf;
+	unsigned int n = 0;
+
+	for (unsigned int i = 0; i < LOOP_FRAMES; i++) {
+		struct frame *f = &w->frames[w->next];
+		if (++w->next == w->nframes)
+			w->next = 0;
+		memq_put(rx, f->data, f->len);
+	}
+	memq_end(io_mem_queue(w->client->name, 0));
+	memq_end(io_mem_queue(w->server->name, 0));
+	relay_loop(w->client, 2);
+	while (memq_get(tx, buf, sizeof w->pkt->buf))
+		n++;
+	if (n != LOOP_FRAMES)
+		errx(1, "relay_loop relayed %u of %u frames", n, LOOP_FRAMES);
+	sink = n;
+}
+
+/* Runs the per-frame benchmarks appropriate to a workload */
+static void
+bench_workload(struct workload *w, const char *desc)
+{
+	unsigned int bytes = w->bytes / w->nframes;
+	int client, server;
+	char ifname[IFNAMSIZ];
+
+	/* Classify the workload by its first frame */
+	w->next = 0;
+	if (pkt_scan_udp(load(w)) == -1)
+		errx(1, "%s: not a UDPv6 frame", desc);
+	client = dhcp_wrap(w->pkt, w->client) != -1;
+	w->next = 0;
+	pkt_scan_udp(load(w));
+	server = !client && dhcp_unwrap(w->pkt, w->server, ifname) != -1;
+
+	bench_report("load (copy)", desc, bytes, bench_run(do_load, w));
+	bench_report("pkt_scan_udp", desc, bytes, bench_run(do_scan, w));
+	bench_report("dhcp_index (+scan)", desc, bytes, bench_run(do_index, w));
+	if (client)
+		bench_report("dhcp_wrap", desc, bytes, bench_run(do_wrap, w));
+	if (server)
+		bench_report("dhcp_unwrap", desc, bytes,
+		    bench_run(do_unwrap, w));
+	if (client || server) {
+		bench_check_csum(w, desc, client);
+		bench_fast(w, desc, bytes, client);
+	}
+	if (client || server) {
+		/* The whole loop, through the memory backend */
+		w->loop_in = client ? w->client : w->server;
+		w->next = 0;
+		struct result r = bench_run(do_loop, w);
+		r.ns /= LOOP_FRAMES;
+		r.cycles /= LOOP_FRAMES;
+		bench_report("relay_loop (mem)", desc, bytes, r);
+
+		/* Again, receiving more at once than a txq holds */
+		rx_batch = LOOP_BATCH;
+		w->next = 0;
+		r = bench_run(do_loop, w);
+		rx_batch = 0;
+		r.ns /= LOOP_FRAMES;
+		r.cycles /= LOOP_FRAMES;
+		bench_report("relay_loop (mem, -b 256)", desc, bytes, r);
+	}
+
+	/* These work on one scanned packet */
+	w->next = 0;
+	pkt_scan_udp(load(w));
+	bench_report("udp6_checksum", desc, bytes,
+	    bench_run(do_checksum, w));
+	bench_report("pkt_insert_udp_data", desc, bytes,
+	    bench_run(do_insert, w));
+}
+
+static void
+free_workload(struct workload *w)
+{
+	for (unsigned int i = 0; i < w->nframes; i++)
+		free(w->frames[i].data);
+	free(w->frames);
+	w->frames = NULL;
+	w->nframes = 0;
+	w->bytes = 0;
+}
+
+static void
+bench_synthetic(struct workload *w)
+{
+	static const unsigned int sizes[] = { 64, 256, 1024, 1400 };
+	static const unsigned int opts[] = { 2, 8, 32 };
+	char desc[32];
+
+	for (unsigned int i = 0; i < lengthof(sizes); i++)
+		for (unsigned int j = 0; j < lengthof(opts); j++) {
+			if (sizes[i] < 8 * opts[j])
+				continue;
+			snprintf(desc, sizeof desc, "client/%u", opts[j]);
+			add_client_frame(w, sizes[i], opts[j]);
+			bench_workload(w, desc);
+			free_workload(w);
+
+			snprintf(desc, sizeof desc, "server/%u", opts[j]);
+			add_server_frame(w, sizes[i], opts[j]);
+			bench_workload(w, desc);
+			free_workload(w);
+		}
+
+	/* The RELAY-REPL most servers send, with just an INTERFACE_ID
+	 * before the RELAY_MSG */
+	for (unsigned int i = 0; i < lengthof(sizes); i++) {
+		add_server_frame(w, sizes[i], 0);
+		bench_workload(w, "server/0");
+		free_workload(w);
+	}
+
+	/* Client messages through chains of relays, for the index */
+	static const unsigned int depths[] = { 2, 8 };
+	for (unsigned int i = 0; i < lengthof(depths); i++)
+		for (unsigned int j = 0; j < lengthof(opts); j++) {
+			snprintf(desc, sizeof desc, "nested%u/%u",
+			    depths[i], opts[j]);
+			add_nested_frame(w, 256, opts[j], depths[i]);
+			bench_workload(w, desc);
+			free_workload(w);
+		}
+}
+
+/* Benchmarks the client and server frames of a capture file
+ * as two workloads. */
+static void
+bench_pcap(struct workload *w, const char *path)
+{
+	struct pcap_file pc;
+	struct workload server = *w;
+	static char buf[65536];
+	int len;
+
+	server.frames = NULL;
+	if (pcap_open_read(&pc, path) == -1)
+		err(1, "%s", path);
+	while ((len = pcap_read(&pc, buf, sizeof buf, NULL)) > 0) {
+		struct pkt *pkt = w->pkt;
+		struct workload *into;
+		struct frame *f;
+		char ifname[IFNAMSIZ];
+
+		/* Keep the frames that the relay would forward */
+		memcpy(&pkt->buf[PKT_RXOFF], buf, len);
+		pkt->raw = pkt->buf;
+		pkt->rawsize = sizeof pkt->buf;
+		pkt->rawoff = PKT_RXOFF;
+		pkt->rawlen = len;
+		if (pkt_scan_udp(pkt) == -1 || !pkt->datalen)
+			continue;
+		if (pkt->data[0] == 13) {
+			if (dhcp_unwrap(pkt, w->server, ifname) == -1)
+				continue;
+			into = &server;
+		} else {
+			if (dhcp_wrap(pkt, w->client) == -1)
+				continue;
+			into = w;
+		}
+
+		into->frames = realloc(into->frames,
+		    (into->nframes + 1) * sizeof *into->frames);
+		if (!into->frames)
+			err(1, "realloc");
+		f = &into->frames[into->nframes++];
+		f->len = len;
+		f->data = malloc(len);
+		if (!f->data)
+			err(1, "malloc");
+		memcpy(f->data, buf, len);
+		into->bytes += len;
+	}
+	if (len == -1)
+		err(1, "%s", path);
+	pcap_close(&pc);
+
+	if (w->nframes)
+		bench_workload(w, "pcap/client");
+	if (server.nframes)
+		bench_workload(&server, "pcap/server");
+	free_workload(w);
+	free_workload(&server);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct ifc ifc[2] = {
+		{ .side = CLIENT, .name = "eth0", .trust_hops = 32 },
+		{ .side = SERVER, .name = "eth1" },
+	};
+	struct workload w = {
+		.pkt = malloc(sizeof *w.pkt),
+		.client = &ifc[0],
+		.server = &ifc[1],
+	};
+
+	if (!w.pkt)
+		err(1, "malloc");
+	pkt_init(w.pkt);
+	w.pkt->sll.sll_family = AF_PACKET;
+	w.pkt->sll.sll_protocol = htons(ETH_P_IPV6);
+	w.pkt->sll.sll_hatype = ARPHRD_ETHER;
+	ifc_set_replay(&ifc[0]);
+	ifc_set_replay(&ifc[1]);
+	ifc_index_build(ifc, 2);
+	io_backend = &io_mem;
+	if (stats_open(NULL, ifc, 2, 1) == -1)
+		exit(1);
+
+	bench_header();
+	bench_csum();
+	bench_synthetic(&w);
+	for (int i = 1; i < argc; i++)
+		bench_pcap(&w, argv[i]);
+	fast_close(ifc, 2);
+	return 0;
+}
@@ -0,0 +1,251 @@
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "capture.h"
+#include "ifc.h"
+
+volatile int capture_on;
+
+/* pcap-ng block types and options */
+#define BT_SHB		0x0a0d0d0a
+#define BT_IDB		0x00000001
+#define BT_EPB		0x00000006
+#define BT_PAD		0x80000001	/* Local use */
+#define BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define OPT_END		0
+#define OPT_COMMENT	1
+#define IF_NAME		2
+#define IF_TSRESOL	9
+#define EPB_FLAGS	2
+#define LINKTYPE_ETHERNET 1
+
+#define PAD4(n)		(((n) + 3) & ~3u)
+#define BLOCK_MIN	12		/* type, length, length */
+
+#define FILTERS_MAX	16
+#define RING_MIN	(256 << 10)	/* Of the ring of blocks */
+
+static struct {
+	char *map;
+	size_t size;
+	size_t start;		/* Of the ring of blocks */
+	size_t pos;		/* Where the next block goes */
+	pthread_mutex_t lock;
+} cap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static const char *filter_ifc[FILTERS_MAX];
+static unsigned int nfilter_ifc;
+static unsigned char filter_mac[FILTERS_MAX][6];
+static unsigned int nfilter_mac;
+
+int
+capture_filter(const char *arg)
+{
+	unsigned char mac[6];
+	char end;
+
+	if (sscanf(arg, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx%c", &mac[0], &mac[1],
+	    &mac[2], &mac[3], &mac[4], &mac[5], &end) == 6) {
+		if (nfilter_mac == FILTERS_MAX)
+			return -1;
+		memcpy(filter_mac[nfilter_mac++], mac, 6);
+	} else {
+		if (nfilter_ifc == FILTERS_MAX)
+			return -1;
+		filter_ifc[nfilter_ifc++] = arg;
+	}
+	return 0;
+}
+
+int
+capture_ifc(const struct ifc *ifc)
+{
+	if (!nfilter_ifc)
+		return 1;
+	for (unsigned int k = 0; k < nfilter_ifc; k++)
+		if (strcmp(ifc->name, filter_ifc[k]) == 0)
+			return 1;
+	return 0;
+}
+
+int
+capture_mac(const void *frame)
+{
+	const unsigned char *mac = frame;	/* Destination, source */
+
+	if (!nfilter_mac)
+		return 1;
+	for (unsigned int k = 0; k < nfilter_mac; k++)
+		if (memcmp(mac, filter_mac[k], 6) == 0 ||
+		    memcmp(mac + 6, filter_mac[k], 6) == 0)
+			return 1;
+	return 0;
+}
+
+/* Appends an option to the block at p, returning its end */
+static char *
+put_opt(char *p, uint16_t code, const void *data, uint16_t len)
+{
+	uint16_t h[2] = { code, len };
+
+	memcpy(p, h, sizeof h);
+	memcpy(p + sizeof h, data, len);
+	memset(p + sizeof h + len, 0, PAD4(len) - len);
+	return p + sizeof h + PAD4(len);
+}
+
+/* Finishes the block begun at start, of the given type, at p */
+static char *
+end_block(char *start, uint32_t type, char *p)
+{
+	uint32_t len = p - start + 4;
+
+	memcpy(start, &type, 4);
+	memcpy(start + 4, &len, 4);
+	memcpy(p, &len, 4);
+	return p + 4;
+}
+
+/* Writes a padding block over map[off, off + len) */
+static void
+put_pad(size_t off, size_t len)
+{
+	char *p = cap.map + off;
+	uint32_t type = BT_PAD, len32 = len;
+
+	memcpy(p, &type, 4);
+	memcpy(p + 4, &len32, 4);
+	memcpy(p + len - 4, &len32, 4);
+}
+
+static uint32_t
+block_len(size_t off)
+{
+	uint32_t len;
+
+	memcpy(&len, cap.map + off + 4, 4);
+	return len;
+}
+
+int
+capture_open(const char *path, size_t size, const struct ifc *ifc,
+	unsigned int nifc)
+{
+	size = size & ~(size_t)3;
+	if (size > UINT32_MAX)
+		size = (size_t)UINT32_MAX & ~(size_t)3;
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1 || ftruncate(fd, size) == -1) {
+		warn("%s", path);
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	cap.map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (cap.map == MAP_FAILED) {
+		warn("%s: mmap", path);
+		return -1;
+	}
+	cap.size = size;
+
+	/* Section header, of unknown length */
+	char *p = cap.map, *b = p;
+	uint32_t magic = BYTE_ORDER_MAGIC;
+	uint16_t version[2] = { 1, 0 };
+	int64_t section_len = -1;
+	p += 8;
+	memcpy(p, &magic, 4); p += 4;
+	memcpy(p, version, 4); p += 4;
+	memcpy(p, &section_len, 8); p += 8;
+	p = end_block(b, BT_SHB, put_opt(p, OPT_END, NULL, 0));
+
+	/* An interface for each relay interface, in order */
+	for (unsigned int i = 0; i < nifc; i++) {
+		uint16_t link[2] = { LINKTYPE_ETHERNET, 0 };
+		uint32_t snaplen = 0;
+		uint8_t tsresol = 9;		/* ns */
+		b = p;
+		p += 8;
+		memcpy(p, link, 4); p += 4;
+		memcpy(p, &snaplen, 4); p += 4;
+		p = put_opt(p, IF_NAME, ifc[i].name, strlen(ifc[i].name));
+		p = put_opt(p, IF_TSRESOL, &tsresol, 1);
+		p = end_block(b, BT_IDB, put_opt(p, OPT_END, NULL, 0));
+	}
+	cap.start = cap.pos = p - cap.map;
+	if (cap.size < cap.start + RING_MIN) {
+		warnx("%s: too small", path);
+		munmap(cap.map, cap.size);
+		cap.map = NULL;
+		return -1;
+	}
+	put_pad(cap.start, cap.size - cap.start);
+	capture_on = 1;
+	return 0;
+}
+
+void
+capture_toggle(void)
+{
+	if (cap.map)
+		capture_on = !capture_on;
+}
+
+void
+capture_frame(unsigned int ifc, uint64_t time, int out,
+	const struct iovec *iov, unsigned int iovcnt, const char *comment)
+{
+	uint32_t caplen = 0;
+	size_t clen = strlen(comment);
+
+	for (unsigned int k = 0; k < iovcnt; k++)
+		caplen += iov[k].iov_len;
+	size_t len = 8 + 20 + PAD4(caplen) + 4 + PAD4(clen) + 4 + 4 + 4 + 4;
+
+	if (!time) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		time = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	}
+
+	pthread_mutex_lock(&cap.lock);
+	size_t room = cap.size - cap.pos;
+	if (len > room || (len < room && room - len < BLOCK_MIN)) {
+		/* Wrap, padding over the blocks left at the end */
+		if (room)
+			put_pad(cap.pos, room);
+		cap.pos = cap.start;
+	}
+	/* Overwrite whole blocks, keeping room to pad after this one */
+	size_t end = cap.pos;
+	while (end < cap.pos + len ||
+	    (end > cap.pos + len && end < cap.pos + len + BLOCK_MIN))
+		end += block_len(end);
+
+	char *b = cap.map + cap.pos, *p = b + 8;
+	uint32_t epb[5] = { ifc, time >> 32, time, caplen, caplen };
+	uint32_t flags = out ? 2 : 1;		/* Outbound, inbound */
+	memcpy(p, epb, sizeof epb); p += sizeof epb;
+	for (unsigned int k = 0; k < iovcnt; k++) {
+		memcpy(p, iov[k].iov_base, iov[k].iov_len);
+		p += iov[k].iov_len;
+	}
+	memset(p, 0, PAD4(caplen) - caplen);
+	p += PAD4(caplen) - caplen;
+	p = put_opt(p, OPT_COMMENT, comment, clen);
+	p = put_opt(p, EPB_FLAGS, &flags, 4);
+	p = end_block(b, BT_EPB, put_opt(p, OPT_END, NULL, 0));
+	cap.pos += len;
+	if (end > cap.pos)
+		put_pad(cap.pos, end - cap.pos);
+	pthread_mutex_unlock(&cap.lock);
+}
@@ -0,0 +1,51 @@
+/*
+ * Capture of relayed traffic (-C) into a fixed-size, memory-mapped
+ * pcap-ng file used as a ring. Each frame received is recorded as it
+ * arrived, with a comment saying whether it was relayed or why it was
+ * dropped; each frame sent is recorded as it was rewritten. Frames may
+ * be selected by interface or by MAC address (-c).
+ *
+ * The file holds a section header and an interface description per
+ * relay interface, then blocks that exactly fill the rest of it. New
+ * records overwrite the oldest, and whatever is left of an overwritten
+ * block becomes a local padding block, which readers skip; so the file
+ * is always valid, though its records are out of order after it wraps.
+ *
+ * SIGUSR1 pauses and resumes the capture; while it is paused the relay
+ * only tests capture_on.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+struct ifc;
+
+/* Set while capturing */
+extern volatile int capture_on;
+
+/* Adds a filter: an interface name, or a MAC address (xx:xx:...).
+ * Frames are captured if they are on an interface given, if any, and
+ * from or to a MAC address given, if any.
+ * Returns 0 on success, -1 on error. */
+int capture_filter(const char *arg);
+
+/* Creates the file, of size bytes, for the interfaces, and starts
+ * capturing. Returns 0 on success, -1 on error. */
+int capture_open(const char *path, size_t size, const struct ifc *ifc,
+	unsigned int nifc);
+
+/* Pauses or resumes capturing (async-signal-safe) */
+void capture_toggle(void);
+
+/* Tests if frames on the interface are selected by the filters */
+int capture_ifc(const struct ifc *ifc);
+
+/* Tests if a frame's MAC addresses are selected by the filters */
+int capture_mac(const void *frame);
+
+/* Records a frame made of iov[0..iovcnt), received (out == 0) or sent
+ * on interface number ifc at time (ns, CLOCK_REALTIME, or 0 for now),
+ * with a comment */
+void capture_frame(unsigned int ifc, uint64_t time, int out,
+	const struct iovec *iov, unsigned int iovcnt, const char *comment);
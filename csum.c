@@ -0,0 +1,51 @@
+#include <string.h>
+
+#include "csum.h"
+
+uint32_t
+csum_partial(const void *data, size_t len, uint32_t sum)
+{
+	const unsigned char *p = data;
+	uint64_t acc0 = sum, acc1 = 0, acc2 = 0, acc3 = 0;
+	uint32_t w[4];
+
+	/* Adding 32-bit words into 64-bit accumulators cannot overflow
+	 * for any packet size, so there is no carry to propagate and
+	 * the independent lanes can be vectorised by the compiler. */
+	for (; len >= sizeof w; len -= sizeof w, p += sizeof w) {
+		memcpy(w, p, sizeof w);
+		acc0 += w[0];
+		acc1 += w[1];
+		acc2 += w[2];
+		acc3 += w[3];
+	}
+	for (; len >= sizeof w[0]; len -= sizeof w[0], p += sizeof w[0]) {
+		memcpy(w, p, sizeof w[0]);
+		acc0 += w[0];
+	}
+	if (len) {
+		/* Zero-pad the last 1..3 bytes to a 32-bit word.
+		 * Byte k of a word falls in the same lane as byte k
+		 * of a 16-bit word, modulo 0xffff. */
+		w[0] = 0;
+		memcpy(w, p, len);
+		acc0 += w[0];
+	}
+
+	/* Fold to 32 bits; 2^32 == 1 (mod 0xffff) */
+	uint64_t acc = acc0 + acc1 + acc2 + acc3;
+	acc = (acc & 0xffffffff) + (acc >> 32);
+	acc = (acc & 0xffffffff) + (acc >> 32);
+	return acc;
+}
+
+uint16_t
+csum_replace(uint16_t check, const void *old, const void *new, size_t len)
+{
+	/* HC' = ~(~HC + ~m + m') */
+	uint32_t sum = (uint16_t)~check;
+
+	sum = csum_add(sum, (uint16_t)~csum_fold(csum_partial(old, len, 0)));
+	sum = csum_add(sum, csum_partial(new, len, 0));
+	return csum_finish(sum);
+}
@@ -0,0 +1,68 @@
+/*
+ * Internet (one's complement) checksum arithmetic, RFC 1071.
+ * Partial sums are kept in 32-bit accumulators of native-endian
+ * 16-bit words, which works for network-endian data because the
+ * one's complement sum is byte-order independent.
+ * Checksum fields can be updated without rescanning the data they
+ * cover, as described in RFC 1624.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Adds the 16-bit words of data[len] to the partial sum.
+ * Odd-length data is summed as though padded with a zero byte, so
+ * only the last of several consecutive pieces may have an odd length
+ * (otherwise see csum_at()). */
+uint32_t csum_partial(const void *data, size_t len, uint32_t sum);
+
+/* Updates a stored checksum field whose covered data changed from
+ * old[len] to new[len] (RFC 1624, eqn 3). len must be even. */
+uint16_t csum_replace(uint16_t check, const void *old, const void *new,
+	size_t len);
+
+/* Folds a partial sum into 16 bits */
+static inline uint16_t
+csum_fold(uint32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/* Adds two partial sums */
+static inline uint32_t
+csum_add(uint32_t a, uint32_t b)
+{
+	a += b;
+	return a + (a < b);	/* end-around carry */
+}
+
+/* Subtracts partial sum b from a */
+static inline uint32_t
+csum_sub(uint32_t a, uint32_t b)
+{
+	return csum_add(a, (uint16_t)~csum_fold(b));
+}
+
+/* Converts the partial sum of some data to the sum it contributes
+ * when placed at byte offset off: data at an odd offset is summed
+ * in the opposite byte lanes. */
+static inline uint32_t
+csum_at(uint32_t sum, size_t off)
+{
+	if (off & 1) {
+		uint16_t s = csum_fold(sum);
+		return (uint16_t)((s << 8) | (s >> 8));
+	}
+	return sum;
+}
+
+/* Converts a partial sum to a UDP checksum field value.
+ * (A computed checksum of zero is transmitted as all ones.) */
+static inline uint16_t
+csum_finish(uint32_t sum)
+{
+	uint16_t check = ~csum_fold(sum);
+	return check ? check : 0xffff;
+}
@@ -0,0 +1,99 @@
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup.h"
+#include "ifc.h"
+#include "pkt.h"
+
+unsigned int dedup_window;
+_Thread_local struct dedup *dedup_self;
+
+/* A fingerprint stays in the set for between (DEDUP_SPOKES - 1) and
+ * DEDUP_SPOKES slices of dedup_window / (DEDUP_SPOKES - 1) */
+#define DEDUP_SPOKES	4
+#define DEDUP_BITS	10		/* Slots per spoke, log2 */
+#define DEDUP_SLOTS	(1u << DEDUP_BITS)
+#define DEDUP_PROBE	8
+
+struct dedup {
+	uint64_t slice;			/* ns per spoke */
+	uint64_t tick;			/* Current slice number */
+	uint32_t spoke[DEDUP_SPOKES][DEDUP_SLOTS];	/* 0 is empty */
+};
+
+void
+dedup_bind(void)
+{
+	if (!dedup_window)
+		return;
+	dedup_self = calloc(1, sizeof *dedup_self);
+	if (!dedup_self)
+		err(1, "calloc");
+	dedup_self->slice = (dedup_window * 1000000ull + DEDUP_SPOKES - 2) /
+	    (DEDUP_SPOKES - 1);
+}
+
+void
+dedup_unbind(void)
+{
+	free(dedup_self);
+	dedup_self = NULL;
+}
+
+/* Turns the wheel to the slice of time now, emptying the spokes it
+ * comes round to */
+static void
+dedup_turn(struct dedup *d, uint64_t now)
+{
+	uint64_t tick = now / d->slice;
+
+	if (tick <= d->tick)
+		return;		/* Not yet, or the clock stepped back */
+	if (tick - d->tick >= DEDUP_SPOKES)
+		memset(d->spoke, 0, sizeof d->spoke);
+	else
+		for (uint64_t t = d->tick + 1; t <= tick; t++)
+			memset(d->spoke[t % DEDUP_SPOKES], 0,
+			    sizeof d->spoke[0]);
+	d->tick = tick;
+}
+
+int
+dedup_seen(struct dedup *d, const struct ifc *ifc, const struct pkt *pkt)
+{
+	dedup_turn(d, pkt_time(pkt));
+
+	/* Hash the interface, MAC, msg-type and transaction-id */
+	unsigned char key[4 + 8 + 4] = { 0 };
+	unsigned int halen = pkt->sll.sll_halen < 8 ? pkt->sll.sll_halen : 8;
+	memcpy(key, &ifc->num, 4);
+	memcpy(key + 4, pkt->sll.sll_addr, halen);
+	memcpy(key + 12, pkt->data, 4);
+	uint64_t a, b;
+	memcpy(&a, key, 8);
+	memcpy(&b, key + 8, 8);
+	uint64_t h = (a ^ (b * 0xff51afd7ed558ccdull)) * 0x9e3779b97f4a7c15ull;
+	uint32_t fp = (h >> 32) | 1;
+	unsigned int slot = (h >> (32 - DEDUP_BITS)) & (DEDUP_SLOTS - 1);
+
+	for (unsigned int s = 0; s < DEDUP_SPOKES; s++)
+		for (unsigned int k = 0; k < DEDUP_PROBE; k++) {
+			uint32_t v = d->spoke[s][(slot + k) & (DEDUP_SLOTS - 1)];
+			if (v == fp)
+				return 1;
+			if (!v)
+				break;
+		}
+
+	/* Add it to the current spoke, unless its probe window is full */
+	uint32_t *spoke = d->spoke[d->tick % DEDUP_SPOKES];
+	for (unsigned int k = 0; k < DEDUP_PROBE; k++) {
+		uint32_t *v = &spoke[(slot + k) & (DEDUP_SLOTS - 1)];
+		if (!*v) {
+			*v = fp;
+			break;
+		}
+	}
+	return 0;
+}
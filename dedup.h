@@ -0,0 +1,36 @@
+/*
+ * Optional suppression of retransmitted client messages (-d). A message
+ * with the same input interface, client link-layer address, message
+ * type and transaction-id as one seen within the window is dropped by
+ * dhcp_dup(), before it is rate-limited (-l, -L) or wrapped and relayed
+ * again.
+ *
+ * Each worker keeps a set of 32-bit fingerprints of the messages it has
+ * seen, split over a time wheel: a few spokes, each a small
+ * open-addressed table for one slice of the window. Messages are added
+ * to the current spoke, and a spoke is emptied as the wheel comes round
+ * to it again, so nothing need be expired one by one.
+ */
+
+#include <stdint.h>
+
+struct ifc;
+struct pkt;
+
+/* The window in milliseconds, or 0 for none */
+extern unsigned int dedup_window;
+
+struct dedup;
+
+/* The calling thread's set, or NULL if it does not check */
+extern _Thread_local struct dedup *dedup_self;
+
+/* Creates a set for the calling thread, if there is a window */
+void dedup_bind(void);
+
+/* Frees the calling thread's set */
+void dedup_unbind(void);
+
+/* Records a message received from a client on ifc.
+ * Returns 1 if it was already seen within the window, else 0. */
+int dedup_seen(struct dedup *d, const struct ifc *ifc, const struct pkt *pkt);
@@ -1,21 +1,19 @@
 #include <err.h>
+#include <stdlib.h>
 
+#include "csum.h"
+#include "dedup.h"
 #include "dhcp.h"
-#include "dumphex.h"
 #include "ifc.h"
 #include "pkt.h"
-#include "verbose.h"
+#include "plog.h"
+#include "stats.h"
 
 #define INET6_ADDRLEN	16
 
 /* DHCP Relay packet header. This is different to normal DHCPv6 */
 struct dhcp_relay_hdr {
-	uint8_t msg_type;
-#define DHCP_ADVERTISE    2
-#define DHCP_REPLY        7
-#define DHCP_RECONFIGURE 10
-#define DHCP_RELAY_FORW  12
-#define DHCP_RELAY_REPL  13
+	uint8_t msg_type;		/* DHCP_* */
 	uint8_t hop_count;
 	uint8_t link_address[INET6_ADDRLEN];
 	uint8_t peer_address[INET6_ADDRLEN];
@@ -31,18 +29,186 @@ struct dhcp_opt {
 	/* data follows, unpadded */
 };
 
+int
+dhcp_relay_template(struct ifc *ifc)
+{
+	struct dhcp_relay_hdr hdr = {
+		.msg_type = DHCP_RELAY_FORW,
+		.hop_count = 0,			/* patched */
+		.link_address = {0}, /* link-address field is :: */
+		.peer_address = {0}		/* patched */
+	};
+	struct dhcp_opt opt_vendor = {
+		.code = htons(OPTION_VENDOR_CLASS),
+		.len = htons(ifc->vendor_len)
+	};
+	uint16_t ifnamelen = strnlen(ifc->name, IFNAMSIZ);
+	struct dhcp_opt opt_ifname = {
+		.code = htons(OPTION_INTERFACE_ID),
+		.len = htons(ifnamelen)
+	};
+	struct dhcp_opt opt_msg = {
+		.code = htons(OPTION_RELAY_MSG),
+		.len = 0			/* patched */
+	};
+	unsigned int len =
+	    sizeof hdr +
+	    sizeof opt_ifname + ifnamelen +
+	    (ifc->vendor_len ? (sizeof opt_vendor + ifc->vendor_len) : 0) +
+	    sizeof opt_msg;
+
+	char *dst = realloc(ifc->relay_tmpl, len);
+	if (!dst)
+		return -1;
+	ifc->relay_tmpl = dst;
+	ifc->relay_len = len;
+
+	memcpy(dst, &hdr, sizeof hdr); dst += sizeof hdr;
+	memcpy(dst, &opt_ifname, sizeof opt_ifname); dst += sizeof opt_ifname;
+	memcpy(dst, ifc->name, ifnamelen); dst += ifnamelen;
+	if (ifc->vendor_len) {
+		memcpy(dst, &opt_vendor, sizeof opt_vendor); dst += sizeof opt_vendor;
+		memcpy(dst, ifc->vendor_data, ifc->vendor_len); dst += ifc->vendor_len;
+	}
+	memcpy(dst, &opt_msg, sizeof opt_msg); dst += sizeof opt_msg;
+
+	ifc->relay_sum = csum_partial(ifc->relay_tmpl, len, 0);
+	return 0;
+}
+
+unsigned int
+dhcp_index(struct pkt *pkt)
+{
+	unsigned int off = 0, len = pkt->datalen;
+
+	if (pkt->nopts != -1)
+		return pkt->nmsgs;
+	pkt->nopts = 0;
+	pkt->nmsgs = 0;
+	while (pkt->nmsgs < PKT_MSGS) {
+		unsigned int depth = pkt->nmsgs++;
+		const char *msg = pkt->data + off;
+
+		pkt->msg[depth].off = off;
+		pkt->msg[depth].len = len;
+		if (len < 4)
+			break;
+		int relay = msg[0] == DHCP_RELAY_FORW ||
+			    msg[0] == DHCP_RELAY_REPL;
+		unsigned int p = relay ? sizeof (struct dhcp_relay_hdr) : 4;
+		unsigned int next = 0, next_len = 0;
+		int nested = 0;
+
+		while (p + sizeof (struct dhcp_opt) <= len) {
+			struct dhcp_opt opt;
+			memcpy(&opt, msg + p, sizeof opt);
+			opt.code = ntohs(opt.code);
+			opt.len = ntohs(opt.len);
+			p += sizeof opt;
+			if (opt.len > len - p)
+				break;	/* Truncated */
+			if (pkt->nopts < PKT_OPTS)
+				pkt->opt[pkt->nopts++] = (struct pkt_opt) {
+					.code = opt.code,
+					.len = opt.len,
+					.off = off + p,
+					.depth = depth,
+				};
+			if (relay && opt.code == OPTION_RELAY_MSG && !nested) {
+				next = off + p;
+				next_len = opt.len;
+				nested = 1;
+			}
+			p += opt.len;
+		}
+		if (!nested)
+			break;
+		off = next;
+		len = next_len;
+	}
+	return pkt->nmsgs;
+}
+
+const struct pkt_opt *
+dhcp_opt(struct pkt *pkt, unsigned int depth, unsigned int code)
+{
+	dhcp_index(pkt);
+	for (int k = 0; k < pkt->nopts; k++)
+		if (pkt->opt[k].depth == depth && pkt->opt[k].code == code)
+			return &pkt->opt[k];
+	return NULL;
+}
+
+const char *
+dhcp_client_msg(struct pkt *pkt, unsigned int *depth)
+{
+	unsigned int n = dhcp_index(pkt);
+
+	if (!n || pkt->msg[n - 1].len < 4)
+		return NULL;
+	const char *msg = pkt->data + pkt->msg[n - 1].off;
+	if (msg[0] == DHCP_RELAY_FORW || msg[0] == DHCP_RELAY_REPL)
+		return NULL;	/* Nested too deeply, or no RELAY_MSG */
+	*depth = n - 1;
+	return msg;
+}
+
+/* After the wrapper of pkt's message at depth 0 has been removed,
+ * leaving the message that was at depth 1, makes the index describe
+ * that message. */
+static void
+dhcp_index_unwrap(struct pkt *pkt, int nopts)
+{
+	unsigned int base = pkt->msg[1].off;
+	int n = 0;
+
+	for (int k = 0; k < nopts; k++)
+		if (pkt->opt[k].depth) {
+			pkt->opt[n] = pkt->opt[k];
+			pkt->opt[n].depth--;
+			pkt->opt[n].off -= base;
+			n++;
+		}
+	for (unsigned int d = 1; d < pkt->nmsgs; d++) {
+		pkt->msg[d - 1] = pkt->msg[d];
+		pkt->msg[d - 1].off -= base;
+	}
+	pkt->nmsgs--;
+	pkt->nopts = n;
+}
+
+int
+dhcp_dup(const struct pkt *pkt, const struct ifc *ifc)
+{
+	if (!dedup_self || pkt->datalen < 4)
+		return 0;
+	switch (pkt->data[0/*msg-type*/]) {
+	case DHCP_ADVERTISE:
+	case DHCP_REPLY:
+	case DHCP_RECONFIGURE:
+	case DHCP_RELAY_FORW:
+	case DHCP_RELAY_REPL:
+		return 0;	/* dhcp_wrap() decides */
+	}
+	if (!dedup_seen(dedup_self, ifc, pkt))
+		return 0;
+	plog(PLOG_DUP, ifc, NULL, pkt, NULL, 0);
+	stat_inc(ifc, STAT_DUP);
+	return 1;
+}
+
 /* Wraps a client DHCPv6 packet into a RELAY-FORW message.
  * The source interface's name is used as the INTERFACE-ID option.
+ * The new headers are usually built in pkt->hdrbuf, leaving a
+ * split packet (see pkt.h).
  * Returns 0 on success, otherwise -1 if the message should
  * be discarded. */
 int
 dhcp_wrap(struct pkt *pkt, const struct ifc *ifc)
 {
-	if (verbose_level > 1)
-		dumphex(stderr, "before-wrap", pkt->data, pkt->datalen);
+	plog(PLOG_BEFORE_WRAP, ifc, NULL, pkt, pkt->data, pkt->datalen);
 
 	/* Discard selected messages */
-	struct dhcp_relay_hdr *dhcp = (struct dhcp_relay_hdr *)pkt->data;
 	uint8_t hop_count = 0;
 	if (pkt->datalen) {
 		switch (pkt->data[0/*msg-type*/]) {
@@ -50,76 +216,87 @@ dhcp_wrap(struct pkt *pkt, const struct ifc *ifc)
 		case DHCP_REPLY:
 		case DHCP_RECONFIGURE:
 		case DHCP_RELAY_REPL:
-			verbose2("%s: discarding message type %u\n",
-			    ifc->name, *pkt->data);
+			plog(PLOG_DISCARD, ifc, NULL, pkt, NULL, 0);
+			stat_inc(ifc, STAT_MSG_TYPE);
 			return -1;	/* Discard */
 		case DHCP_RELAY_FORW:
-			if (pkt->datalen < 2)
+			if (pkt->datalen < 2) {
+				stat_inc(ifc, STAT_MALFORMED);
 				return -1; /* malformed */
+			}
 			if (pkt->data[1/*hop_count*/] >= ifc->trust_hops) {
-				verbose(
-				    "%s: too many nested forwards (%u) from %s",
-				    ifc->name, dhcp->hop_count,
-				    pkt_lladdr(pkt));
+				plog(PLOG_HOPS, ifc, NULL, pkt, NULL, 0);
+				stat_inc(ifc, STAT_HOPS);
 				return -1;
 			}
 			hop_count = pkt->data[1] + 1;
+			break;
 		}
 	}
 
-	struct dhcp_relay_hdr hdr = {
-		.msg_type = DHCP_RELAY_FORW,
-		.hop_count = hop_count,
-		.link_address = {0} /* link-address field is :: */
-		/* .peer_address = ip6_src */
-	};
-	memcpy(&hdr.peer_address, &pkt->ip6_hdr->ip6_src, INET6_ADDRLEN);
-
-	struct dhcp_opt opt_vendor = {
-		.code = htons(OPTION_VENDOR_CLASS),
-		.len = htons(ifc->vendor_len)
-	};
-	uint16_t ifnamelen = strnlen(ifc->name, IFNAMSIZ);
-	struct dhcp_opt opt_ifname = {
-		.code = htons(OPTION_INTERFACE_ID),
-		.len = htons(ifnamelen)
-	};
-	struct dhcp_opt opt_msg = {
-		.code = htons(OPTION_RELAY_MSG),
-		.len = htons(pkt->datalen)
-	};
-
-	/* Insert the relay header and options at the
-	 * beginning of the UDP payload:
+	/* The relay header and options come from the template:
 	 *    hdr
 	 *    INTERFACE_ID: ifc->name
 	 *    [VENDOR_CLASS: ifc->vendor]
 	 *    RELAY_MSG: <original data goes here>
 	 */
-	unsigned int insert_len =
-	    sizeof hdr +
-	    sizeof opt_ifname + ifnamelen +
-	    (ifc->vendor_len ? (sizeof opt_vendor + ifc->vendor_len) : 0) +
-	    sizeof opt_msg;
+	unsigned int insert_len = ifc->relay_len;
 
-	char *dst = pkt_insert_udp_data(pkt, 0, insert_len);
-	if (!dst) {
-		warnx("%s: big packet? from %s", ifc->name,
-		    pkt_lladdr(pkt));
-		return -1;
-	}
+	/* The client's payload sum survives the move */
+	int csum_ok = pkt->csum_ok;
+	uint32_t sum = csum_ok ? pkt_payload_sum(pkt) : 0;
 
-	memcpy(dst, &hdr, sizeof hdr); dst += sizeof hdr;
-	memcpy(dst, &opt_ifname, sizeof opt_ifname); dst += sizeof opt_ifname;
-	memcpy(dst, ifc->name, ifnamelen); dst += ifnamelen;
-	if (ifc->vendor_len) {
-		memcpy(dst, &opt_vendor, sizeof opt_vendor); dst += sizeof opt_vendor;
-		memcpy(dst, ifc->vendor_data, ifc->vendor_len); dst += ifc->vendor_len;
+	/* Prefer to build the new headers apart from the client's message,
+	 * so that it is neither moved nor copied when it is sent. */
+	char *l2 = &pkt->raw[pkt->rawoff];
+	unsigned int l2len = pkt->data - l2;
+	char *dst;
+	if (l2len + insert_len <= sizeof pkt->hdrbuf) {
+		memcpy(pkt->hdrbuf, l2, l2len);
+		pkt->hdr = pkt->hdrbuf;
+		pkt->hdrlen = l2len + insert_len;
+		pkt->ip6_hdr = (struct ip6_hdr *)
+		    (pkt->hdr + ((char *)pkt->ip6_hdr - l2));
+		pkt->udphdr = (struct udphdr *)
+		    (pkt->hdr + ((char *)pkt->udphdr - l2));
+		pkt->udphdr->uh_ulen = htons(ntohs(pkt->udphdr->uh_ulen) +
+		    insert_len);
+		pkt->ip6_hdr->ip6_plen = htons(ntohs(pkt->ip6_hdr->ip6_plen) +
+		    insert_len);
+		dst = pkt->hdr + l2len;
+	} else {
+		dst = pkt_insert_udp_data(pkt, 0, insert_len);
+		if (!dst) {
+			plog(PLOG_BIG, ifc, NULL, pkt, NULL, 0);
+			stat_inc(ifc, STAT_BIG);
+			return -1;
+		}
 	}
-	memcpy(dst, &opt_msg, sizeof opt_msg); dst += sizeof opt_msg;
+	char *relay = dst;
+
+	/* Patch the template's per-packet fields */
+	struct dhcp_relay_hdr *hdr = (struct dhcp_relay_hdr *)relay;
+	uint16_t msg_len = htons(pkt->datalen);
+	memcpy(relay, ifc->relay_tmpl, insert_len);
+	hdr->hop_count = hop_count;
+	memcpy(hdr->peer_address, &pkt->ip6_hdr->ip6_src, INET6_ADDRLEN);
+	memcpy(relay + insert_len - sizeof msg_len, &msg_len, sizeof msg_len);
 
-	if (verbose_level > 1)
-		dumphex(stderr, "after-wrap", pkt->data, pkt->datalen);
+	/* The payload sum is the relay part's plus the client message's */
+	if (csum_ok) {
+		sum = csum_at(sum, insert_len);
+		sum = csum_add(sum, ifc->relay_sum);
+		sum = csum_add(sum, csum_at(
+		    csum_partial(&hop_count, 1, 0), 1));
+		sum = csum_partial(hdr->peer_address, INET6_ADDRLEN, sum);
+		sum = csum_add(sum, csum_at(
+		    csum_partial(&msg_len, sizeof msg_len, 0), insert_len));
+		pkt_set_payload_sum(pkt, sum);
+	} else
+		pkt->csum_ok = 0;
+	pkt->nopts = -1;	/* data[] is no longer the whole message */
+
+	plog(PLOG_AFTER_WRAP, ifc, NULL, pkt, relay, insert_len);
 	return 0;
 }
 
@@ -138,62 +315,53 @@ dhcp_unwrap(struct pkt *pkt, const struct ifc *ifc,
 	    dhcp->msg_type != DHCP_RELAY_REPL ||
 	    memcmp(dhcp->link_address, &in6addr_any, INET6_ADDRLEN) != 0)
 	{
-		verbose("%s: bad DHCPv6 relay packet from %s\n",
-		    ifc->name, pkt_lladdr(pkt));
+		plog(PLOG_BAD_RELAY, ifc, NULL, pkt, NULL, 0);
+		stat_inc(ifc, STAT_MALFORMED);
 		return -1;
 	}
 
-	/* Initialise with impossible values to detect missing options */
-	unsigned int msg_offset = 0;
-	unsigned int msg_len = 0;
-	ifname[0] = '\0';
-
-	/* Walk the options, looking for INTERFACE-ID and RELAY-MSG */
-	const char *p = pkt->data + 2 + 16 + 16;
-	const char *pmax = pkt->data + pkt->datalen;
-	while (p + sizeof (struct dhcp_opt) < pmax) {
-		/* Easier to copy into a stack var */
-		struct dhcp_opt opt;
-		memcpy(&opt, p, sizeof opt);
-		opt.len = ntohs(opt.len);
-		opt.code = ntohs(opt.code);
-		if (!opt.code) {
-			break;
-		}
-		verbose2("DHCPv6 relay packet option %d, offset %d, length %d\n", opt.code, (int) (p - pkt->data), opt.len);
-		p += sizeof opt; /* Move to data */
-		switch (opt.code) {
-		case OPTION_INTERFACE_ID:
-			/* Extract the interface name */
-			if (opt.len > IFNAMSIZ) {
-				warnx("%s: oversized interface-id from %s",
-				    ifc->name, pkt_lladdr(pkt));
-				return -1;
-			}
-			memset(ifname, 0, IFNAMSIZ);
-			memcpy(ifname, p, opt.len);
-			break;
-		case OPTION_RELAY_MSG:
-			msg_offset = p - pkt->data;
-			msg_len = opt.len;
-			break;
-		/* Ignore other options */
-		}
-		p += opt.len;
+	/* Look up INTERFACE-ID and RELAY-MSG; the index has checked
+	 * that they lie within the message */
+	const struct pkt_opt *id = dhcp_opt(pkt, 0, OPTION_INTERFACE_ID);
+	if (id && id->len > IFNAMSIZ) {
+		plog(PLOG_BAD_IFID, ifc, NULL, pkt, NULL, 0);
+		stat_inc(ifc, STAT_MALFORMED);
+		return -1;
 	}
 	/* If any required options were missing, its a fail */
-	if (!msg_offset || !ifname[0]) {
-		warnx("%s: missing relay options from %s",
-		    ifc->name, pkt_lladdr(pkt));
+	if (!id || !id->len || pkt->nmsgs < 2) {
+		plog(PLOG_NO_OPTS, ifc, NULL, pkt, NULL, 0);
+		stat_inc(ifc, STAT_MALFORMED);
 		return -1;
 	}
+	memset(ifname, 0, IFNAMSIZ);
+	memcpy(ifname, pkt->data + id->off, id->len);
+	unsigned int msg_offset = pkt->msg[1].off;
+	unsigned int msg_len = pkt->msg[1].len;
+
+	/* Work out the relayed message's checksum by removing the
+	 * wrapper from the sum of the whole payload */
+	int csum_ok = pkt->csum_ok;
+	uint32_t sum = 0;
+	if (csum_ok) {
+		unsigned int end = msg_offset + msg_len;
+		sum = csum_sub(pkt_payload_sum(pkt),
+		    csum_partial(pkt->data, msg_offset, 0));
+		sum = csum_sub(sum, csum_at(csum_partial(pkt->data + end,
+		    pkt->datalen - end, 0), end));
+		sum = csum_at(sum, msg_offset);
+	}
 
 	/* Copy the peer-address into the ipv6 dst field */
 	memcpy(&pkt->ip6_hdr->ip6_dst, dhcp->peer_address, INET6_ADDRLEN);
 
 	/* Remove the wrapper */
+	int nopts = pkt->nopts;
 	pkt_insert_udp_data(pkt, msg_offset, -msg_offset);
 	if (pkt->datalen > msg_len)
 		pkt_insert_udp_data(pkt, pkt->datalen, -(pkt->datalen - msg_len));
+	if (csum_ok)
+		pkt_set_payload_sum(pkt, sum);
+	dhcp_index_unwrap(pkt, nopts);
 	return 0;
 }
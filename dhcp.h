@@ -1,8 +1,42 @@
 #include <net/if.h>
 
 struct ifc;
+
+/* DHCPv6 message types the relay looks for */
+#define DHCP_ADVERTISE    2
+#define DHCP_REPLY        7
+#define DHCP_RECONFIGURE 10
+#define DHCP_RELAY_FORW  12
+#define DHCP_RELAY_REPL  13
 struct pkt;
 
+/* Compiles ifc's RELAY-FORW template (see struct ifc).
+ * Returns 0 on success, -1 on error. */
+int dhcp_relay_template(struct ifc *ifc);
+
+/* Records a client's message in the calling thread's set of those
+ * seen (-d), unless it comes from a relay or is not a client's.
+ * Returns 1 if it is a retransmission to drop, having counted it,
+ * else 0. */
+int dhcp_dup(const struct pkt *pkt, const struct ifc *ifc);
+
 int dhcp_wrap(struct pkt *pkt, const struct ifc *ifc);
 int dhcp_unwrap(struct pkt *pkt, const struct ifc *ifc,
         char ifname[IFNAMSIZ]);
+
+/* Indexes the options of pkt's DHCPv6 message and of the messages
+ * nested in its RELAY_MSG options, in one pass over their headers,
+ * unless it is already indexed (see struct pkt). Options that run past
+ * their message end it, and are not indexed.
+ * Returns the number of messages indexed. */
+unsigned int dhcp_index(struct pkt *pkt);
+
+/* Finds the first option code in the message at depth in the index.
+ * Returns NULL if there is none. */
+const struct pkt_opt *dhcp_opt(struct pkt *pkt, unsigned int depth,
+	unsigned int code);
+
+/* Finds the client's message (of at least 4 bytes), inside any
+ * RELAY-FORW or RELAY-REPL wrappers, and sets *depth to its depth.
+ * Returns NULL if there is none. */
+const char *dhcp_client_msg(struct pkt *pkt, unsigned int *depth);
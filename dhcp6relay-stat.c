@@ -0,0 +1,222 @@
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+
+/*
+ * Shows the rates of the counters in a dhcp6relay stats file (-S),
+ * and percentiles of the relay latency, refreshing like top(1).
+ */
+
+/* Maps a stats file read-only */
+static const struct stats_hdr *
+stats_map(const char *path)
+{
+	struct stats_hdr *h;
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if (fd == -1)
+		err(1, "%s", path);
+	if (fstat(fd, &st) == -1)
+		err(1, "%s", path);
+	if ((size_t)st.st_size < sizeof *h)
+		errx(1, "%s: too short", path);
+	h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (h == MAP_FAILED)
+		err(1, "%s: mmap", path);
+	close(fd);
+	if (h->magic != STATS_MAGIC || h->version != STATS_VERSION ||
+	    h->nstats != STAT_MAX || h->nbuckets != HIST_BUCKETS ||
+	    h->size > (uint64_t)st.st_size)
+		errx(1, "%s: not a dhcp6relay stats file", path);
+	return h;
+}
+
+/* Number of counters and histogram buckets in each worker's copy */
+#define NVALUES(h)	((h)->nifc * (STAT_MAX + DIR_MAX * HIST_BUCKETS))
+
+/* Adds up the workers' counters into sum[nifc][STAT_MAX], followed by
+ * their histograms, [nifc][DIR_MAX][HIST_BUCKETS] */
+static void
+stats_sum(const struct stats_hdr *h, uint64_t *sum)
+{
+	memset(sum, 0, NVALUES(h) * sizeof *sum);
+	for (unsigned int w = 0; w < h->nworkers; w++) {
+		/* The histograms follow the counters */
+		const uint64_t *c = stats_counters(h, w);
+		for (unsigned int k = 0; k < NVALUES(h); k++)
+			sum[k] += __atomic_load_n(&c[k], __ATOMIC_RELAXED);
+	}
+}
+
+/* Returns the latency in us below which a fraction q of the n
+ * samples in the histogram cur - prev fall (rounded up to the
+ * bucket's upper bound) */
+static double
+percentile(const uint64_t *cur, const uint64_t *prev, uint64_t n, double q)
+{
+	uint64_t seen = 0;
+	unsigned int b;
+
+	for (b = 0; b < HIST_BUCKETS - 1; b++) {
+		seen += cur[b] - prev[b];
+		if (seen >= q * n)
+			break;
+	}
+	return hist_value(b + (b < HIST_BUCKETS - 1)) / 1e3;
+}
+
+/* Prints the latency percentiles of each interface and direction
+ * with samples in cur - prev */
+static void
+show_latency(const struct stats_hdr *h, const uint64_t *cur,
+	const uint64_t *prev)
+{
+	static const char *const dirs[DIR_MAX] = { "c->s", "s->c" };
+	static const double q[] = { .5, .9, .99, .999, 1 };
+	size_t base = h->nifc * STAT_MAX;
+
+	printf("\n%-*s %4s %10s %10s %10s %10s %10s %10s (us)\n",
+	    IFNAMSIZ, "latency", "dir", "samples", "p50", "p90", "p99",
+	    "p99.9", "max");
+	for (unsigned int i = 0; i < h->nifc; i++)
+		for (unsigned int d = 0; d < DIR_MAX; d++) {
+			size_t off = base + (i * DIR_MAX + d) * HIST_BUCKETS;
+			uint64_t n = 0;
+			for (unsigned int b = 0; b < HIST_BUCKETS; b++)
+				n += cur[off + b] - prev[off + b];
+			if (!n)
+				continue;
+			printf("%-*.*s %4s %10llu", IFNAMSIZ, IFNAMSIZ,
+			    stats_ifname(h, i), dirs[d],
+			    (unsigned long long)n);
+			for (unsigned int k = 0; k < sizeof q / sizeof q[0]; k++)
+				printf(" %10.1f", percentile(&cur[off],
+				    &prev[off], n, q[k]));
+			putchar('\n');
+		}
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Prints each interface's counters, as rates per second over secs,
+ * or as totals if secs is 0. */
+static void
+show(const struct stats_hdr *h, const uint64_t *cur, const uint64_t *prev,
+	double secs)
+{
+	printf("%-*s %10s %10s %10s %10s %10s %s\n", IFNAMSIZ, "interface",
+	    stat_names[STAT_RX], stat_names[STAT_RELAYED],
+	    stat_names[STAT_TX], stat_names[STAT_TX_ERR], "dropped",
+	    "drop reasons");
+	for (unsigned int i = 0; i < h->nifc; i++) {
+		const uint64_t *c = &cur[i * STAT_MAX];
+		const uint64_t *p = &prev[i * STAT_MAX];
+		double rate[STAT_MAX], dropped = 0;
+
+		for (unsigned int s = 0; s < STAT_MAX; s++) {
+			rate[s] = secs ? (c[s] - p[s]) / secs : c[s];
+			if (s >= STAT_DROP_FIRST)
+				dropped += rate[s];
+		}
+		printf("%-*.*s %10.*f %10.*f %10.*f %10.*f %10.*f",
+		    IFNAMSIZ, IFNAMSIZ, stats_ifname(h, i),
+		    secs ? 1 : 0, rate[STAT_RX],
+		    secs ? 1 : 0, rate[STAT_RELAYED],
+		    secs ? 1 : 0, rate[STAT_TX],
+		    secs ? 1 : 0, rate[STAT_TX_ERR],
+		    secs ? 1 : 0, dropped);
+		for (unsigned int s = STAT_DROP_FIRST; s < STAT_MAX; s++)
+			if (rate[s])
+				printf(" %s=%.*f", stat_names[s],
+				    secs ? 1 : 0, rate[s]);
+		putchar('\n');
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *path = "/run/dhcp6relay.stats";
+	double interval = 1;
+	long count = -1;
+	int error = 0;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "i:n:")) != -1)
+		switch (ch) {
+		case 'i':
+			interval = strtod(optarg, NULL);
+			if (interval <= 0) {
+				error = 1;
+				warnx("-i: expected interval in seconds");
+			}
+			break;
+		case 'n':
+			count = strtol(optarg, NULL, 0);
+			break;
+		default:
+			error = 1;
+		}
+	if (optind < argc)
+		path = argv[optind++];
+	if (optind != argc)
+		error = 1;
+	if (error) {
+		fprintf(stderr, "usage: %s [-i interval] [-n count]"
+		    " [stats-file]\n", argv[0]);
+		exit(2);
+	}
+
+	const struct stats_hdr *h = stats_map(path);
+	size_t size = NVALUES(h) * sizeof (uint64_t);
+	uint64_t *cur = malloc(size), *prev = malloc(size);
+	if (!cur || !prev)
+		err(1, "malloc");
+	int tty = isatty(STDOUT_FILENO);
+
+	/* The totals first, then rates every interval */
+	stats_sum(h, cur);
+	printf("%s: pid %u, %u workers, totals\n", path, h->pid,
+	    h->nworkers);
+	show(h, cur, cur, 0);
+	memset(prev, 0, size);
+	show_latency(h, cur, prev);
+	for (long n = 0; count == -1 || n < count; n++) {
+		double t0 = now();
+		memcpy(prev, cur, size);
+		struct timespec ts = {
+			.tv_sec = interval,
+			.tv_nsec = (interval - (long)interval) * 1e9
+		};
+		nanosleep(&ts, NULL);
+		stats_sum(h, cur);
+		if (tty)
+			fputs("\033[H\033[2J", stdout);	/* Clear screen */
+		else
+			putchar('\n');
+		printf("%s: pid %u, %u workers, per second\n", path, h->pid,
+		    h->nworkers);
+		show(h, cur, prev, now() - t0);
+		show_latency(h, cur, prev);
+		fflush(stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,874 @@
+#include <err.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>	/* XDP_FLAGS_SKB_MODE */
+#include <netinet/in.h>
+#include <sys/syscall.h>
+
+#include "csum.h"
+#include "dedup.h"
+#include "dhcp.h"
+#include "fast.h"
+#include "ifc.h"
+#include "limit.h"
+#include "policy.h"
+#include "verbose.h"
+
+#define OPTION_RELAY_MSG	 9
+#define OPTION_INTERFACE_ID	18
+
+int fast_path;
+
+/* Offsets within an untagged ethernet frame */
+#define OFF_TYPE	12
+#define OFF_PLEN	(ETH_HLEN + 4)
+#define OFF_NXT		(ETH_HLEN + 6)
+#define OFF_IP6_SRC	(ETH_HLEN + 8)
+#define OFF_IP6_DST	(ETH_HLEN + 24)
+#define OFF_UDP		(ETH_HLEN + 40)
+#define OFF_UDP_DPORT	(OFF_UDP + 2)
+#define OFF_UDP_LEN	(OFF_UDP + 4)
+#define OFF_UDP_SUM	(OFF_UDP + 6)
+#define OFF_MSG		(OFF_UDP + 8)		/* msg-type */
+#define OFF_LINK_ADDR	(OFF_MSG + 2)
+#define OFF_PEER_ADDR	(OFF_MSG + 18)
+#define OFF_OPT		(OFF_MSG + 34)		/* A relay's first option */
+
+/* The largest IPv6 packet relayed in the kernel */
+#define FAST_MTU	1500
+
+/* The longest relay template compiled into a program */
+#define FAST_RELAY_MAX	128
+
+#define FAST_INSN_MAX	1024
+
+/* Jump targets. Jumps to a label are patched where it is placed, so
+ * a label can be placed again for the jumps after it. */
+enum { PASS, ABORT, KEY_DONE, EVEN, NLABELS };
+#define LABEL(l)	(0x7f00 + (l))
+
+struct prog {
+	struct bpf_insn insn[FAST_INSN_MAX];
+	unsigned int len;
+};
+
+/* Where the replies for a client interface go */
+struct fast_dest {
+	uint32_t ifindex;
+	struct in6_addr src;	/* The interface's address, to send from */
+};
+
+/* The program attached to an interface */
+struct fast_link {
+	unsigned int ifindex;
+	int link_fd;		/* Attaches the program until closed, or -1 */
+	struct bpf_insn *insn;	/* The program, or the one that failed */
+	unsigned int len;
+};
+static struct fast_link *links;		/* By interface position */
+static unsigned int nlinks;
+static int count_fd = -1;	/* ARRAY of frames relayed, by position */
+static int client_fd = -1;	/* HASH from interface-ID to fast_dest */
+static struct prog test_prog;	/* Loaded by fast_test() */
+static int test_fd = -1;
+
+static int
+sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(SYS_bpf, cmd, attr, sizeof *attr);
+}
+
+static void
+emit(struct prog *p, uint8_t code, uint8_t dst, uint8_t src, int16_t off,
+	int32_t imm)
+{
+	if (p->len < FAST_INSN_MAX)
+		p->insn[p->len] = (struct bpf_insn){ .code = code,
+		    .dst_reg = dst, .src_reg = src, .off = off, .imm = imm };
+	p->len++;
+}
+
+#define MOV(p, d, s)	emit(p, BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOVI(p, d, k)	emit(p, BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, k)
+#define ADD(p, d, s)	emit(p, BPF_ALU64 | BPF_ADD | BPF_X, d, s, 0, 0)
+#define ALUI(p, op, d, k) emit(p, BPF_ALU64 | (op) | BPF_K, d, 0, 0, k)
+#define ADDI(p, d, k)	ALUI(p, BPF_ADD, d, k)
+#define LDX(p, size, d, s, off) emit(p, BPF_LDX | (size) | BPF_MEM, d, s, off, 0)
+#define STX(p, size, d, off, s) emit(p, BPF_STX | (size) | BPF_MEM, d, s, off, 0)
+#define ST(p, size, d, off, k)	emit(p, BPF_ST | (size) | BPF_MEM, d, 0, off, k)
+/* Converts d's low halfword between network and host order */
+#define BSWAP16(p, d)	emit(p, BPF_ALU | BPF_END | BPF_TO_BE, d, 0, 0, 16)
+/* Jumps to label l if d op k, or d op s */
+#define JMPI(p, op, d, k, l) emit(p, BPF_JMP | (op) | BPF_K, d, 0, LABEL(l), k)
+#define JMP(p, op, d, s, l)  emit(p, BPF_JMP | (op) | BPF_X, d, s, LABEL(l), 0)
+#define JMP32I(p, op, d, k, l) emit(p, BPF_JMP32 | (op) | BPF_K, d, 0, LABEL(l), k)
+#define CALL(p, f)	emit(p, BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT(p)		emit(p, BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/* Points the jumps so far to label l at the next instruction */
+static void
+label(struct prog *p, int l)
+{
+	for (unsigned int pc = 0; pc < p->len && pc < FAST_INSN_MAX; pc++) {
+		struct bpf_insn *in = &p->insn[pc];
+		unsigned int class = BPF_CLASS(in->code);
+		if ((class == BPF_JMP || class == BPF_JMP32) &&
+		    in->off == LABEL(l))
+			in->off = p->len - (pc + 1);
+	}
+}
+
+/* d = the map in fd */
+static void
+ld_map(struct prog *p, int d, int fd)
+{
+	emit(p, BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd);
+	emit(p, 0, 0, 0, 0, 0);
+}
+
+/* r2 = data, r3 = data_end, from the context in r6 */
+static void
+load_data(struct prog *p)
+{
+	LDX(p, BPF_W, 2, 6, offsetof(struct xdp_md, data));
+	LDX(p, BPF_W, 3, 6, offsetof(struct xdp_md, data_end));
+}
+
+/* Jumps to l unless the frame has at least len bytes */
+static void
+need_len(struct prog *p, int len, int l)
+{
+	MOV(p, 4, 2);
+	ADDI(p, 4, len);
+	JMP(p, BPF_JGT, 4, 3, l);
+}
+
+/* Passes the frame unless the IPv6 address at off is addr */
+static void
+need_addr(struct prog *p, int off, const struct in6_addr *addr)
+{
+	for (int i = 0; i < 4; i++) {
+		int32_t w;
+		memcpy(&w, &addr->s6_addr32[i], sizeof w);
+		LDX(p, BPF_W, 4, 2, off + 4 * i);
+		JMP32I(p, BPF_JNE, 4, w, PASS);
+	}
+}
+
+/* Passes the frame unless the IPv6 address at off is in fe80::/10 */
+static void
+need_linklocal(struct prog *p, int off)
+{
+	uint32_t mask = htonl(0xffc00000), ll = htonl(0xfe800000);
+
+	LDX(p, BPF_W, 4, 2, off);
+	emit(p, BPF_ALU | BPF_AND | BPF_K, 4, 0, 0, mask);
+	JMP32I(p, BPF_JNE, 4, ll, PASS);
+}
+
+/* Passes the frame if it came from the MAC address hw, i.e. from us */
+static void
+deny_mac(struct prog *p, const unsigned char *hw)
+{
+	int32_t w;
+	int16_t h;
+
+	memcpy(&w, hw, sizeof w);
+	memcpy(&h, hw + 4, sizeof h);
+	LDX(p, BPF_W, 4, 2, ETH_ALEN);
+	emit(p, BPF_JMP32 | BPF_JNE | BPF_K, 4, 0, 2, w);
+	LDX(p, BPF_H, 4, 2, ETH_ALEN + 4);
+	JMP32I(p, BPF_JEQ, 4, (uint16_t)h, PASS);
+}
+
+/* Checks the ethernet, IPv6 and UDP headers as the interface's socket
+ * filter does (see filter_compile()), up to the addresses, and leaves
+ * the IPv6 and UDP length, which must agree with each other and with
+ * the frame's, in host order in r7 */
+static void
+need_headers(struct prog *p, const struct ifc *ifc, unsigned int max)
+{
+	LDX(p, BPF_H, 4, 2, OFF_TYPE);
+	JMPI(p, BPF_JNE, 4, htons(ETH_P_IPV6), PASS);
+	LDX(p, BPF_B, 4, 2, OFF_NXT);
+	JMPI(p, BPF_JNE, 4, IPPROTO_UDP, PASS);
+	LDX(p, BPF_H, 4, 2, OFF_UDP_DPORT);
+	JMPI(p, BPF_JNE, 4, htons(547), PASS);
+	if (ifc->hwlen == ETH_ALEN)
+		deny_mac(p, ifc->hwaddr);
+
+	LDX(p, BPF_H, 7, 2, OFF_PLEN);
+	BSWAP16(p, 7);
+	LDX(p, BPF_H, 4, 2, OFF_UDP_LEN);
+	BSWAP16(p, 4);
+	JMP(p, BPF_JNE, 4, 7, PASS);
+	JMPI(p, BPF_JLT, 7, 8 + 4, PASS);
+	JMPI(p, BPF_JGT, 7, max, PASS);
+	MOV(p, 5, 2);
+	ADD(p, 5, 7);
+	ADDI(p, 5, OFF_UDP);
+	JMP(p, BPF_JGT, 5, 3, PASS);
+	ADDI(p, 5, 1);
+	JMP(p, BPF_JLE, 5, 3, PASS);	/* Trailing bytes */
+	LDX(p, BPF_H, 4, 2, OFF_UDP_SUM);
+	JMPI(p, BPF_JEQ, 4, 0, PASS);
+}
+
+/* Adds the n halfwords at s + off to d, as csum_partial() does */
+static void
+sum_words(struct prog *p, int d, int s, int off, int n)
+{
+	for (int k = 0; k < n; k++) {
+		LDX(p, BPF_H, 4, s, off + 2 * k);
+		ADD(p, d, 4);
+	}
+}
+
+/* Folds the partial sum in d into 16 bits, as csum_fold(), using t */
+static void
+fold(struct prog *p, int d, int t)
+{
+	for (int k = 0; k < 2; k++) {
+		MOV(p, t, d);
+		ALUI(p, BPF_RSH, t, 16);
+		ALUI(p, BPF_AND, d, 0xffff);
+		ADD(p, d, t);
+	}
+}
+
+/* Swaps the bytes of the folded sum in d, as csum_at() at an odd
+ * offset, using t */
+static void
+swap_lanes(struct prog *p, int d, int t)
+{
+	MOV(p, t, d);
+	ALUI(p, BPF_RSH, t, 8);
+	ALUI(p, BPF_LSH, d, 8);
+	emit(p, BPF_ALU64 | BPF_OR | BPF_X, d, t, 0, 0);
+	ALUI(p, BPF_AND, d, 0xffff);
+}
+
+/* Turns the partial sum in d into a checksum field, as csum_finish() */
+static void
+finish(struct prog *p, int d, int t)
+{
+	fold(p, d, t);
+	ALUI(p, BPF_XOR, d, 0xffff);
+	emit(p, BPF_JMP | BPF_JNE | BPF_K, d, 0, 1, 0);
+	MOVI(p, d, 0xffff);
+}
+
+/* Counts the frame for interface position num, and redirects it to
+ * the interface whose index is in register reg, or is ifindex */
+static void
+redirect(struct prog *p, unsigned int num, int reg, unsigned int ifindex)
+{
+	ST(p, BPF_W, 10, -20, num);
+	ld_map(p, 1, count_fd);
+	MOV(p, 2, 10);
+	ADDI(p, 2, -20);
+	CALL(p, BPF_FUNC_map_lookup_elem);
+	emit(p, BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 2, 0);
+	MOVI(p, 1, 1);
+	emit(p, BPF_STX | BPF_DW | BPF_ATOMIC, 0, 1, 0, BPF_ADD);
+	if (reg != -1)
+		MOV(p, 1, reg);
+	else
+		MOVI(p, 1, ifindex);
+	MOVI(p, 2, 0);
+	CALL(p, BPF_FUNC_redirect);
+	EXIT(p);
+}
+
+/* Wraps client c's messages for server s, as dhcp_wrap() does those
+ * that are not from another relay, and sends them from s's address as
+ * relay_send() does. The message's own sum is what the old checksum
+ * leaves over from the headers, so the new checksum follows from the
+ * headers and the template without summing it. */
+static void
+compile_wrap(struct prog *p, const struct ifc *c, const struct ifc *s)
+{
+	static const struct in6_addr all_dhcp = {{{
+	    0xff,2,0,0, 0,0,0,0, 0,0,0,0, 0,1,0,2 }}};
+	unsigned int len = c->relay_len;
+	int odd = len & 1;
+
+	/* r6 = ctx, r7 = UDP length, r9 = new checksum */
+	MOV(p, 6, 1);
+	load_data(p);
+	need_len(p, OFF_MSG + 4, PASS);
+	need_headers(p, c, FAST_MTU - 40 - len);
+	need_addr(p, OFF_IP6_DST, &all_dhcp);
+	LDX(p, BPF_B, 4, 2, OFF_MSG);
+	JMPI(p, BPF_JEQ, 4, DHCP_ADVERTISE, PASS);
+	JMPI(p, BPF_JEQ, 4, DHCP_REPLY, PASS);
+	JMPI(p, BPF_JEQ, 4, DHCP_RECONFIGURE, PASS);
+	JMPI(p, BPF_JEQ, 4, DHCP_RELAY_FORW, PASS);
+	JMPI(p, BPF_JEQ, 4, DHCP_RELAY_REPL, PASS);
+
+	/* r9 = what both checksums cover: the destination, the ports and
+	 * the next header; r5 = the source address, the peer-address */
+	MOVI(p, 5, 0);
+	sum_words(p, 5, 2, OFF_IP6_SRC, 8);
+	MOVI(p, 9, htons(IPPROTO_UDP));
+	sum_words(p, 9, 2, OFF_IP6_DST, 8);
+	sum_words(p, 9, 2, OFF_UDP, 2);
+	/* r1 = the message's sum, moved into place */
+	MOV(p, 1, 9);
+	ADD(p, 1, 5);
+	sum_words(p, 1, 2, OFF_UDP_LEN, 1);
+	sum_words(p, 1, 2, OFF_UDP_LEN, 2);
+	fold(p, 1, 4);
+	ALUI(p, BPF_XOR, 1, 0xffff);
+	if (odd)
+		swap_lanes(p, 1, 4);
+	/* r9 += the new source, the message, the relay header and
+	 * options, and the lengths */
+	ADDI(p, 9, csum_fold(csum_partial(&s->addr, sizeof s->addr, 0)));
+	ADD(p, 9, 1);
+	ADD(p, 9, 5);
+	ADDI(p, 9, csum_fold(c->relay_sum));
+	MOV(p, 4, 7);
+	ADDI(p, 4, -8);
+	BSWAP16(p, 4);
+	if (odd)
+		swap_lanes(p, 4, 1);
+	ADD(p, 9, 4);
+	MOV(p, 4, 7);
+	ADDI(p, 4, len);
+	BSWAP16(p, 4);
+	ADD(p, 9, 4);
+	ADD(p, 9, 4);
+	finish(p, 9, 4);
+
+	/* Make room in front, and move the headers into it */
+	MOV(p, 1, 6);
+	MOVI(p, 2, -(int)len);
+	CALL(p, BPF_FUNC_xdp_adjust_head);
+	JMPI(p, BPF_JNE, 0, 0, PASS);
+	load_data(p);
+	need_len(p, OFF_MSG + len, ABORT);
+	int size = odd ? BPF_B : BPF_H;
+	for (int k = 0; k < OFF_MSG; k += odd ? 1 : 2) {
+		LDX(p, size, 4, 2, len + k);
+		STX(p, size, 2, k, 4);
+	}
+
+	/* Fill in the template, then patch it */
+	for (unsigned int k = 0; k < len; k += 2) {
+		uint16_t h = 0;
+		memcpy(&h, c->relay_tmpl + k, k + 1 < len ? 2 : 1);
+		if (k + 1 < len)
+			ST(p, BPF_H, 2, OFF_MSG + k, h);
+		else
+			ST(p, BPF_B, 2, OFF_MSG + k, c->relay_tmpl[k]);
+	}
+	for (int k = 0; k < 16; k += 2) {
+		LDX(p, BPF_H, 4, 2, OFF_IP6_SRC + k);
+		STX(p, BPF_H, 2, OFF_PEER_ADDR + k, 4);
+	}
+	for (int k = 0; k < 16; k += 2) {
+		uint16_t h;
+		memcpy(&h, &s->addr.s6_addr[k], sizeof h);
+		ST(p, BPF_H, 2, OFF_IP6_SRC + k, h);
+	}
+	MOV(p, 4, 7);
+	ADDI(p, 4, -8);
+	MOV(p, 5, 4);
+	ALUI(p, BPF_RSH, 5, 8);
+	STX(p, BPF_B, 2, OFF_MSG + len - 2, 5);
+	STX(p, BPF_B, 2, OFF_MSG + len - 1, 4);
+	MOV(p, 4, 7);
+	ADDI(p, 4, len);
+	BSWAP16(p, 4);
+	STX(p, BPF_H, 2, OFF_PLEN, 4);
+	STX(p, BPF_H, 2, OFF_UDP_LEN, 4);
+	STX(p, BPF_H, 2, OFF_UDP_SUM, 9);
+	redirect(p, c->num, -1, s->index);
+}
+
+/* Unwraps server s's RELAY-REPLs that hold just an INTERFACE-ID and
+ * then the RELAY_MSG, as dhcp_unwrap() does, for the client interfaces
+ * in client_fd, and sends them from the client interface's address.
+ * The message's sum is what the old checksum leaves over from the
+ * headers and the wrapper. */
+static void
+compile_unwrap(struct prog *p, const struct ifc *s)
+{
+	/* r6 = ctx, r7 = the client's ifindex, r8 = the RELAY_MSG length,
+	 * r9 = the interface-ID length */
+	MOV(p, 6, 1);
+	load_data(p);
+	need_len(p, OFF_OPT + 4, PASS);
+	need_headers(p, s, FAST_MTU - 40);
+	need_linklocal(p, OFF_IP6_SRC);
+	if (IN6_IS_ADDR_UNSPECIFIED(&s->addr))
+		need_linklocal(p, OFF_IP6_DST);
+	else
+		need_addr(p, OFF_IP6_DST, &s->addr);
+	LDX(p, BPF_B, 4, 2, OFF_MSG);
+	JMPI(p, BPF_JNE, 4, DHCP_RELAY_REPL, PASS);
+	for (int k = 0; k < 16; k += 2) {
+		LDX(p, BPF_H, 4, 2, OFF_LINK_ADDR + k);
+		JMPI(p, BPF_JNE, 4, 0, PASS);
+	}
+	LDX(p, BPF_H, 4, 2, OFF_OPT);
+	JMPI(p, BPF_JNE, 4, htons(OPTION_INTERFACE_ID), PASS);
+	LDX(p, BPF_H, 9, 2, OFF_OPT + 2);
+	BSWAP16(p, 9);
+	JMPI(p, BPF_JEQ, 9, 0, PASS);
+	JMPI(p, BPF_JGT, 9, IFNAMSIZ, PASS);
+
+	/* Look up the interface-ID as a name, NUL-padded on the stack */
+	ST(p, BPF_DW, 10, -16, 0);
+	ST(p, BPF_DW, 10, -8, 0);
+	for (int k = 0; k < IFNAMSIZ; k++) {
+		JMPI(p, BPF_JLE, 9, k, KEY_DONE);
+		need_len(p, OFF_OPT + 4 + k + 1, PASS);
+		LDX(p, BPF_B, 4, 2, OFF_OPT + 4 + k);
+		STX(p, BPF_B, 10, -16 + k, 4);
+	}
+	label(p, KEY_DONE);
+	ld_map(p, 1, client_fd);
+	MOV(p, 2, 10);
+	ADDI(p, 2, -16);
+	CALL(p, BPF_FUNC_map_lookup_elem);
+	JMPI(p, BPF_JEQ, 0, 0, PASS);
+	LDX(p, BPF_W, 7, 0, offsetof(struct fast_dest, ifindex));
+	/* The new source address goes on the stack, below the key */
+	for (int k = 0; k < 16; k += 4) {
+		LDX(p, BPF_W, 4, 0, offsetof(struct fast_dest, src) + k);
+		STX(p, BPF_W, 10, -40 + k, 4);
+	}
+
+	/* The RELAY_MSG follows, and runs to the end of the message */
+	load_data(p);
+	need_len(p, OFF_OPT + 4, PASS);
+	MOV(p, 4, 2);
+	ADD(p, 4, 9);
+	MOV(p, 5, 4);
+	ADDI(p, 5, OFF_OPT + 8);
+	JMP(p, BPF_JGT, 5, 3, PASS);
+	LDX(p, BPF_B, 5, 4, OFF_OPT + 4);
+	JMPI(p, BPF_JNE, 5, 0, PASS);
+	LDX(p, BPF_B, 5, 4, OFF_OPT + 5);
+	JMPI(p, BPF_JNE, 5, OPTION_RELAY_MSG, PASS);
+	LDX(p, BPF_B, 8, 4, OFF_OPT + 6);
+	ALUI(p, BPF_LSH, 8, 8);
+	LDX(p, BPF_B, 5, 4, OFF_OPT + 7);
+	emit(p, BPF_ALU64 | BPF_OR | BPF_X, 8, 5, 0, 0);
+	MOV(p, 5, 8);
+	ADD(p, 5, 9);
+	ADDI(p, 5, OFF_OPT + 8 - OFF_UDP);
+	LDX(p, BPF_H, 1, 2, OFF_UDP_LEN);
+	BSWAP16(p, 1);
+	JMP(p, BPF_JNE, 5, 1, PASS);
+
+	/* r0 = what both checksums cover: the ports and the next header;
+	 * r5 = the peer-address, the new destination */
+	MOVI(p, 0, htons(IPPROTO_UDP));
+	sum_words(p, 0, 2, OFF_UDP, 2);
+	MOVI(p, 5, 0);
+	sum_words(p, 5, 2, OFF_PEER_ADDR, 8);
+	/* r1 = everything else the old checksum covers but the message:
+	 * the addresses, the lengths, the relay header and the options'
+	 * headers and interface-ID, which lies at an even offset */
+	MOV(p, 1, 0);
+	sum_words(p, 1, 2, OFF_IP6_SRC, 8);
+	sum_words(p, 1, 2, OFF_IP6_DST, 8);
+	sum_words(p, 1, 2, OFF_UDP_LEN, 1);
+	sum_words(p, 1, 2, OFF_UDP_LEN, 2);
+	sum_words(p, 1, 2, OFF_MSG, 17);
+	sum_words(p, 1, 2, OFF_OPT, 2);
+	sum_words(p, 1, 10, -16, IFNAMSIZ / 2);
+	MOV(p, 4, 8);
+	BSWAP16(p, 4);
+	ADDI(p, 4, htons(OPTION_RELAY_MSG));
+	/* r3 = 0 if the interface-ID's length is even */
+	MOV(p, 3, 9);
+	ALUI(p, BPF_AND, 3, 1);
+	JMPI(p, BPF_JEQ, 3, 0, EVEN);
+	fold(p, 4, 3);
+	swap_lanes(p, 4, 3);
+	label(p, EVEN);
+	ADD(p, 1, 4);
+	/* r1 = the message's sum, moved into place */
+	fold(p, 1, 3);
+	ALUI(p, BPF_XOR, 1, 0xffff);
+	MOV(p, 3, 9);
+	ALUI(p, BPF_AND, 3, 1);
+	JMPI(p, BPF_JEQ, 3, 0, EVEN);
+	swap_lanes(p, 1, 3);
+	label(p, EVEN);
+	/* r0 = the new checksum */
+	sum_words(p, 0, 10, -40, 8);
+	ADD(p, 0, 5);
+	ADD(p, 0, 1);
+	MOV(p, 4, 8);
+	ADDI(p, 4, 8);
+	BSWAP16(p, 4);
+	ADD(p, 0, 4);
+	ADD(p, 0, 4);
+	finish(p, 0, 3);
+
+	/* Rewrite the headers, then move them up to the message */
+	load_data(p);
+	need_len(p, OFF_OPT + 4, PASS);
+	MOV(p, 4, 2);
+	ADD(p, 4, 9);
+	MOV(p, 5, 4);
+	ADDI(p, 5, OFF_OPT + 8);
+	JMP(p, BPF_JGT, 5, 3, PASS);
+	for (int k = 0; k < 16; k += 2) {
+		LDX(p, BPF_H, 5, 2, OFF_PEER_ADDR + k);
+		STX(p, BPF_H, 2, OFF_IP6_DST + k, 5);
+		LDX(p, BPF_H, 5, 10, -40 + k);
+		STX(p, BPF_H, 2, OFF_IP6_SRC + k, 5);
+	}
+	MOV(p, 5, 8);
+	ADDI(p, 5, 8);
+	BSWAP16(p, 5);
+	STX(p, BPF_H, 2, OFF_PLEN, 5);
+	STX(p, BPF_H, 2, OFF_UDP_LEN, 5);
+	STX(p, BPF_H, 2, OFF_UDP_SUM, 0);
+	for (int k = OFF_MSG - 1; k >= 0; k--) {
+		LDX(p, BPF_B, 5, 2, k);
+		STX(p, BPF_B, 4, OFF_OPT + 8 - OFF_MSG + k, 5);
+	}
+	MOV(p, 1, 6);
+	MOV(p, 2, 9);
+	ADDI(p, 2, OFF_OPT + 8 - OFF_MSG);
+	CALL(p, BPF_FUNC_xdp_adjust_head);
+	JMPI(p, BPF_JNE, 0, 0, ABORT);
+	redirect(p, s->num, 7, 0);
+}
+
+/* Returns the position of the only SERVER interface, or -1 */
+static int
+fast_server(const struct ifc *ifc, unsigned int nifc)
+{
+	int s = -1;
+
+	for (unsigned int i = 0; i < nifc; i++)
+		if (ifc[i].side == SERVER) {
+			if (s != -1)
+				return -1;
+			s = i;
+		}
+	return s;
+}
+
+/* Whether client interface i is one a RELAY-REPL may be redirected to */
+static int
+fast_client(const struct ifc *ifc, unsigned int i)
+{
+	return ifc[i].side == CLIENT && !ifc[i].vlan_n && ifc[i].index;
+}
+
+/* Generates interface i's program.
+ * Returns 0 on success, -1 if it can have none (errno ENOENT) or the
+ * program is too long (E2BIG). */
+static int
+fast_compile(struct prog *p, const struct ifc *ifc, unsigned int nifc,
+	unsigned int i)
+{
+	const struct ifc *c = &ifc[i];
+	int s;
+
+	p->len = 0;
+	errno = ENOENT;
+	if (!c->index || c->vlan_n || c->xdp)
+		return -1;
+	switch (c->side) {
+	case CLIENT:
+		s = fast_server(ifc, nifc);
+		if (s == -1 || !ifc[s].index || c->limit_rate || limit_rate ||
+		    dedup_window || c->relay_len > FAST_RELAY_MAX)
+			return -1;
+		compile_wrap(p, c, &ifc[s]);
+		break;
+	case SERVER:
+		if (policy_mode != POLICY_ALL)
+			return -1;
+		compile_unwrap(p, c);
+		break;
+	default:
+		return -1;
+	}
+
+	label(p, PASS);
+	MOVI(p, 0, XDP_PASS);
+	EXIT(p);
+	label(p, ABORT);
+	MOVI(p, 0, XDP_ABORTED);
+	EXIT(p);
+	if (p->len > FAST_INSN_MAX) {
+		errno = E2BIG;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+fast_load(const struct prog *p)
+{
+	union bpf_attr attr = {
+		.prog_type = BPF_PROG_TYPE_XDP,
+		.insns = (uintptr_t)p->insn,
+		.insn_cnt = p->len,
+		.license = (uintptr_t)"BSD",
+	};
+	return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+/* Creates the maps the programs share */
+static int
+fast_maps(unsigned int nifc)
+{
+	union bpf_attr attr;
+
+	if (count_fd == -1) {
+		attr = (union bpf_attr) {
+			.map_type = BPF_MAP_TYPE_ARRAY,
+			.key_size = sizeof (uint32_t),
+			.value_size = sizeof (uint64_t),
+			.max_entries = nifc,
+		};
+		if ((count_fd = sys_bpf(BPF_MAP_CREATE, &attr)) == -1)
+			return -1;
+	}
+	if (client_fd == -1) {
+		attr = (union bpf_attr) {
+			.map_type = BPF_MAP_TYPE_HASH,
+			.key_size = IFNAMSIZ,
+			.value_size = sizeof (struct fast_dest),
+			.max_entries = nifc,
+		};
+		if ((client_fd = sys_bpf(BPF_MAP_CREATE, &attr)) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/* Makes the client map name the client interfaces of the table */
+static void
+fast_clients(const struct ifc *ifc, unsigned int nifc)
+{
+	char key[IFNAMSIZ], next[IFNAMSIZ];
+	char stale[nifc][IFNAMSIZ];
+	unsigned int nstale = 0;
+	union bpf_attr attr;
+
+	for (unsigned int i = 0; i < nifc; i++) {
+		if (!fast_client(ifc, i))
+			continue;
+		struct fast_dest dest = {
+			.ifindex = ifc[i].index,
+			.src = ifc[i].addr,
+		};
+		memset(key, 0, sizeof key);
+		strncpy(key, ifc[i].name, sizeof key - 1);
+		attr = (union bpf_attr) {
+			.map_fd = client_fd,
+			.key = (uintptr_t)key,
+			.value = (uintptr_t)&dest,
+		};
+		if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1)
+			warn("%s: fast path", ifc[i].name);
+	}
+
+	/* Forget the interfaces that have gone */
+	attr = (union bpf_attr) {
+		.map_fd = client_fd,
+		.key = 0,
+		.next_key = (uintptr_t)next,
+	};
+	while (nstale < nifc && sys_bpf(BPF_MAP_GET_NEXT_KEY, &attr) == 0) {
+		int i = ifc_index_find(ifc, next, strnlen(next, IFNAMSIZ));
+		if (i == -1 || !fast_client(ifc, i))
+			memcpy(stale[nstale++], next, IFNAMSIZ);
+		memcpy(key, next, sizeof key);
+		attr.key = (uintptr_t)key;
+	}
+	for (unsigned int k = 0; k < nstale; k++) {
+		attr = (union bpf_attr) {
+			.map_fd = client_fd,
+			.key = (uintptr_t)stale[k],
+		};
+		(void) sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+	}
+}
+
+/* Detaches an interface's program */
+static void
+fast_detach(struct fast_link *fl, const struct ifc *ifc)
+{
+	if (fl->link_fd != -1) {
+		close(fl->link_fd);
+		verbose("%s: relaying in userspace\n", ifc->name);
+	}
+	fl->link_fd = -1;
+	free(fl->insn);
+	fl->insn = NULL;
+	fl->len = 0;
+	fl->ifindex = 0;
+}
+
+/* Attaches program p to the interface, in place of any it had */
+static int
+fast_attach(struct fast_link *fl, const struct ifc *ifc, const struct prog *p)
+{
+	int prog_fd = fast_load(p);
+	union bpf_attr attr;
+	int ret;
+
+	if (prog_fd == -1)
+		return -1;
+	if (fl->link_fd != -1 && fl->ifindex == ifc->index) {
+		attr = (union bpf_attr) { .link_update = {
+			.link_fd = fl->link_fd,
+			.new_prog_fd = prog_fd,
+		} };
+		ret = sys_bpf(BPF_LINK_UPDATE, &attr);
+	} else {
+		fast_detach(fl, ifc);
+		attr = (union bpf_attr) { .link_create = {
+			.prog_fd = prog_fd,
+			.target_ifindex = ifc->index,
+			.attach_type = BPF_XDP,
+			.flags = XDP_FLAGS_SKB_MODE,
+		} };
+		ret = fl->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+		if (ret != -1)
+			verbose("%s: relaying in the kernel\n", ifc->name);
+	}
+	int error = errno;
+	close(prog_fd);
+	errno = error;
+	return ret == -1 ? -1 : 0;
+}
+
+void
+fast_update(const struct ifc *ifc, unsigned int nifc)
+{
+	static struct prog p;
+
+	if (!links) {
+		if (!(links = calloc(nifc, sizeof *links))) {
+			warn("fast path");
+			return;
+		}
+		nlinks = nifc;
+		for (unsigned int i = 0; i < nifc; i++)
+			links[i].link_fd = -1;
+	}
+	if (fast_maps(nifc) == -1) {
+		warn("fast path maps");
+		return;
+	}
+	fast_clients(ifc, nifc);
+
+	for (unsigned int i = 0; i < nifc; i++) {
+		struct fast_link *fl = &links[i];
+
+		if (fast_compile(&p, ifc, nifc, i) == -1) {
+			if (errno != ENOENT)
+				warn("%s: fast path", ifc[i].name);
+			fast_detach(fl, &ifc[i]);
+			continue;
+		}
+		/* Unchanged, or failed before */
+		if (fl->ifindex == ifc[i].index && fl->len == p.len &&
+		    memcmp(fl->insn, p.insn, p.len * sizeof *p.insn) == 0)
+			continue;
+		if (fast_attach(fl, &ifc[i], &p) == -1) {
+			warn("%s: fast path", ifc[i].name);
+			fast_detach(fl, &ifc[i]);
+		}
+		/* Remember the program even if it failed, so as not to
+		 * try it again */
+		free(fl->insn);
+		fl->insn = malloc(p.len * sizeof *p.insn);
+		if (fl->insn)
+			memcpy(fl->insn, p.insn, p.len * sizeof *p.insn);
+		fl->len = fl->insn ? p.len : 0;
+		fl->ifindex = ifc[i].index;
+	}
+}
+
+void
+fast_close(const struct ifc *ifc, unsigned int nifc)
+{
+	for (unsigned int i = 0; i < nlinks && i < nifc; i++) {
+		uint64_t count = 0;
+		union bpf_attr attr = {
+			.map_fd = count_fd,
+			.key = (uintptr_t)&i,
+			.value = (uintptr_t)&count,
+		};
+		if (links[i].link_fd != -1 &&
+		    sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr) == 0)
+			verbose("%s: relayed %llu frames in the kernel\n",
+			    ifc[i].name, (unsigned long long)count);
+		fast_detach(&links[i], &ifc[i]);
+	}
+	free(links);
+	links = NULL;
+	nlinks = 0;
+	if (test_fd != -1)
+		close(test_fd);
+	test_fd = -1;
+	if (count_fd != -1)
+		close(count_fd);
+	count_fd = -1;
+	if (client_fd != -1)
+		close(client_fd);
+	client_fd = -1;
+}
+
+int
+fast_test(const struct ifc *ifc, unsigned int nifc, unsigned int i,
+	const void *frame, unsigned int len, void *out, unsigned int *outlen,
+	uint32_t *ns)
+{
+	static struct prog p;
+
+	if (fast_maps(nifc) == -1)
+		return -1;
+	fast_clients(ifc, nifc);
+	if (fast_compile(&p, ifc, nifc, i) == -1)
+		return -1;
+
+	/* Keep the last program, to run it again */
+	if (test_fd == -1 || p.len != test_prog.len ||
+	    memcmp(p.insn, test_prog.insn, p.len * sizeof *p.insn) != 0)
+	{
+		if (test_fd != -1)
+			close(test_fd);
+		test_prog = p;
+		if ((test_fd = fast_load(&p)) == -1)
+			return -1;
+	}
+
+	union bpf_attr attr = { .test = {
+		.prog_fd = test_fd,
+		.data_in = (uintptr_t)frame,
+		.data_size_in = len,
+		.data_out = (uintptr_t)out,
+		.data_size_out = *outlen,
+		.repeat = 1,
+	} };
+	if (sys_bpf(BPF_PROG_TEST_RUN, &attr) == -1)
+		return -1;
+	*outlen = attr.test.data_size_out;
+	*ns = attr.test.duration;
+	return attr.test.retval;
+}
@@ -0,0 +1,53 @@
+/*
+ * The in-kernel fast path (-k). An XDP program on each client
+ * interface wraps the plain client messages that dhcp_wrap() would,
+ * and one on the server interface unwraps the plain RELAY-REPLs that
+ * dhcp_unwrap() would; both fix up the UDP checksum incrementally and
+ * redirect the frame straight to the interface it is for, without it
+ * reaching the relay's sockets. Anything unusual goes on to the
+ * sockets as before, to be relayed or dropped in userspace: frames
+ * from other relays, VLAN trunks and AF_XDP interfaces, RELAY-REPLs
+ * with options other than an INTERFACE-ID before the RELAY_MSG or
+ * for an interface the program does not know, and frames that would
+ * grow past 1500 bytes.
+ *
+ * Each program is generated for its interface, with the relay
+ * template, addresses and destination compiled in, and is replaced
+ * when those change. Client messages are only wrapped in the kernel
+ * when there is exactly one server interface and no client limits
+ * (-l, -L) or deduplication (-d); replies only when no server policy
+ * (-p) keeps state about them. Frames relayed in the kernel are not
+ * checked against their UDP checksum (a bad one stays bad), logged,
+ * captured or counted other than in the totals fast_close() reports.
+ *
+ * The programs run as generic XDP, after the kernel has built a socket
+ * buffer for the frame, so that they can redirect to interfaces whose
+ * drivers do not take XDP frames.
+ */
+
+#include <stdint.h>
+
+struct ifc;
+
+/* Set by -k to relay what it can in the kernel */
+extern int fast_path;
+
+/* Attaches, replaces or detaches the programs of the interfaces in
+ * the table so that they match it. Interfaces that cannot have one
+ * (e.g. without the privilege to load it) are left to userspace,
+ * with a warning. Called again whenever the table changes. */
+void fast_update(const struct ifc *ifc, unsigned int nifc);
+
+/* Detaches all the programs, reporting how many frames each relayed */
+void fast_close(const struct ifc *ifc, unsigned int nifc);
+
+/* Runs the program fast_update() would attach to interface i over one
+ * L2 frame with BPF_PROG_TEST_RUN, so that it can be checked against
+ * dhcp_wrap() and dhcp_unwrap(). The interfaces need not exist, only
+ * have indexes. The frame as it would be sent is put in out[*outlen]
+ * (of size *outlen on entry), and the time the program took in *ns.
+ * Returns the XDP action, or -1 on error (errno ENOENT if interface i
+ * would have no program). */
+int fast_test(const struct ifc *ifc, unsigned int nifc, unsigned int i,
+	const void *frame, unsigned int len, void *out, unsigned int *outlen,
+	uint32_t *ns);
@@ -0,0 +1,167 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <arpa/inet.h> /* ntohl */
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "dhcp.h"
+#include "filter.h"
+#include "ifc.h"
+
+/* Offsets within an untagged ethernet frame. On trunks, those after
+ * the MAC addresses are loaded relative to X, the length of the VLAN
+ * tags left in the frame. */
+#define OFF_SRC_MAC	6
+#define OFF_TYPE	12
+#define OFF_NXT		(ETH_HLEN + 6)
+#define OFF_IP6_SRC	(ETH_HLEN + 8)
+#define OFF_IP6_DST	(ETH_HLEN + 24)
+#define OFF_UDP_DPORT	(ETH_HLEN + 40 + 2)
+#define OFF_MSG_TYPE	(ETH_HLEN + 40 + 8)
+#define OFF_HOP_COUNT	(OFF_MSG_TYPE + 1)
+#define OFF_LINK_ADDR	(OFF_MSG_TYPE + 2)
+
+#define REJECT		0xff	/* Jump target patched to the final drop */
+
+struct prog {
+	struct sock_filter insn[IFC_FILTER_MAX];
+	unsigned int len;
+	uint16_t mode;		/* BPF_ABS, or BPF_IND on trunks */
+};
+
+static void
+emit(struct prog *p, uint16_t code, uint8_t jt, uint8_t jf, uint32_t k)
+{
+	if (p->len < IFC_FILTER_MAX)
+		p->insn[p->len] = (struct sock_filter){ code, jt, jf, k };
+	p->len++;
+}
+
+#define LD(p, size, off) emit(p, BPF_LD | (size) | (p)->mode, 0, 0, off)
+#define AND(p, k)	emit(p, BPF_ALU | BPF_AND | BPF_K, 0, 0, k)
+/* Drops the frame unless A == k, or if A == k */
+#define NEED(p, k)	emit(p, BPF_JMP | BPF_JEQ | BPF_K, 0, REJECT, k)
+#define DENY(p, k)	emit(p, BPF_JMP | BPF_JEQ | BPF_K, REJECT, 0, k)
+
+/* Drops the frame unless the IPv6 address at off is addr */
+static void
+need_addr(struct prog *p, uint32_t off, const struct in6_addr *addr)
+{
+	for (unsigned int i = 0; i < 4; i++) {
+		LD(p, BPF_W, off + 4 * i);
+		NEED(p, ntohl(addr->s6_addr32[i]));
+	}
+}
+
+/* Drops the frame unless the IPv6 address at off is in fe80::/10 */
+static void
+need_linklocal(struct prog *p, uint32_t off)
+{
+	LD(p, BPF_W, off);
+	AND(p, 0xffc00000);
+	NEED(p, 0xfe800000);
+}
+
+int
+filter_compile(struct ifc *ifc)
+{
+	static const struct in6_addr all_dhcp = {{{
+	    0xff,2,0,0, 0,0,0,0, 0,0,0,0, 0,1,0,2 }}};
+	struct prog p = { .len = 0, .mode = BPF_ABS };
+
+	if (ifc->side == TRUNK) {
+		/* X = 0, 4 or 8, past up to two tags in the frame */
+		p.mode = BPF_IND;
+		emit(&p, BPF_LDX | BPF_W | BPF_IMM, 0, 0, 0);
+		LD(&p, BPF_H, OFF_TYPE);
+		emit(&p, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, ETH_P_8021Q);
+		emit(&p, BPF_JMP | BPF_JEQ | BPF_K, 0, 5, ETH_P_8021AD);
+		emit(&p, BPF_LDX | BPF_W | BPF_IMM, 0, 0, 4);
+		LD(&p, BPF_H, OFF_TYPE);
+		emit(&p, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, ETH_P_8021Q);
+		emit(&p, BPF_JMP | BPF_JEQ | BPF_K, 0, 1, ETH_P_8021AD);
+		emit(&p, BPF_LDX | BPF_W | BPF_IMM, 0, 0, 8);
+	}
+
+	/* IPv6 with UDP as the first next header, so no extension
+	 * headers, to the DHCPv6 server port */
+	LD(&p, BPF_H, OFF_TYPE);
+	NEED(&p, ETH_P_IPV6);
+	LD(&p, BPF_B, OFF_NXT);
+	NEED(&p, IPPROTO_UDP);
+	LD(&p, BPF_H, OFF_UDP_DPORT);
+	NEED(&p, 547);
+
+	/* Not something this host sent, such as our own relayed frames */
+	emit(&p, BPF_LD | BPF_B | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_PKTTYPE);
+	DENY(&p, PACKET_OUTGOING);
+	if (ifc->hwlen == ETH_ALEN) {
+		emit(&p, BPF_LD | BPF_W | BPF_ABS, 0, 0, OFF_SRC_MAC);
+		emit(&p, BPF_JMP | BPF_JEQ | BPF_K, 0, 2,
+		    (uint32_t)ifc->hwaddr[0] << 24 | ifc->hwaddr[1] << 16 |
+		    ifc->hwaddr[2] << 8 | ifc->hwaddr[3]);
+		emit(&p, BPF_LD | BPF_H | BPF_ABS, 0, 0, OFF_SRC_MAC + 4);
+		DENY(&p, ifc->hwaddr[4] << 8 | ifc->hwaddr[5]);
+	}
+
+	if (ifc->side == CLIENT || ifc->side == TRUNK) {
+		/* Multicast to All_DHCP_Relay_Agents_and_Servers,
+		 * in a message type we relay, within trust_hops
+		 * (which trunks leave to their virtual clients) */
+		need_addr(&p, OFF_IP6_DST, &all_dhcp);
+		LD(&p, BPF_B, OFF_MSG_TYPE);
+		DENY(&p, DHCP_ADVERTISE);
+		DENY(&p, DHCP_REPLY);
+		DENY(&p, DHCP_RECONFIGURE);
+		DENY(&p, DHCP_RELAY_REPL);
+		if (ifc->side == CLIENT && !ifc->trust_hops)
+			DENY(&p, DHCP_RELAY_FORW);
+		else if (ifc->side == CLIENT) {
+			emit(&p, BPF_JMP | BPF_JEQ | BPF_K, 0, 2,
+			    DHCP_RELAY_FORW);
+			LD(&p, BPF_B, OFF_HOP_COUNT);
+			emit(&p, BPF_JMP | BPF_JGE | BPF_K, REJECT, 0,
+			    ifc->trust_hops);
+		}
+	} else {
+		/* A RELAY-REPL with link-address ::, unicast between
+		 * link-local addresses, to ours if we know it */
+		need_linklocal(&p, OFF_IP6_SRC);
+		if (IN6_IS_ADDR_UNSPECIFIED(&ifc->addr))
+			need_linklocal(&p, OFF_IP6_DST);
+		else
+			need_addr(&p, OFF_IP6_DST, &ifc->addr);
+		LD(&p, BPF_B, OFF_MSG_TYPE);
+		NEED(&p, DHCP_RELAY_REPL);
+		need_addr(&p, OFF_LINK_ADDR, &in6addr_any);
+	}
+
+	emit(&p, BPF_RET | BPF_K, 0, 0, 0x00040000);
+	emit(&p, BPF_RET | BPF_K, 0, 0, 0);
+	if (p.len > IFC_FILTER_MAX) {
+		errno = E2BIG;
+		return -1;
+	}
+
+	/* Point the drops at the last instruction */
+	for (unsigned int pc = 0; pc < p.len; pc++) {
+		if (p.insn[pc].jt == REJECT)
+			p.insn[pc].jt = p.len - 2 - pc;
+		if (p.insn[pc].jf == REJECT)
+			p.insn[pc].jf = p.len - 2 - pc;
+	}
+
+	memcpy(ifc->filter, p.insn, p.len * sizeof *p.insn);
+	ifc->filter_len = p.len;
+	return 0;
+}
+
+void
+filter_prog(const struct ifc *ifc, struct sock_fprog *fprog)
+{
+	fprog->len = ifc->filter_len;
+	fprog->filter = (struct sock_filter *)ifc->filter;
+}
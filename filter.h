@@ -0,0 +1,16 @@
+/*
+ * Socket filters generated for each interface, so that the kernel
+ * drops the frames the relay would only discard, before they are
+ * copied to it or wake it up.
+ */
+
+struct ifc;
+struct sock_fprog;
+
+/* Compiles ifc's socket filter (see struct ifc) from its side,
+ * addresses and trust_hops.
+ * Returns 0 on success, -1 on error. */
+int filter_compile(struct ifc *ifc);
+
+/* Points fprog at ifc's compiled filter, for the kernel */
+void filter_prog(const struct ifc *ifc, struct sock_fprog *fprog);
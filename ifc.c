@@ -1,32 +1,139 @@
 #include <err.h>
 #include <ifaddrs.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <net/if.h>
 #include <netinet/in.h>
+#include <linux/if_packet.h>
 
+#include "dhcp.h"
+#include "filter.h"
 #include "ifc.h"
 
 int
 ifc_set_info(const struct ifaddrs *ifa, struct ifc *ifc)
 {
+	if (ifc->side == CLIENT && dhcp_relay_template(ifc) == -1)
+		err(1, "%s: relay template", ifc->name);
+	return ifc_set_link(ifa, ifc);
+}
+
+int
+ifc_set_link(const struct ifaddrs *ifa, struct ifc *ifc)
+{
+	int found = 0;
+
+	if (ifc->vlan_n) {
+		/* Virtual clients only have their trunk's link */
+		ifc->index = 0;
+		return 0;
+	}
 	ifc->index = if_nametoindex(ifc->name);
 	if (!ifc->index)
 		warn("%s", ifc->name);
-
-	for (; ifa; ifa = ifa->ifa_next)
-		if (strncmp(ifc->name, ifa->ifa_name, IFNAMSIZ) == 0 &&
-		    ifa->ifa_addr &&
-		    ifa->ifa_addr->sa_family == AF_INET6)
-		{
+	ifc->addr = in6addr_any;
+	ifc->hwlen = 0;
+	for (; ifa; ifa = ifa->ifa_next) {
+		if (strncmp(ifc->name, ifa->ifa_name, IFNAMSIZ) != 0 ||
+		    !ifa->ifa_addr)
+			continue;
+		if (ifa->ifa_addr->sa_family == AF_INET6 && !found) {
 			struct sockaddr_in6 *sa6 =
 			    (struct sockaddr_in6 *)ifa->ifa_addr;
 			if (IN6_IS_ADDR_LINKLOCAL(&sa6->sin6_addr)) {
 				ifc->addr = sa6->sin6_addr;
-				return 0;
+				found = 1;
+			}
+		} else if (ifa->ifa_addr->sa_family == AF_PACKET) {
+			struct sockaddr_ll *sll =
+			    (struct sockaddr_ll *)ifa->ifa_addr;
+			if (sll->sll_halen <= sizeof ifc->hwaddr) {
+				memcpy(ifc->hwaddr, sll->sll_addr,
+				    sll->sll_halen);
+				ifc->hwlen = sll->sll_halen;
 			}
 		}
-	warnx("%s: no IPv6 link local address, using ::", ifc->name);
+	}
+	if (!found)
+		warnx("%s: no IPv6 link local address, using ::", ifc->name);
+
+	/* The filter depends on the addresses */
+	if (filter_compile(ifc) == -1)
+		err(1, "%s: filter", ifc->name);
+	return found ? 0 : -1;
+}
+
+int
+ifc_set_replay(struct ifc *ifc)
+{
+	ifc->index = 0;
 	ifc->addr = in6addr_any;
+	ifc->hwlen = 0;
+	if (ifc->side == CLIENT && dhcp_relay_template(ifc) == -1)
+		err(1, "%s: relay template", ifc->name);
+	if (!ifc->vlan_n && filter_compile(ifc) == -1)
+		err(1, "%s: filter", ifc->name);
+	return 0;
+}
+
+/* Open-addressed hash table of the positions of CLIENT interfaces
+ * keyed by name, or -1 in empty slots. Its size is a power of two,
+ * at least twice the number of entries. */
+static int *index_slot;
+static unsigned int index_mask;
+
+/* FNV-1a hash of an interface name */
+static unsigned int
+index_hash(const char *id, size_t len)
+{
+	unsigned int h = 2166136261u;
+
+	while (len--) {
+		h ^= (unsigned char)*id++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+void
+ifc_index_build(struct ifc *ifc, unsigned int nifc)
+{
+	unsigned int size = 2;
+
+	while (size < 2 * nifc)
+		size <<= 1;
+	free(index_slot);
+	index_slot = malloc(size * sizeof *index_slot);
+	if (!index_slot)
+		err(1, "malloc");
+	for (unsigned int h = 0; h < size; h++)
+		index_slot[h] = -1;
+	index_mask = size - 1;
+
+	for (unsigned int i = 0; i < nifc; i++) {
+		if (ifc[i].side != CLIENT)
+			continue;
+		size_t len = strnlen(ifc[i].name, IFNAMSIZ);
+		unsigned int h = index_hash(ifc[i].name, len) & index_mask;
+		while (index_slot[h] != -1)
+			h = (h + 1) & index_mask;
+		index_slot[h] = i;
+	}
+}
+
+int
+ifc_index_find(const struct ifc *ifc, const char *id, size_t len)
+{
+	int i;
+
+	if (!index_slot)
+		return -1;
+	for (unsigned int h = index_hash(id, len) & index_mask;
+	     (i = index_slot[h]) != -1;
+	     h = (h + 1) & index_mask)
+		if (strnlen(ifc[i].name, IFNAMSIZ) == len &&
+		    memcmp(ifc[i].name, id, len) == 0)
+			return i;
 	return -1;
 }
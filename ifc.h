@@ -1,16 +1,66 @@
 #include <netinet/in.h>
+#include <linux/filter.h>
 #include <ifaddrs.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /* A system interface */
 struct ifc {
-	enum { NONE, CLIENT, SERVER } side;
+	enum { NONE, CLIENT, SERVER, TRUNK } side;
 	const char *name;
 	unsigned char trust_hops;	/* Max number of client-side relays */
+	unsigned char xdp;		/* Receive through AF_XDP (see xsk.h) */
+	unsigned int limit_rate;	/* Aggregate messages/s from clients, or 0 */
+	unsigned int limit_burst;	/* (see limit.h) */
+	unsigned int num;		/* Position in the list */
 	unsigned int index;		/* ifindex, set by ifc_set_info() */
 	struct in6_addr addr;		/* Link-local address, set by ifc_set_info() */
+	unsigned char hwaddr[8];	/* MAC address, set by ifc_set_info() */
+	unsigned int hwlen;		/* 0 if unknown */
+	/* VLAN trunking (see vlan.h), set by vlan_build() */
+	struct vlan_map *vlan_map;	/* TRUNK: its virtual clients */
+	unsigned int vlan_n;		/* Virtual CLIENT: 1 or 2 tags, else 0 */
+	uint16_t vlan[2];		/* VIDs, outer first */
+	unsigned int trunk;		/* Position of the TRUNK carrying it */
 	const char *vendor_data;	/* Vendor-class info to add */
 	unsigned vendor_len;
+
+	/* RELAY-FORW header and options, set by ifc_set_info().
+	 * The hop-count, peer-address and RELAY_MSG length are zero,
+	 * to be patched per packet by dhcp_wrap(). */
+	char *relay_tmpl;
+	unsigned int relay_len;
+	uint32_t relay_sum;		/* Partial checksum of relay_tmpl */
+
+	/* Socket filter for the frames to relay, set by ifc_set_info()
+	 * with filter_compile(). It is held inline so that a copy of
+	 * the interface table (see relay_loop()) stands alone. */
+#define IFC_FILTER_MAX	64
+	struct sock_filter filter[IFC_FILTER_MAX];
+	unsigned short filter_len;
 };
 
-/* Sets an ifc's index LL-address using the list from getifaddrs() */
+/* Sets an ifc's index, LL-address and MAC address using the list from
+ * getifaddrs(), and compiles its relay template with
+ * dhcp_relay_template() and its socket filter with filter_compile() */
 int ifc_set_info(const struct ifaddrs *ifa, struct ifc *ifc);
+
+/* Sets just what ifc_set_info() takes from the system: the index,
+ * LL-address and MAC address, and the filter that depends on them.
+ * Returns 0 on success, -1 if there is no LL-address. */
+int ifc_set_link(const struct ifaddrs *ifa, struct ifc *ifc);
+
+/* Sets up an interface that is replayed rather than found on this
+ * host (see io.h): it has no index, the address ::, no MAC address,
+ * a relay template and a filter, so that its output does not depend
+ * on the host. */
+int ifc_set_replay(struct ifc *ifc);
+
+/* Rebuilds the index from interface-ID to the position of a CLIENT
+ * interface. It holds for any copy of the table, since only names
+ * and sides are used. */
+void ifc_index_build(struct ifc *ifc, unsigned int nifc);
+
+/* Finds the CLIENT interface in table ifc[] named by an interface-ID
+ * option. Returns its position, or -1 if there is none. */
+int ifc_index_find(const struct ifc *ifc, const char *id, size_t len);
@@ -0,0 +1,630 @@
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <net/if.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+
+#include "filter.h"
+#include "ifc.h"
+#include "io.h"
+#include "loop.h"
+#include "pcap.h"
+#include "pkt.h"
+#include "ring.h"
+#include "sock.h"
+#include "uring.h"
+#include "verbose.h"
+#include "xsk.h"
+
+const struct io_ops *io_backend = &io_packet;
+const char *io_pcap_in;
+const char *io_pcap_out;
+
+int
+io_open(struct io *io, const struct ifc *ifc, unsigned int fanout)
+{
+	*io = (struct io)IO_INIT;
+	io->ops = io_backend;
+	io->name = ifc->name;
+	if (io->ops->open(io, ifc, fanout) == -1) {
+		io->ops = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void
+io_close(struct io *io)
+{
+	if (io->ops)
+		io->ops->close(io);
+	io->ops = NULL;
+	io->fd = -1;
+}
+
+/* Returns the time now, as a receive timestamp */
+static uint64_t
+io_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Finishes receiving an ethernet frame into pkt->raw[] from somewhere
+ * other than a socket: applies the socket's filter and makes up the
+ * sockaddr_ll and timestamp the kernel would have provided.
+ * Returns 0 if the frame should be dropped. */
+static int
+io_rx_frame(const struct sock_fprog *fprog, struct pkt *pkt,
+	unsigned int len, uint64_t rxtime)
+{
+	const char *frame = &pkt->raw[pkt->rawoff];
+	struct ether_header eh;
+
+	if (len < sizeof eh)
+		return 0;
+	memcpy(&eh, frame, sizeof eh);
+	pkt->sll = (struct sockaddr_ll) {
+		.sll_family = AF_PACKET,
+		.sll_protocol = eh.ether_type,
+		.sll_hatype = ARPHRD_ETHER,
+		.sll_pkttype = (eh.ether_dhost[0] & 1) ? PACKET_MULTICAST
+		                                       : PACKET_OTHERHOST,
+		.sll_halen = ETHER_ADDR_LEN,
+	};
+	memcpy(pkt->sll.sll_addr, eh.ether_shost, ETHER_ADDR_LEN);
+	if (!sock_filter_run(fprog, frame, len, &pkt->sll))
+		return 0;
+	pkt->rawlen = len;
+	pkt->rxtime = rxtime;
+	pkt->nvlan = 0;
+	pkt->ip6_hdr = NULL;
+	pkt->udphdr = NULL;
+	pkt->data = NULL;
+	pkt->datalen = 0;
+	return 1;
+}
+
+/* Prepares pkt to receive into its own storage after the headroom */
+static void
+io_rx_init(struct pkt *pkt)
+{
+	if (pkt->raw != pkt->buf)
+		pkt_init(pkt);	/* Stop borrowing a ring frame */
+	pkt->rawoff = PKT_RXOFF;
+}
+
+/*
+ * AF_PACKET sockets, with an optional receive ring (-r) or io_uring
+ * (-u), and otherwise receiving with recvmmsg() (-b) or one recvfrom()
+ * per poll. On client interfaces with -x, frames to the DHCPv6 port
+ * are received and replies sent through an XDP socket instead, when
+ * one can be opened; the AF_PACKET socket gets whatever XDP passes.
+ */
+
+struct packet_port {
+	int s;			/* The socket; io->fd may be the io_uring */
+	struct ring ring;	/* ring.map is NULL without -r */
+	struct uring uring;	/* uring.fd is -1 without -u */
+	struct xsk *xsk;	/* NULL without -x */
+	int ep;			/* With xsk, polls it and the socket */
+	struct sock_fprog fprog;	/* Run on the XDP socket's frames */
+	struct sock_filter filter[IFC_FILTER_MAX];
+};
+
+/* Keeps a copy of the interface's filter, which outlives its table */
+static void
+packet_set_filter(struct packet_port *p, const struct ifc *ifc)
+{
+	memcpy(p->filter, ifc->filter, ifc->filter_len * sizeof *p->filter);
+	p->fprog.len = ifc->filter_len;
+	p->fprog.filter = p->filter;
+}
+
+/* Opens an XDP socket for the interface, to be polled along with the
+ * socket through an epoll fd of the port's own.
+ * Returns 0 on success, -1 on error. */
+static int
+packet_open_xsk(struct io *io, struct packet_port *p, const struct ifc *ifc)
+{
+	if (!(p->xsk = xsk_open(ifc->index)))
+		return -1;
+	packet_set_filter(p, ifc);
+	p->ep = epoll_create1(EPOLL_CLOEXEC);
+	int fds[] = { io->fd, xsk_fd(p->xsk) };
+	for (unsigned int k = 0; p->ep != -1 && k < 2; k++) {
+		struct epoll_event ev = { .events = EPOLLIN };
+		if (epoll_ctl(p->ep, EPOLL_CTL_ADD, fds[k], &ev) == -1) {
+			close(p->ep);
+			p->ep = -1;
+		}
+	}
+	if (p->ep == -1) {
+		xsk_close(p->xsk);
+		p->xsk = NULL;
+		return -1;
+	}
+	io->fd = p->ep;
+	return 0;
+}
+
+/* Receives up to n frames from the XDP socket into pkts[], first
+ * handing back those of the last call */
+static int
+packet_recv_xsk(struct packet_port *p, struct pkt *pkts, unsigned int n)
+{
+	uint64_t now = sock_timestamps ? io_now() : 0;
+	unsigned int k = 0;
+	int len;
+
+	xsk_release(p->xsk);
+	while (k < n && (len = xsk_recv(p->xsk, &pkts[k])) > 0)
+		if (io_rx_frame(&p->fprog, &pkts[k], len, now))
+			k++;
+	return k;
+}
+
+static int
+packet_open(struct io *io, const struct ifc *ifc, unsigned int fanout)
+{
+	struct packet_port *p = malloc(sizeof *p);
+
+	if (!p)
+		return -1;
+	*p = (struct packet_port) {
+		.ring = RING_INIT, .uring = URING_INIT, .ep = -1
+	};
+	struct sock_fprog fprog;
+	filter_prog(ifc, &fprog);
+	p->s = sock_open(ifc->index, &fprog, ring_block_nr ? &p->ring : NULL,
+	    fanout, ifc->side == TRUNK);
+	if (p->s == -1) {
+		free(p);
+		return -1;
+	}
+	io->fd = p->s;
+	if (uring_bufs) {
+		if (uring_open(&p->uring, p->s) == 0)
+			io->fd = p->uring.fd;
+		else if (errno == ENOSYS || errno == EINVAL ||
+		    errno == EOPNOTSUPP || errno == EPERM)
+			verbose("%s: no io_uring multishot receive (%s),"
+			    " receiving without it\n", ifc->name, strerror(errno));
+		else
+			warn("%s: io_uring", ifc->name);
+	}
+	if (ifc->xdp && ifc->side == CLIENT &&
+	    packet_open_xsk(io, p, ifc) == -1)
+		verbose("%s: no AF_XDP socket (%s), receiving without it\n",
+		    ifc->name, strerror(errno));
+	io->priv = p;
+	return 0;
+}
+
+static int
+packet_recv(struct io *io, struct pkt *pkts, unsigned int n)
+{
+	struct packet_port *p = io->priv;
+	unsigned int k = 0;
+
+	if (p->xsk) {
+		/* Frames redirected by XDP first, then the socket's */
+		int len = packet_recv_xsk(p, pkts, n);
+		if (len)
+			return len;
+	}
+
+	if (p->uring.fd != -1) {
+		/* Borrow frames, which are handed back by the next call */
+		int len = uring_recv(&p->uring, pkts, n);
+		if (len == -1)
+			warn("%s io_uring recvmsg", io->name);
+		return len;
+	}
+
+	if (io->idle) {
+		io->idle = 0;
+		return 0;
+	}
+
+	if (p->ring.map) {
+		/* Borrow frames from one block, which is released by
+		 * the next call */
+		while (k < n && ring_recv(&p->ring, &pkts[k]) > 0) {
+			k++;
+			if (!p->ring.frames_left)
+				break;
+		}
+		return k;
+	}
+
+	/* Without blocking, if woken by the XDP socket */
+	if (rx_batch || p->xsk) {
+		int len = pkt_recv_batch(p->s, pkts, n);
+		if (len == -1 && errno == ENETDOWN) {
+			/* Reported once, as EPOLLERR would have been */
+			verbose("%s: link down\n", io->name);
+			len = 0;
+		} else if (len == -1)
+			warn("%s recvmmsg", io->name);
+		else if (len && len < (int)n)
+			io->idle = 1;	/* Drained the socket */
+		return len;
+	}
+
+	/* One packet per poll */
+	int len = pkt_recv(p->s, &pkts[0]);
+	if (len <= 0) {
+		if (len == 0)
+			warnx("%s recvfrom: closed", io->name);
+		else
+			warn("%s recvfrom", io->name);
+		return -1;
+	}
+	io->idle = 1;
+	return 1;
+}
+
+static int
+packet_filter(struct io *io, const struct ifc *ifc)
+{
+	struct packet_port *p = io->priv;
+	struct sock_fprog fprog;
+
+	filter_prog(ifc, &fprog);
+	if (p->xsk)
+		packet_set_filter(p, ifc);
+	return sock_attach_filter(p->s, &fprog);
+}
+
+static int
+packet_send(struct io *io, struct mmsghdr *msg, unsigned int n)
+{
+	struct packet_port *p = io->priv;
+
+	if (p->xsk)
+		return xsk_send(p->xsk, msg, n);
+	return sendmmsg(p->s, msg, n, 0);
+}
+
+static void
+packet_close(struct io *io)
+{
+	struct packet_port *p = io->priv;
+
+	if (!p)
+		return;
+	if (p->xsk) {
+		xsk_close(p->xsk);
+		close(p->ep);
+	}
+	if (p->uring.fd != -1)
+		uring_close(&p->uring);
+	if (p->ring.map)
+		ring_close(&p->ring);
+	close(p->s);
+	free(p);
+	io->priv = NULL;
+}
+
+const struct io_ops io_packet = {
+	.name = "packet",
+	.open = packet_open,
+	.filter = packet_filter,
+	.recv = packet_recv,
+	.send = packet_send,
+	.close = packet_close,
+};
+
+/*
+ * Capture file replay. Frames are read as fast as the relay can take
+ * them, and sent frames are recorded with the timestamp of the last
+ * frame read, so that the output depends only on the input.
+ */
+
+struct pcap_port {
+	struct pcap_file in;	/* in.f is NULL if there is no input */
+	struct pcap_file out;
+	struct sock_fprog fprog;
+};
+
+/* Timestamp of the last frame replayed */
+static struct timespec pcap_now;
+
+static int
+pcap_port_open(struct io *io, const struct ifc *ifc, unsigned int fanout)
+{
+	struct pcap_port *p = calloc(1, sizeof *p);
+	char path[PATH_MAX];
+
+	if (!p)
+		return -1;
+	filter_prog(ifc, &p->fprog);
+	snprintf(path, sizeof path, "%s/%s.pcap", io_pcap_in, ifc->name);
+	if (pcap_open_read(&p->in, path) == -1 && errno != ENOENT) {
+		warn("%s", path);
+		goto fail;
+	}
+	snprintf(path, sizeof path, "%s/%s.pcap", io_pcap_out, ifc->name);
+	if (pcap_open_write(&p->out, path) == -1) {
+		warn("%s", path);
+		goto fail;
+	}
+	io->priv = p;
+	return 0;
+fail:
+	pcap_close(&p->in);
+	free(p);
+	return -1;
+}
+
+static int
+pcap_port_recv(struct io *io, struct pkt *pkts, unsigned int n)
+{
+	struct pcap_port *p = io->priv;
+	uint64_t now = io_now();
+	unsigned int k = 0;
+
+	while (k < n) {
+		struct pkt *pkt = &pkts[k];
+		int len = 0;
+
+		io_rx_init(pkt);
+		if (p->in.f)
+			len = pcap_read(&p->in, &pkt->raw[pkt->rawoff],
+			    pkt->rawsize - pkt->rawoff, &pcap_now);
+		if (len == -1) {
+			warn("%s pcap_read", io->name);
+			return -1;
+		}
+		if (len == 0) {
+			io->eof = 1;
+			break;
+		}
+		if (io_rx_frame(&p->fprog, pkt, len, now))
+			k++;
+	}
+	return k;
+}
+
+static int
+pcap_port_filter(struct io *io, const struct ifc *ifc)
+{
+	struct pcap_port *p = io->priv;
+
+	filter_prog(ifc, &p->fprog);
+	return 0;
+}
+
+static int
+pcap_port_send(struct io *io, struct mmsghdr *msg, unsigned int n)
+{
+	struct pcap_port *p = io->priv;
+
+	for (unsigned int i = 0; i < n; i++)
+		if (pcap_write(&p->out, msg[i].msg_hdr.msg_iov,
+		    msg[i].msg_hdr.msg_iovlen, &pcap_now) == -1)
+			return i ? (int)i : -1;
+	return n;
+}
+
+static void
+pcap_port_close(struct io *io)
+{
+	struct pcap_port *p = io->priv;
+
+	pcap_close(&p->in);
+	pcap_close(&p->out);
+	free(p);
+	io->priv = NULL;
+}
+
+const struct io_ops io_pcap = {
+	.name = "pcap",
+	.open = pcap_port_open,
+	.filter = pcap_port_filter,
+	.recv = pcap_port_recv,
+	.send = pcap_port_send,
+	.close = pcap_port_close,
+};
+
+/*
+ * In-memory queues, for benchmarks and tests that drive the relay
+ * from inside the program. Interfaces are polled continuously.
+ */
+
+#define MEMQ_SLOTS	4096	/* A power of two */
+
+struct memq {
+	unsigned int head;	/* Next slot to put; written by producer */
+	unsigned int tail;	/* Next slot to get; written by consumer */
+	int end;
+	struct memq_slot {
+		unsigned int len;
+		unsigned int size;	/* Allocated size of data[] */
+		char *data;
+	} slot[MEMQ_SLOTS];
+};
+
+/* An interface's queues */
+struct mem_port {
+	char name[IFNAMSIZ];
+	struct memq *q[2];	/* Receive, transmit */
+	struct sock_fprog fprog;
+};
+
+static struct mem_port **mem_ports;
+static unsigned int mem_nports;
+
+static struct mem_port *
+mem_port(const char *ifname)
+{
+	struct mem_port **ports, *p;
+
+	for (unsigned int i = 0; i < mem_nports; i++)
+		if (strncmp(mem_ports[i]->name, ifname, IFNAMSIZ) == 0)
+			return mem_ports[i];
+	ports = realloc(mem_ports, (mem_nports + 1) * sizeof *ports);
+	if (!ports)
+		err(1, "realloc");
+	mem_ports = ports;
+	if (!(p = calloc(1, sizeof *p)))
+		err(1, "calloc");
+	snprintf(p->name, sizeof p->name, "%s", ifname);
+	mem_ports[mem_nports++] = p;
+	return p;
+}
+
+struct memq *
+io_mem_queue(const char *ifname, int tx)
+{
+	struct mem_port *p = mem_port(ifname);
+	struct memq **q = &p->q[tx ? 1 : 0];
+
+	if (!*q && !(*q = calloc(1, sizeof **q)))
+		err(1, "calloc");
+	return *q;
+}
+
+/* Copies a frame made of iov[0..iovcnt) onto the queue */
+static int
+memq_putv(struct memq *q, const struct iovec *iov, int iovcnt)
+{
+	unsigned int head = q->head;
+	unsigned int len = 0;
+
+	if (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == MEMQ_SLOTS) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	struct memq_slot *s = &q->slot[head % MEMQ_SLOTS];
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (len > s->size) {
+		char *data = realloc(s->data, len);
+		if (!data)
+			return -1;
+		s->data = data;
+		s->size = len;
+	}
+	s->len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(s->data + s->len, iov[i].iov_base, iov[i].iov_len);
+		s->len += iov[i].iov_len;
+	}
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int
+memq_put(struct memq *q, const void *frame, unsigned int len)
+{
+	struct iovec iov = { .iov_base = (void *)frame, .iov_len = len };
+	return memq_putv(q, &iov, 1);
+}
+
+int
+memq_get(struct memq *q, void *buf, unsigned int size)
+{
+	unsigned int tail = q->tail;
+
+	if (tail == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return 0;
+	struct memq_slot *s = &q->slot[tail % MEMQ_SLOTS];
+	unsigned int len = s->len < size ? s->len : size;
+	memcpy(buf, s->data, len);
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return len;
+}
+
+void
+memq_end(struct memq *q)
+{
+	__atomic_store_n(&q->end, 1, __ATOMIC_RELEASE);
+}
+
+static int
+mem_open(struct io *io, const struct ifc *ifc, unsigned int fanout)
+{
+	struct mem_port *p = mem_port(ifc->name);
+
+	io_mem_queue(ifc->name, 0);
+	io_mem_queue(ifc->name, 1);
+	filter_prog(ifc, &p->fprog);
+	io->priv = p;
+	return 0;
+}
+
+static int
+mem_recv(struct io *io, struct pkt *pkts, unsigned int n)
+{
+	struct mem_port *p = io->priv;
+	struct memq *q = p->q[0];
+	uint64_t now = io_now();
+	unsigned int k = 0;
+
+	while (k < n) {
+		struct pkt *pkt = &pkts[k];
+
+		/* Only an end seen before an empty queue is final */
+		int end = __atomic_load_n(&q->end, __ATOMIC_ACQUIRE);
+		io_rx_init(pkt);
+		int len = memq_get(q, &pkt->raw[pkt->rawoff],
+		    pkt->rawsize - pkt->rawoff);
+		if (!len) {
+			if (end) {
+				q->end = 0;
+				io->eof = 1;
+			}
+			break;
+		}
+		if (io_rx_frame(&p->fprog, pkt, len, now))
+			k++;
+	}
+	return k;
+}
+
+static int
+mem_filter(struct io *io, const struct ifc *ifc)
+{
+	struct mem_port *p = io->priv;
+
+	filter_prog(ifc, &p->fprog);
+	return 0;
+}
+
+static int
+mem_send(struct io *io, struct mmsghdr *msg, unsigned int n)
+{
+	struct mem_port *p = io->priv;
+
+	for (unsigned int i = 0; i < n; i++)
+		if (memq_putv(p->q[1], msg[i].msg_hdr.msg_iov,
+		    msg[i].msg_hdr.msg_iovlen) == -1)
+			return i ? (int)i : -1;
+	return n;
+}
+
+static void
+mem_close(struct io *io)
+{
+	io->priv = NULL;
+}
+
+const struct io_ops io_mem = {
+	.name = "mem",
+	.open = mem_open,
+	.filter = mem_filter,
+	.recv = mem_recv,
+	.send = mem_send,
+	.close = mem_close,
+};
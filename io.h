@@ -0,0 +1,93 @@
+/*
+ * I/O backends carry frames between relay_loop() and the interfaces.
+ * The packet backend uses AF_PACKET sockets on real interfaces.
+ * The pcap backend replays a capture file per interface and records
+ * what would have been sent in another. The memory backend exchanges
+ * frames with the rest of the program through in-memory queues.
+ * The last two let the production loop run without privileges or NICs.
+ */
+
+#include <sys/socket.h>
+
+struct ifc;
+struct pkt;
+struct io_ops;
+
+/* An interface opened by a backend */
+struct io {
+	const struct io_ops *ops;
+	const char *name;	/* Interface name, for messages */
+	int fd;			/* Polled with epoll, or -1 if always ready */
+	int idle;		/* Nothing more to receive until the next poll */
+	int eof;		/* No more frames will be received */
+	void *priv;		/* Backend state */
+};
+#define IO_INIT { .ops = NULL, .fd = -1, .priv = NULL }
+
+struct io_ops {
+	const char *name;
+
+	/* Opens the interface. fanout is as for sock_open().
+	 * Returns 0 on success, -1 on error. */
+	int (*open)(struct io *io, const struct ifc *ifc, unsigned int fanout);
+
+	/* Replaces the interface's filter with ifc's, without losing
+	 * the frames already received.
+	 * Returns 0 on success, -1 on error. */
+	int (*filter)(struct io *io, const struct ifc *ifc);
+
+	/* Receives up to n frames into pkts[]. The frames stay valid
+	 * until the next call. Returns the number of frames received,
+	 * 0 if none are waiting (setting io->eof if none ever will),
+	 * or -1 on error. */
+	int (*recv)(struct io *io, struct pkt *pkts, unsigned int n);
+
+	/* Sends the frames described by msg[0..n).
+	 * Returns the number of frames sent, or -1 on error. */
+	int (*send)(struct io *io, struct mmsghdr *msg, unsigned int n);
+
+	void (*close)(struct io *io);
+};
+
+extern const struct io_ops io_packet;
+extern const struct io_ops io_pcap;
+extern const struct io_ops io_mem;
+
+/* Backend used by relay_loop(); &io_packet unless changed */
+extern const struct io_ops *io_backend;
+
+/* Directories of the pcap backend. Frames received on an interface
+ * are read from <io_pcap_in>/<name>.pcap, if it exists, and frames
+ * sent are written to <io_pcap_out>/<name>.pcap. */
+extern const char *io_pcap_in;
+extern const char *io_pcap_out;
+
+/* Opens an interface with io_backend.
+ * Returns 0 on success, -1 on error. */
+int io_open(struct io *io, const struct ifc *ifc, unsigned int fanout);
+
+/* Closes the interface, if open */
+void io_close(struct io *io);
+
+/*
+ * A single-producer, single-consumer queue of frames for the memory
+ * backend. Each interface has a queue of frames for it to receive
+ * and a queue of the frames it sent.
+ */
+struct memq;
+
+/* Returns an interface's receive (tx == 0) or transmit queue,
+ * creating it if necessary. */
+struct memq *io_mem_queue(const char *ifname, int tx);
+
+/* Copies a frame onto the queue.
+ * Returns 0 on success, or -1 if the queue is full. */
+int memq_put(struct memq *q, const void *frame, unsigned int len);
+
+/* Copies the oldest frame into buf[size], truncating it if necessary.
+ * Returns the number of bytes stored, or 0 if the queue is empty. */
+int memq_get(struct memq *q, void *buf, unsigned int size);
+
+/* Marks the end of the frames put so far. Once the consumer has
+ * taken them, it sees the end of input (once). */
+void memq_end(struct memq *q);
@@ -0,0 +1,148 @@
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ifc.h"
+#include "limit.h"
+#include "pkt.h"
+#include "stats.h"
+
+unsigned int limit_rate;
+unsigned int limit_burst;
+
+/* Per-client buckets: a table of 2^LIMIT_BITS slots, of which a key
+ * may be in any of the LIMIT_PROBE from its hash on */
+#define LIMIT_BITS	13
+#define LIMIT_SLOTS	(1u << LIMIT_BITS)
+#define LIMIT_PROBE	8
+
+/*
+ * A bucket is kept as the time at which it would be full again (its
+ * "theoretical arrival time", as in GCRA). Each message moves it on by
+ * the interval between tokens, unless that would leave it more than the
+ * burst's tolerance ahead of now. A bucket whose time has passed is full
+ * and holds nothing worth keeping.
+ */
+struct bucket {
+	uint64_t interval;	/* ns per token */
+	uint64_t tolerance;	/* ns, interval * (burst - 1) */
+	uint64_t tat;		/* ns */
+};
+
+struct slot {
+	uint64_t key;		/* 0 if never used */
+	uint64_t tat;
+};
+
+struct limiter {
+	struct bucket client;	/* Rate of each slot */
+	struct bucket *ifc;	/* [nifc] aggregate, or interval 0 */
+	unsigned int nifc;
+	struct slot slot[LIMIT_SLOTS];
+};
+
+static void
+bucket_init(struct bucket *b, unsigned int rate, unsigned int burst,
+	unsigned int share)
+{
+	b->interval = rate ? 1000000000ull * share / rate : 0;
+	burst = (burst ? burst : rate) / share;
+	b->tolerance = b->interval * (burst > 1 ? burst - 1 : 0);
+	b->tat = 0;
+}
+
+/* Takes a token from the bucket whose time is *tat.
+ * Returns 0 on success, -1 if it is empty. */
+static int
+bucket_take(const struct bucket *b, uint64_t *tat, uint64_t now)
+{
+	uint64_t t = *tat;
+
+	/* Refilled, or the clock stepped back */
+	if (t < now || t > now + b->tolerance + b->interval)
+		t = now;
+	if (t - now > b->tolerance)
+		return -1;
+	*tat = t + b->interval;
+	return 0;
+}
+
+struct limiter *
+limit_new(const struct ifc *ifc, unsigned int nifc, unsigned int nworkers)
+{
+	int any = limit_rate != 0;
+
+	for (unsigned int i = 0; i < nifc; i++)
+		if (ifc[i].limit_rate)
+			any = 1;
+	if (!any)
+		return NULL;
+
+	struct limiter *l = calloc(1, sizeof *l);
+	if (!l || !(l->ifc = calloc(nifc, sizeof *l->ifc)))
+		err(1, "calloc");
+	l->nifc = nifc;
+	/* A client's frames mostly stay with one worker */
+	bucket_init(&l->client, limit_rate, limit_burst, 1);
+	for (unsigned int i = 0; i < nifc; i++)
+		bucket_init(&l->ifc[i], ifc[i].limit_rate, ifc[i].limit_burst,
+		    nworkers);
+	return l;
+}
+
+/* Returns the slot for a key, reusing the stalest slot in its
+ * probe window if it has none */
+static struct slot *
+limit_slot(struct limiter *l, uint64_t key)
+{
+	unsigned int h = (key * 0x9e3779b97f4a7c15ull) >> (64 - LIMIT_BITS);
+	struct slot *victim = NULL;
+
+	for (unsigned int k = 0; k < LIMIT_PROBE; k++) {
+		struct slot *s = &l->slot[(h + k) & (LIMIT_SLOTS - 1)];
+		if (s->key == key)
+			return s;
+		if (!victim || s->tat < victim->tat)
+			victim = s;
+	}
+	victim->key = key;
+	victim->tat = 0;
+	return victim;
+}
+
+int
+limit_check(struct limiter *l, const struct ifc *ifc, unsigned int i,
+	const struct pkt *pkt)
+{
+	uint64_t now = pkt_time(pkt);
+
+	if (l->client.interval) {
+		/* Key on the interface and the first 6 bytes of the MAC */
+		uint64_t key = (uint64_t)(i + 1) << 48;
+		unsigned char mac[6] = { 0 };
+		memcpy(mac, pkt->sll.sll_addr, pkt->sll.sll_halen < 6
+		    ? pkt->sll.sll_halen : 6);
+		for (unsigned int k = 0; k < 6; k++)
+			key |= (uint64_t)mac[k] << (8 * k);
+		if (bucket_take(&l->client, &limit_slot(l, key)->tat,
+		    now) == -1) {
+			stat_inc(&ifc[i], STAT_LIMIT_CLIENT);
+			return -1;
+		}
+	}
+	struct bucket *b = &l->ifc[i];
+	if (b->interval && bucket_take(b, &b->tat, now) == -1) {
+		stat_inc(&ifc[i], STAT_LIMIT_IFC);
+		return -1;
+	}
+	return 0;
+}
+
+void
+limit_free(struct limiter *l)
+{
+	if (l) {
+		free(l->ifc);
+		free(l);
+	}
+}
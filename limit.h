@@ -0,0 +1,35 @@
+/*
+ * Optional rate limits on client messages, checked before they are
+ * wrapped: a token bucket per client link-layer address and input
+ * interface (-l), and an aggregate bucket per input interface (-L).
+ * Each worker keeps its own buckets, without locks. The per-client
+ * buckets live in a fixed-size open-addressed table; a bucket that has
+ * refilled is as good as free, so entries expire lazily, as their
+ * slots are reused.
+ */
+
+#include <stdint.h>
+
+struct ifc;
+struct pkt;
+
+/* The per-client limit, in messages per second (0 for none),
+ * and the burst allowed above it */
+extern unsigned int limit_rate;
+extern unsigned int limit_burst;
+
+struct limiter;
+
+/* Creates one of nworkers workers' buckets for the interfaces, whose
+ * aggregate limits (ifc->limit_rate) are shared out between them.
+ * Returns NULL if there are no limits to enforce. */
+struct limiter *limit_new(const struct ifc *ifc, unsigned int nifc,
+	unsigned int nworkers);
+
+/* Takes a token for a message received from a client on interface
+ * ifc[i], or counts it as dropped (STAT_LIMIT_CLIENT or STAT_LIMIT_IFC).
+ * Returns 0 if it may be relayed, -1 if it is over a limit. */
+int limit_check(struct limiter *l, const struct ifc *ifc, unsigned int i,
+	const struct pkt *pkt);
+
+void limit_free(struct limiter *l);
@@ -1,150 +1,773 @@
 #include <err.h>
 #include <errno.h>
 #include <ifaddrs.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <net/if.h>
 #include <netinet/in.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 
+#include "capture.h"
+#include "dedup.h"
 #include "dhcp.h"
+#include "fast.h"
 #include "ifc.h"
+#include "io.h"
+#include "limit.h"
 #include "loop.h"
+#include "nl.h"
 #include "pkt.h"
+#include "plog.h"
+#include "policy.h"
+#include "ring.h"
 #include "sock.h"
+#include "stats.h"
+#include "txq.h"
+#include "uring.h"
+#include "vlan.h"
 #include "verbose.h"
 
 volatile int loop_stop;
+volatile int loop_reload;
+unsigned int rx_batch;
+unsigned int loop_workers = 1;
+int loop_fanout_mode = PACKET_FANOUT_HASH;
 
-/* Opens sockets on all interfaces, then
- * enters a loop relaying DHCPv6 packets
- * between them, until loop_stop is set. */
-void
-relay_loop(struct ifc *ifc, unsigned int nifc)
+#define MAX_EVENTS	64	/* epoll events handled per wakeup */
+#define RX_BURST	64	/* Frames received between flushes, unless -b */
+
+/* epoll event data other than the index of a port */
+#define EV_STOP		(~0u)	/* worker.stopfd */
+#define EV_SWITCH	(~1u)	/* worker.switchfd */
+#define EV_NETLINK	(~2u)	/* worker.nlfd */
+
+/* Receive statistics, to show how well batching works */
+struct rxstat {
+	unsigned long calls;	/* Receive calls that returned data */
+	unsigned long frames;
+};
+
+/* Per-interface state of a running relay_loop() */
+struct port {
+	struct io io;
+	struct txq txq;
+	struct rxstat rxstat;
+	unsigned long tx_frames;	/* txq counts already in the stats */
+	unsigned long tx_dropped;
+	int open;
+	int pending;		/* Listed in relay.pending[] */
+};
+
+/* A relay worker; each has its own sockets and buffers */
+struct worker {
+	unsigned int nifc;
+	unsigned int id;
+	int cpu;		/* CPU to pin to, or -1 */
+	unsigned int fanout_id;	/* Base PACKET_FANOUT group id */
+	int stopfd;		/* eventfd written to stop workers, or -1 */
+	int switchfd;		/* eventfd written when the table changes */
+	int nlfd;		/* Netlink socket, or -1 (worker 0 only) */
+	unsigned int gen;	/* Generation of the table in use */
+	int done;		/* Every interface reached the end of its input */
+	pthread_t thread;
+};
+
+/*
+ * The interface table in use. A change to an interface is made in a
+ * new copy of the table, which is published with the next generation
+ * number. Each worker switches to it between batches, and worker 0
+ * frees the old copy once every worker has.
+ */
+static struct ifc *table;
+static unsigned int table_gen;
+static struct worker *workers;
+static unsigned int nworkers;
+
+/* Copies replaced since every worker last switched (worker 0 only) */
+static struct retired {
+	struct ifc *ifc;
+	unsigned int gen;	/* Of the copy that replaced it */
+} *retired;
+static unsigned int nretired;
+
+/* State of a running relay worker */
+struct relay {
+	struct ifc *ifc;
+	unsigned int nifc;
+	struct port *port;	/* Parallel to ifc[] */
+	int epfd;
+	unsigned int nfds;	/* Ports polled with epfd */
+	unsigned int *polled;	/* Indicies of ports without a fd */
+	unsigned int npolled;
+	unsigned int *servers;	/* Indicies of SERVER interfaces */
+	unsigned int nservers;
+	unsigned int *to;	/* Open servers, while relaying a message */
+	unsigned int *pending;	/* Indicies of ports with queued frames */
+	unsigned int npending;
+	struct limiter *limit;	/* NULL if no rate limits */
+	struct policy *policy;	/* NULL to relay to every server */
+	char *cap;		/* Frame being relayed, as received, while
+				 * capturing; otherwise NULL */
+	unsigned int caplen;
+	int capmac;		/* It matched the capture's MAC filter */
+	char *capbuf;		/* Storage for cap, allocated on first use */
+};
+
+/* Returns the interface whose port carries interface j's frames:
+ * for a virtual client, its trunk */
+static unsigned int
+relay_carrier(const struct relay *r, unsigned int j)
 {
-	/* A parallel array of poll structures */
-	struct pollfd pfd[nifc];
+	return r->ifc[j].vlan_n ? r->ifc[j].trunk : j;
+}
 
-	/* Connect each interface's packet socket */
-	for (unsigned i = 0; i < nifc; i++) {
-		pfd[i].revents = 0;
-		pfd[i].fd = sock_open(ifc[i].index,
-		    ifc[i].side == CLIENT
-		    ? &ether_client_fprog
-		    : &ether_server_fprog);
-		if (pfd[i].fd == -1) {
-			warnx("%s: ignored", ifc[i].name);
-			pfd[i].fd = -1;
-			pfd[i].events = 0;
+/* Queues a packet relayed from interface i for transmission on
+ * interface j */
+static void
+relay_send(struct relay *r, unsigned int i, unsigned int j, struct pkt *pkt)
+{
+	unsigned int c = relay_carrier(r, j);
+	struct port *port = &r->port[c];
+
+	if (!port->pending) {
+		port->pending = 1;
+		r->pending[r->npending++] = c;
+	}
+	pkt_set_src(pkt, &r->ifc[c].addr);
+	if (txq_add(&port->txq, pkt, &r->ifc[i], &r->ifc[j]) == -1) {
+		stat_inc(&r->ifc[c], STAT_TX_ERR);
+		return;
+	}
+	if (r->cap && capture_ifc(&r->ifc[c])) {
+		/* The frame just queued, as it will be sent */
+		const struct iovec *iov = port->txq.iov[port->txq.n - 1];
+		if (r->capmac || capture_mac(iov[0].iov_base)) {
+			char comment[IFNAMSIZ + 8];
+			snprintf(comment, sizeof comment, "to %s",
+			    r->ifc[j].name);
+			capture_frame(c, 0, 1, iov, 2, comment);
+		}
+	}
+}
+
+/* Sends everything queued since the last flush. This must be done
+ * before the received packets the queues refer to are reused. */
+static void
+relay_flush(struct relay *r)
+{
+	for (unsigned k = 0; k < r->npending; k++) {
+		unsigned j = r->pending[k];
+		struct port *port = &r->port[j];
+		struct txq *q = &port->txq;
+		txq_flush(q);
+		port->pending = 0;
+
+		/* Also counts frames sent when txq_add() flushed */
+		stat_add(&r->ifc[j], STAT_TX, q->frames - port->tx_frames);
+		stat_add(&r->ifc[j], STAT_TX_ERR,
+		    q->dropped - port->tx_dropped);
+		port->tx_frames = q->frames;
+		port->tx_dropped = q->dropped;
+	}
+	r->npending = 0;
+}
+
+/* Relays one received packet from interface i,
+ * queueing the result on the output interfaces' txq. */
+static void
+relay_one(struct relay *r, unsigned int i, struct pkt *pkt)
+{
+	struct ifc *ifc = r->ifc;
+
+	if (pkt_scan_udp(pkt) == -1) {
+		/* Not IPv6 UDP */
+		stat_inc(&ifc[i], errno == EBADMSG ? STAT_BAD_CSUM
+						   : STAT_NOT_UDP);
+		return;
+	}
+	if (ifc[i].side == TRUNK) {
+		/* Carry on as the virtual client it was tagged for */
+		int v = vlan_find(&ifc[i], pkt);
+		if (v == -1) {
+			stat_inc(&ifc[i], STAT_VLAN);
+			return;
+		}
+		i = v;
+	}
+
+	switch (ifc[i].side) {
+	case CLIENT:
+		/* Handle client->server relay. Retransmissions are dropped
+		 * before they can take the client's limiter tokens. */
+		if (dhcp_dup(pkt, &ifc[i]))
+			return;
+		if (r->limit && limit_check(r->limit, ifc, i, pkt) == -1)
+			return;
+		struct policy_key key;
+		if (r->policy)
+			policy_key(pkt, &key);	/* Before it is wrapped */
+		if (dhcp_wrap(pkt, &ifc[i]) == -1)
+			return;
+		plog(PLOG_CLIENT, &ifc[i], NULL, pkt, NULL, 0);
+		unsigned int nto = 0;
+		for (unsigned k = 0; k < r->nservers; k++) {
+			unsigned j = r->servers[k];
+			if (r->port[j].open)
+				r->to[nto++] = j;
+		}
+		if (r->policy && nto) {
+			/* Just one server */
+			r->to[0] = policy_choose(r->policy, i, &key,
+			    r->to, nto);
+			nto = 1;
+		}
+		for (unsigned k = 0; k < nto; k++) {
+			unsigned j = r->to[k];
+			plog(PLOG_RELAY, &ifc[i], &ifc[j], pkt, NULL, 0);
+			relay_send(r, i, j, pkt);
+		}
+		stat_inc(&ifc[i], STAT_RELAYED);
+		break;
+	case SERVER: ;
+		/* Handle server->client relay */
+		char name[IFNAMSIZ];
+		if (dhcp_unwrap(pkt, &ifc[i], name) == -1)
+			return;
+		plog(PLOG_SERVER, &ifc[i], NULL, pkt, NULL, 0);
+		int j = ifc_index_find(ifc, name, strnlen(name, IFNAMSIZ));
+		if (j != -1 && r->port[relay_carrier(r, j)].open) {
+			/* Found matching interface */
+			plog(PLOG_REPLY, &ifc[i], &ifc[j], pkt, NULL, 0);
+			if (r->policy)
+				policy_reply(r->policy, i, j, pkt);
+			relay_send(r, i, j, pkt);
+			stat_inc(&ifc[i], STAT_RELAYED);
 		} else {
-			pfd[i].events = POLLIN;
+			plog(PLOG_IFID, &ifc[i], NULL, pkt, name,
+			    strnlen(name, IFNAMSIZ));
+			stat_inc(&ifc[i], STAT_IFID);
+		}
+		break;
+	case NONE:
+	case TRUNK:
+		; /* ignore */
+	}
+}
+
+/* Relays a packet as relay_one(), capturing it if capture_on */
+static void
+relay_pkt(struct relay *r, unsigned int i, struct pkt *pkt)
+{
+	if (!capture_on) {
+		relay_one(r, i, pkt);
+		return;
+	}
+
+	/* Keep the frame as received; relaying rewrites it in place */
+	if (!r->capbuf && !(r->capbuf = malloc(sizeof pkt->buf))) {
+		relay_one(r, i, pkt);
+		return;
+	}
+	r->cap = r->capbuf;
+	r->caplen = pkt->rawlen;
+	memcpy(r->cap, &pkt->raw[pkt->rawoff], r->caplen);
+	r->capmac = capture_mac(r->cap);
+	uint64_t time = pkt_time(pkt);
+
+	stat_last = STAT_RX;
+	relay_one(r, i, pkt);
+
+	if (r->capmac && capture_ifc(&r->ifc[i])) {
+		struct iovec iov = { .iov_base = r->cap, .iov_len = r->caplen };
+		char comment[64];
+		if (stat_last >= STAT_DROP_FIRST)
+			snprintf(comment, sizeof comment, "dropped: %s",
+			    stat_names[stat_last]);
+		else
+			snprintf(comment, sizeof comment, "%s",
+			    stat_last == STAT_RELAYED ? "relayed" : "received");
+		capture_frame(i, time, 0, &iov, 1, comment);
+	}
+	r->cap = NULL;
+}
+
+/* Closes interface i */
+static void
+port_close(struct relay *r, unsigned int i)
+{
+	struct port *port = &r->port[i];
+	struct rxstat *rxstat = &port->rxstat;
+
+	if (!port->open)
+		return;
+	if (rxstat->calls)
+		verbose("%s: received %lu frames in %lu calls"
+		    " (average batch %.1f)\n",
+		    r->ifc[i].name, rxstat->frames, rxstat->calls,
+		    (double)rxstat->frames / rxstat->calls);
+	if (port->txq.batches)
+		verbose("%s: sent %lu frames in %lu batches\n",
+		    r->ifc[i].name, port->txq.frames, port->txq.batches);
+	if (port->io.fd != -1) {
+		(void) epoll_ctl(r->epfd, EPOLL_CTL_DEL, port->io.fd, NULL);
+		r->nfds--;
+	}
+	txq_free(&port->txq);
+	io_close(&port->io);
+	port->open = 0;
+}
+
+/* Receives and relays everything waiting on interface i.
+ * Returns -1 if the interface failed and should be closed. */
+static int
+port_input(struct relay *r, unsigned int i, struct pkt *pkts,
+	unsigned int npkts)
+{
+	struct port *port = &r->port[i];
+	int len;
+
+	while ((len = port->io.ops->recv(&port->io, pkts, npkts)) > 0) {
+		port->rxstat.calls++;
+		port->rxstat.frames += len;
+		stat_add(&r->ifc[i], STAT_RX, len);
+		for (int k = 0; k < len; k++)
+			relay_pkt(r, i, &pkts[k]);
+		relay_flush(r);	/* pkts[] are reused */
+	}
+	return len;
+}
+
+/* Opens interface i with the I/O backend */
+static void
+port_open(struct relay *r, const struct worker *w, unsigned int i)
+{
+	struct port *port = &r->port[i];
+	struct ifc *ifc = &r->ifc[i];
+
+	if (io_open(&port->io, ifc, loop_workers > 1
+	    ? SOCK_FANOUT(w->fanout_id + i, loop_fanout_mode)
+	    : 0) == -1)
+	{
+		warnx("%s: ignored", ifc->name);
+		return;
+	}
+	port->txq = (struct txq)TXQ_INIT(&port->io);
+	port->tx_frames = port->tx_dropped = 0;
+	port->open = 1;
+
+	if (port->io.fd == -1) {
+		/* Always ready; polled on every pass */
+		r->polled[r->npolled++] = i;
+	} else {
+		/* Events lead straight to the interface */
+		struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+		if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, port->io.fd, &ev) == -1) {
+			warn("%s: epoll_ctl", ifc->name);
+			port_close(r, i);
+			return;
 		}
+		r->nfds++;
 	}
+}
+
+/* Moves the worker onto the newest interface table. Only the ports
+ * whose interface was replaced (a new ifindex), or that had been
+ * closed, are reopened; the others keep their sockets and just take
+ * the new filter. */
+static void
+relay_switch(struct relay *r, struct worker *w)
+{
+	unsigned int gen = __atomic_load_n(&table_gen, __ATOMIC_ACQUIRE);
+	struct ifc *next = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+	struct ifc *prev = r->ifc;
+
+	r->ifc = next;
+	for (unsigned int i = 0; next != prev && i < r->nifc; i++) {
+		struct port *port = &r->port[i];
+
+		if (next[i].vlan_n)
+			continue;	/* Uses its trunk's port */
+		if (next[i].index != prev[i].index || !port->open) {
+			if (port->open)
+				verbose("%s: link changed, reopening\n",
+				    next[i].name);
+			port_close(r, i);
+			if (next[i].index)
+				port_open(r, w, i);
+		} else if (next[i].filter_len != prev[i].filter_len ||
+		    memcmp(next[i].filter, prev[i].filter,
+			next[i].filter_len * sizeof next[i].filter[0]) != 0)
+		{
+			verbose("%s: address changed, refiltering\n",
+			    next[i].name);
+			if (port->io.ops->filter(&port->io, &next[i]) == -1)
+				port_close(r, i);
+		}
+	}
+	__atomic_store_n(&w->gen, gen, __ATOMIC_RELEASE);
+}
+
+/* Frees the retired tables that no worker is still using */
+static void
+table_reclaim(void)
+{
+	unsigned int oldest = table_gen;
+
+	for (unsigned int k = 0; k < nworkers; k++) {
+		unsigned int gen = __atomic_load_n(&workers[k].gen,
+		    __ATOMIC_ACQUIRE);
+		if (gen < oldest)
+			oldest = gen;
+	}
+	for (unsigned int k = 0; k < nretired; )
+		if (retired[k].gen <= oldest) {
+			free(retired[k].ifc);
+			retired[k] = retired[--nretired];
+		} else
+			k++;
+}
+
+/* Refreshes the interfaces marked in changed[] from the system (see
+ * ifc_set_link()) in a copy of the table. If any differ, or force is
+ * set, publishes the copy and has every worker switch to it.
+ * Worker 0 only. */
+static void
+relay_reload(struct relay *r, struct worker *w, const char *changed,
+	int force)
+{
+	struct ifaddrs *ifaddrs;
+	int differ = force;
+
+	if (getifaddrs(&ifaddrs) == -1) {
+		warn("getifaddrs");
+		return;
+	}
+	struct ifc *next = malloc(r->nifc * sizeof *next);
+	struct retired *rt = realloc(retired, (nretired + 1) * sizeof *rt);
+	if (!next || !rt) {
+		warn("reload");
+		free(next);
+		freeifaddrs(ifaddrs);
+		return;
+	}
+	retired = rt;
+	memcpy(next, r->ifc, r->nifc * sizeof *next);
+	for (unsigned int i = 0; i < r->nifc; i++) {
+		if (!changed[i])
+			continue;
+		verbose("%s: reloading\n", next[i].name);
+		ifc_set_link(ifaddrs, &next[i]);
+		differ |= memcmp(&next[i], &r->ifc[i], sizeof next[i]) != 0;
+	}
+	freeifaddrs(ifaddrs);
+	if (!differ) {
+		free(next);
+		return;
+	}
+
+	retired[nretired++] = (struct retired){ table, table_gen + 1 };
+	__atomic_store_n(&table, next, __ATOMIC_RELEASE);
+	__atomic_store_n(&table_gen, table_gen + 1, __ATOMIC_RELEASE);
+	for (unsigned int k = 0; k < nworkers; k++) {
+		uint64_t one = 1;
+		if (&workers[k] != w &&
+		    write(workers[k].switchfd, &one, sizeof one) == -1)
+			warn("write switchfd");
+	}
+	relay_switch(r, w);
+	if (fast_path)
+		fast_update(next, r->nifc);
+	table_reclaim();
+}
+
+/* Opens the worker's ports on all interfaces, then
+ * relays DHCPv6 packets between them until loop_stop is
+ * set, the worker's stopfd is signalled, or every interface
+ * without a file descriptor reaches the end of its input.
+ * Worker 0 also follows the interfaces (nlfd, loop_reload). */
+static void *
+relay_worker(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int nifc = w->nifc;
+
+	if (w->cpu != -1) {
+		/* Keep each worker's sockets and buffers on one CPU */
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(w->cpu, &cpus);
+		int error = pthread_setaffinity_np(pthread_self(),
+		    sizeof cpus, &cpus);
+		if (error)
+			verbose("worker %u: cannot pin to cpu %d: %s\n",
+			    w->id, w->cpu, strerror(error));
+	}
+
+	stats_bind(w->id);
+	plog_bind(w->id);
+	dedup_bind();
+
+	struct relay r = {
+		.ifc = __atomic_load_n(&table, __ATOMIC_ACQUIRE),
+		.nifc = nifc,
+		.port = calloc(nifc, sizeof *r.port),
+		.polled = calloc(nifc, sizeof *r.polled),
+		.servers = calloc(nifc, sizeof *r.servers),
+		.to = calloc(nifc, sizeof *r.to),
+		.pending = calloc(nifc, sizeof *r.pending),
+		.epfd = epoll_create1(EPOLL_CLOEXEC),
+	};
+	char *changed = calloc(nifc, 1);
+	if (!r.port || !r.polled || !r.servers || !r.to || !r.pending ||
+	    !changed)
+		err(1, "calloc");
+	if (r.epfd == -1)
+		err(1, "epoll_create1");
+	r.limit = limit_new(r.ifc, nifc, nworkers);
+	r.policy = policy_new(r.ifc, nifc);
+
+	for (unsigned i = 0; i < nifc; i++) {
+		if (r.ifc[i].side == SERVER)
+			r.servers[r.nservers++] = i;
+		if (!r.ifc[i].vlan_n)
+			port_open(&r, w, i);
+	}
+
+	/* The worker's own events */
+	int fds[] = { w->stopfd, w->switchfd, w->nlfd };
+	uint32_t evs[] = { EV_STOP, EV_SWITCH, EV_NETLINK };
+	for (unsigned k = 0; k < sizeof fds / sizeof fds[0]; k++) {
+		struct epoll_event ev = { .events = EPOLLIN, .data.u32 = evs[k] };
+		if (fds[k] != -1 &&
+		    epoll_ctl(r.epfd, EPOLL_CTL_ADD, fds[k], &ev) == -1)
+			err(1, "epoll_ctl");
+	}
+
+	/* Receive buffers: one for recvfrom(), rx_batch for recvmmsg(),
+	 * otherwise enough for a burst of frames between flushes */
+	unsigned int npkts = rx_batch ? rx_batch
+	    : ring_block_nr || uring_bufs || io_backend != &io_packet
+	    ? RX_BURST : 1;
+	int replay = r.npolled != 0;
+	struct pkt *pkts = malloc(npkts * sizeof *pkts);
+	if (!pkts)
+		err(1, "malloc");
+	for (unsigned i = 0; i < npkts; i++)
+		pkt_init(&pkts[i]);
+
+	/* Worker 0 follows the interfaces. SIGHUP (loop_reload) only
+	 * interrupts its epoll_pwait(), so none is missed. */
+	int follow = w->id == 0 && io_backend == &io_packet;
+	sigset_t mask, omask, waitmask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &mask, &omask);
+	waitmask = omask;
+	if (follow)
+		sigdelset(&waitmask, SIGHUP);
 
-	struct pkt pkt = PKT_INIT;
 	while (!loop_stop) {
-		int n = poll(pfd, nifc, -1);
+		struct epoll_event ev[MAX_EVENTS];
+		int n = 0;
+
+		if (follow && loop_reload) {
+			loop_reload = 0;
+			memset(changed, 1, nifc);
+			relay_reload(&r, w, changed, 1);
+		}
+		if (follow && nretired)
+			table_reclaim();
+
+		if (r.nfds || w->stopfd != -1 || !r.npolled)
+			n = epoll_pwait(r.epfd, ev, MAX_EVENTS,
+			    r.npolled ? 0 : -1, &waitmask);
 		if (n == -1) {
 			if (errno == EINTR)
 				continue;
-			warn("poll");
+			warn("epoll_wait");
 			break;
 		}
 
-		for (unsigned i = 0; n && i < nifc; i++) {
-			/* interface name for error messages */
-			const char *ifname = ifc[i].name;
-			short revents = pfd[i].revents;
+		/* Port events after a switch may be for replaced sockets;
+		 * they will be reported again if they still apply */
+		int switched = 0;
+		for (int k = 0; k < n; k++) {
+			unsigned i = ev[k].data.u32;
+			uint64_t count;
 
-			pfd[i].revents = 0;
-			if (!revents)
+			switch (i) {
+			case EV_STOP:
+				loop_stop = 1;
+				continue;
+			case EV_SWITCH:
+				if (read(w->switchfd, &count, sizeof count) > 0)
+					relay_switch(&r, w);
+				switched = 1;
+				continue;
+			case EV_NETLINK:
+				memset(changed, 0, nifc);
+				if (nl_read(w->nlfd, r.ifc, nifc, changed) > 0)
+					relay_reload(&r, w, changed, 0);
+				switched = 1;
 				continue;
-			n--;
-
-			if (revents & (POLLERR|POLLHUP|POLLNVAL)) {
-				/* Handle socket errors */
-				warn("%s: error, closing", ifname);
-close:
-				/* Close the socket */
-				close(pfd[i].fd);
-				pfd[i].fd = -1;
-				pfd[i].events = revents = 0;
-			}
-			if (!(revents & POLLIN))
-				continue; /* Silent socket */
-
-			/* Receive a UDPv6 packet */
-			int len = pkt_recv(pfd[i].fd, &pkt);
-			if (len <= 0) {
-				if (len == 0)
-				    warnx("%s recvfrom: closed", ifname);
-				else
-				    warn("%s recvfrom", ifname);
-				goto close;
 			}
-			if (pkt_scan_udp(&pkt) == -1)
-				continue; /* Not IPv6 UDP */
 
-			switch (ifc[i].side) {
-			case CLIENT:
-				/* Handle client->server relay */
-				if (dhcp_wrap(&pkt, &ifc[i]) == -1)
+			if (switched || !r.port[i].open)
+				continue; /* Closed earlier this wakeup */
+			if (ev[k].events & (EPOLLERR|EPOLLHUP)) {
+				/* A socket outlives its link going down */
+				int error = sock_error(r.port[i].io.fd);
+				if (error == ENETDOWN) {
+					verbose("%s: link down\n",
+					    r.ifc[i].name);
 					continue;
-				verbose2("%s: message from client %s\n",
-				    ifc[i].name, pkt_lladdr(&pkt));
-				for (unsigned j = 0; j < nifc; j++)
-					if (ifc[j].side == SERVER &&
-					    pfd[j].fd != -1)
-					{
-						verbose(
-						    "%s->%s: relaying client %s\n",
-						    ifc[i].name, ifc[j].name,
-                                                    pkt_lladdr(&pkt));
-						pkt.ip6_hdr->ip6_src = ifc[j].addr;
-						pkt_send(pfd[j].fd, &pkt);
-					}
-				break;
-			case SERVER: ;
-				/* Handle server->client relay */
-				char name[IFNAMSIZ];
-				char addrbuf[INET6_ADDRSTRLEN];
-				if (dhcp_unwrap(&pkt, &ifc[i], name) == -1)
-					continue;
-				verbose2("%s: message from server %s\n",
-				    ifc[i].name, pkt_lladdr(&pkt));
-				unsigned j;
-				for (j = 0; j < nifc; j++)
-					if (ifc[j].side == CLIENT &&
-					    pfd[j].fd != -1 &&
-					    strncmp(ifc[j].name, name,
-					        IFNAMSIZ) == 0)
-						    break;
-				if (j < nifc) {
-				        /* Found matching interface j */
-					verbose(
-					    "%s<-%s: server %s reply to %s\n",
-					    ifc[j].name, ifc[i].name,
-					    pkt_lladdr(&pkt),
-					    inet_ntop(AF_INET6,
-						&pkt.ip6_hdr->ip6_dst,
-						addrbuf, sizeof addrbuf));
-					pkt.ip6_hdr->ip6_src = ifc[j].addr;
-					pkt_send(pfd[j].fd, &pkt);
-				} else {
-					warnx("%s: unexpected interface-id %.*s from %s",
-					    ifc[i].name, IFNAMSIZ, name, pkt_lladdr(&pkt));
 				}
-				break;
-			case NONE:
-				; /* ignore */
+				/* Handle socket errors */
+				errno = error;
+				warn("%s: error, closing", r.ifc[i].name);
+				port_close(&r, i);
+				continue;
 			}
+			if (port_input(&r, i, pkts, npkts) == -1)
+				port_close(&r, i);
+		}
+
+		/* Receive from the interfaces that have no fd to poll */
+		for (unsigned k = 0; k < r.npolled; ) {
+			unsigned i = r.polled[k];
+			if (port_input(&r, i, pkts, npkts) == -1)
+				port_close(&r, i);
+			if (!r.port[i].open || r.port[i].io.eof)
+				r.polled[k] = r.polled[--r.npolled];
+			else
+				k++;
+		}
+		if (replay && !r.npolled && !r.nfds) {
+			w->done = 1;
+			break;
 		}
 	}
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
 
 	/* Close everything */
 	for (unsigned i = 0; i < nifc; i++)
-		if (pfd[i].fd != -1)
-			close(pfd[i].fd);
+		port_close(&r, i);
+	close(r.epfd);
+	free(r.port);
+	free(r.polled);
+	free(r.servers);
+	free(r.to);
+	free(r.pending);
+	limit_free(r.limit);
+	policy_free(r.policy);
+	free(r.capbuf);
+	dedup_unbind();
+	free(changed);
+	free(pkts);
+	return NULL;
+}
 
+/* Runs loop_workers relay workers until loop_stop is set.
+ * The calling thread runs worker 0 and is the only one that
+ * receives SIGHUP; the others are woken through eventfds.
+ * Backends other than io_packet run one worker. */
+int
+relay_loop(struct ifc *ifc, unsigned int nifc)
+{
+	unsigned int n = loop_workers ? loop_workers : 1;
+
+	if (io_backend != &io_packet)
+		n = 1;
+	struct worker w[n];
+	int stopfd = -1;
+
+	/* Work on a copy of the table, so that it can be replaced */
+	table = malloc(nifc * sizeof *table);
+	if (!table)
+		err(1, "malloc");
+	memcpy(table, ifc, nifc * sizeof *table);
+	table_gen = 0;
+	workers = w;
+	nworkers = n;
+
+	if (n > 1) {
+		stopfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (stopfd == -1)
+			err(1, "eventfd");
+	}
+	/* Spread the workers over the CPUs we may run on */
+	cpu_set_t cpus;
+	int ncpus = 0;
+	if (n > 1 && sched_getaffinity(0, sizeof cpus, &cpus) == 0)
+		ncpus = CPU_COUNT(&cpus);
+	for (int c = 0, k = 0; k < (int)n; c = (c + 1) % CPU_SETSIZE) {
+		if (ncpus && !CPU_ISSET(c, &cpus))
+			continue;
+		w[k] = (struct worker) {
+			.nifc = nifc,
+			.id = k,
+			.cpu = ncpus ? c : -1,
+			.fanout_id = getpid(),
+			.stopfd = stopfd,
+			.switchfd = -1,
+			.nlfd = -1,
+		};
+		if (k && (w[k].switchfd = eventfd(0,
+		    EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+			err(1, "eventfd");
+		k++;
+	}
+
+	/* Follow the interfaces, unless they are replayed */
+	if (io_backend == &io_packet && (w[0].nlfd = nl_open()) == -1)
+		warnx("not following interface changes; use SIGHUP");
+	if (fast_path && io_backend == &io_packet)
+		fast_update(table, nifc);
+
+	/* Other workers start with SIGHUP blocked */
+	sigset_t mask, omask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &mask, &omask);
+	for (unsigned int k = 1; k < n; k++) {
+		int error = pthread_create(&w[k].thread, NULL,
+		    relay_worker, &w[k]);
+		if (error) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+
+	relay_worker(&w[0]);
+
+	if (n > 1) {
+		/* Wake the other workers so they see loop_stop */
+		uint64_t one = 1;
+		if (write(stopfd, &one, sizeof one) == -1)
+			warn("write stopfd");
+		for (unsigned int k = 1; k < n; k++) {
+			pthread_join(w[k].thread, NULL);
+			close(w[k].switchfd);
+		}
+		close(stopfd);
+	}
+	if (w[0].nlfd != -1)
+		close(w[0].nlfd);
+	if (fast_path && io_backend == &io_packet)
+		fast_close(table, nifc);
+	while (nretired)
+		free(retired[--nretired].ifc);
+	free(table);
+	table = NULL;
+	workers = NULL;
+	return w[0].done;
 }
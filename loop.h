@@ -1,4 +1,12 @@
 struct ifc;
-void relay_loop(struct ifc *ifc, unsigned int nifc);
+/* Relays between the interfaces, following changes to them as they
+ * happen with netlink (packet backend only).
+ * Returns 0 when loop_stop is set, or 1 once every interface's
+ * input has ended (pcap and memory backends). */
+int relay_loop(struct ifc *ifc, unsigned int nifc);
 extern volatile int loop_stop; /* Stops relay_loop(). */
+extern volatile int loop_reload; /* Rechecks every interface (SIGHUP) */
+extern unsigned int rx_batch;  /* recvmmsg() batch size, 0 for recvfrom() */
+extern unsigned int loop_workers;  /* Number of relay worker threads */
+extern int loop_fanout_mode;   /* PACKET_FANOUT_HASH or _CPU, for workers */
 
@@ -7,9 +7,23 @@
 #include <syslog.h>
 #include <unistd.h>
 
+#include <linux/if_packet.h>	/* PACKET_FANOUT_* */
+
+#include "capture.h"
+#include "dedup.h"
+#include "fast.h"
 #include "ifc.h"
+#include "io.h"
+#include "limit.h"
 #include "loop.h"
+#include "plog.h"
+#include "policy.h"
+#include "ring.h"
+#include "sock.h"
+#include "stats.h"
+#include "uring.h"
 #include "verbose.h"
+#include "vlan.h"
 
 /*
  * Lightweight DHCPv6 Relay Agent (RFC 6221) for Linux
@@ -19,7 +33,13 @@
 static void
 on_sighup()
 {
-	loop_stop = 1;
+	loop_reload = 1;
+}
+
+static void
+on_sigusr1()
+{
+	capture_toggle();
 }
 
 /* Converts string to int, returning true on success */
@@ -34,6 +54,24 @@ to_int(const char *arg, int *ret)
 	return 1;
 }
 
+/* Converts "rate[,burst]" to positive ints, the burst defaulting to
+ * the rate, returning true on success */
+static int
+to_rate(char *arg, unsigned int *rate, unsigned int *burst)
+{
+	char *comma = strchr(arg, ',');
+	int r, b;
+
+	if (comma)
+		*comma++ = '\0';
+	if (!to_int(arg, &r) || r < 1 ||
+	    (comma && (!to_int(comma, &b) || b < 1)))
+		return 0;
+	*rate = r;
+	*burst = comma ? b : r;
+	return 1;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -42,19 +80,130 @@ main(int argc, char *argv[])
 	struct ifc *ifc = NULL;
 	struct ifc *this_ifc = NULL;
 	unsigned int nifc = 0;
+	const char *stats_path = NULL;
+	const char *capture_path = NULL;
+	size_t capture_size = 64 << 20;
 	int i;
 
-	while ((ch = getopt(argc, argv, "i:o:t:v")) != -1)
+	while ((ch = getopt(argc, argv, "b:c:C:d:i:kl:L:o:p:r:R:S:t:T:u:vw:x")) != -1)
 		switch (ch) {
+		case 'b':
+			if (!to_int(optarg, &i) || i < 0 || i > 1024) {
+				error = 1;
+				warnx("-b: expected batch size from 0..1024");
+				break;
+			}
+			rx_batch = i;
+			break;
+		case 'c':
+			if (capture_filter(optarg) == -1) {
+				error = 1;
+				warnx("-c: too many filters");
+			}
+			break;
+		case 'C': ;
+			/* -C path[,MiB] */
+			char *mib = strrchr(optarg, ',');
+			if (mib) {
+				*mib++ = '\0';
+				if (!to_int(mib, &i) || i < 1 || i > 4095) {
+					error = 1;
+					warnx("-C: expected size from 1..4095 MiB");
+					break;
+				}
+				capture_size = (size_t)i << 20;
+			}
+			capture_path = optarg;
+			break;
+		case 'd':
+			if (!to_int(optarg, &i) || i < 0) {
+				error = 1;
+				warnx("-d: expected window in milliseconds");
+				break;
+			}
+			dedup_window = i;
+			break;
 		case 'i':
 		case 'o':
+		case 'T':
 			ifc = realloc(ifc, (nifc + 1) * sizeof *ifc);
 			if (!ifc)
 				err(1, "realloc");
 			this_ifc = &ifc[nifc++];
 			memset(this_ifc, 0, sizeof *this_ifc);
 			this_ifc->name = optarg;
-			this_ifc->side = ch == 'i' ? CLIENT : SERVER;
+			this_ifc->side = ch == 'i' ? CLIENT
+			    : ch == 'o' ? SERVER : TRUNK;
+			break;
+		case 'k':
+			fast_path = 1;
+			break;
+		case 'l':
+			if (!to_rate(optarg, &limit_rate, &limit_burst)) {
+				error = 1;
+				warnx("-l: expected rate[,burst] per second");
+			}
+			break;
+		case 'L':
+			if (!this_ifc || this_ifc->side != CLIENT) {
+				error = 1;
+				warnx("-L: must follow -i <interface>");
+				break;
+			}
+			if (!to_rate(optarg, &this_ifc->limit_rate,
+			    &this_ifc->limit_burst))
+			{
+				error = 1;
+				warnx("-L: expected rate[,burst] per second (%s)",
+				    this_ifc->name);
+			}
+			break;
+		case 'p':
+			if (strcmp(optarg, "all") == 0)
+				policy_mode = POLICY_ALL;
+			else if (strcmp(optarg, "hash") == 0)
+				policy_mode = POLICY_HASH;
+			else if (strcmp(optarg, "least") == 0)
+				policy_mode = POLICY_LEAST;
+			else {
+				error = 1;
+				warnx("-p: expected policy all, hash or least");
+			}
+			break;
+		case 'r': ;
+			/* -r blocks[,block-size] */
+			char *comma = strchr(optarg, ',');
+			int size = ring_block_size;
+			if (comma)
+				*comma++ = '\0';
+			if (!to_int(optarg, &i) || i < 0 ||
+			    (comma && !to_int(comma, &size)) ||
+			    size <= 0 || size % getpagesize())
+			{
+				error = 1;
+				warnx("-r: expected blocks[,block-size]"
+				    " (block-size a multiple of %d)",
+				    getpagesize());
+				break;
+			}
+			ring_block_nr = i;
+			ring_block_size = size;
+			break;
+		case 'R': ;
+			/* -R in-dir,out-dir */
+			char *out = strchr(optarg, ',');
+			if (!out || out == optarg || !out[1]) {
+				error = 1;
+				warnx("-R: expected in-dir,out-dir");
+				break;
+			}
+			*out++ = '\0';
+			io_pcap_in = optarg;
+			io_pcap_out = out;
+			io_backend = &io_pcap;
+			break;
+		case 'S':
+			stats_path = optarg;
 			break;
 		case 't':
 			if (!this_ifc || this_ifc->side != CLIENT) {
@@ -70,37 +219,132 @@ main(int argc, char *argv[])
 			}
 			this_ifc->trust_hops = i;
 			break;
+		case 'u':
+			if (!to_int(optarg, &i) || i < 1 || i > 32768 ||
+			    (i & (i - 1)))
+			{
+				error = 1;
+				warnx("-u: expected buffers, a power of two"
+				    " from 1..32768");
+				break;
+			}
+			uring_bufs = i;
+			break;
 		case 'v':
 			verbose_level++;
 			break;
+		case 'w': ;
+			/* -w workers[,hash|cpu] */
+			char *mode = strchr(optarg, ',');
+			if (mode)
+				*mode++ = '\0';
+			if (!to_int(optarg, &i) || i < 1 || i > 1024) {
+				error = 1;
+				warnx("-w: expected number of workers from 1..1024");
+				break;
+			}
+			loop_workers = i;
+			if (!mode || strcmp(mode, "hash") == 0)
+				loop_fanout_mode = PACKET_FANOUT_HASH;
+			else if (strcmp(mode, "cpu") == 0)
+				loop_fanout_mode = PACKET_FANOUT_CPU;
+			else {
+				error = 1;
+				warnx("-w: expected fanout mode hash or cpu");
+			}
+			break;
+		case 'x':
+			if (!this_ifc || this_ifc->side != CLIENT) {
+				error = 1;
+				warnx("-x: must follow -i <interface>");
+				break;
+			}
+			this_ifc->xdp = 1;
+			break;
 		default:
 			error = 1;
 		}
 
 	if (optind != argc)
 		error = 1;
+	if (ring_block_nr && uring_bufs) {
+		error = 1;
+		warnx("-r and -u cannot be used together");
+	}
+	if (policy_mode == POLICY_LEAST && loop_workers > 1) {
+		/* Replies reach whichever worker the server's flow hashes
+		 * to, not the one counting the transaction */
+		error = 1;
+		warnx("-p least cannot be used with more than one worker");
+	}
 	if (error) {
 		fprintf(stderr, "usage: %s"
 			" [-v]"
-			" [-i interface [-t trust]]..."
+			" [-b batch]"
+			" [-r blocks[,block-size] | -u buffers]"
+			" [-w workers[,hash|cpu]]"
+			" [-k]"
+			" [-R in-dir,out-dir]"
+			" [-S stats-file]"
+			" [-d msecs]"
+			" [-l rate[,burst]]"
+			" [-p all|hash|least]"
+			" [-C capture-file[,MiB] [-c interface|mac]...]"
+			" [-T trunk]..."
+			" [-i interface [-t trust] [-L rate[,burst]] [-x]]..."
 			" [-o interface]..."
 			"\n",
 			argv[0]);
 		exit(2);
 	}
 
-	if (signal(SIGHUP, on_sighup) == SIG_ERR)
-		err(1, "signal SIGHUP");
-	for (;;) {
-		struct ifaddrs *ifaddrs;
-		if (getifaddrs(&ifaddrs) == -1)
-			err(1, "getifaddrs");
-		for (unsigned int i = 0; i < nifc; i++)
-			ifc_set_info(ifaddrs, &ifc[i]);
-		freeifaddrs(ifaddrs);
+	/* Client interfaces named <trunk>.<vid> use the trunk */
+	if (vlan_build(ifc, nifc) == -1)
+		exit(1);
+
+	/* Interfaces are also known by their position */
+	for (unsigned int k = 0; k < nifc; k++)
+		ifc[k].num = k;
+
+	if (stats_path && stats_open(stats_path, ifc, nifc,
+	    io_backend == &io_packet ? loop_workers : 1) == -1)
+		exit(1);
+	sock_timestamps = stats_path != NULL;	/* For latency histograms */
+
+	/* Per-packet messages are formatted by a logger thread */
+	if (plog_start(ifc, io_backend == &io_packet && loop_workers
+	    ? loop_workers : 1) == -1)
+		exit(1);
+
+	/* SIGUSR1 pauses and resumes the capture */
+	if (capture_path && capture_open(capture_path, capture_size,
+	    ifc, nifc) == -1)
+		exit(1);
+	if (signal(SIGUSR1, on_sigusr1) == SIG_ERR)
+		err(1, "signal SIGUSR1");
 
-		loop_stop = 0;
+	if (io_backend != &io_packet) {
+		/* Replay captures instead of using the interfaces */
+		for (unsigned int i = 0; i < nifc; i++)
+			ifc_set_replay(&ifc[i]);
+		ifc_index_build(ifc, nifc);
 		relay_loop(ifc, nifc);
-		verbose("reloading interfaces\n");
+		plog_stop();
+		exit(0);
 	}
+
+	if (signal(SIGHUP, on_sighup) == SIG_ERR)
+		err(1, "signal SIGHUP");
+	struct ifaddrs *ifaddrs;
+	if (getifaddrs(&ifaddrs) == -1)
+		err(1, "getifaddrs");
+	for (unsigned int i = 0; i < nifc; i++)
+		ifc_set_info(ifaddrs, &ifc[i]);
+	freeifaddrs(ifaddrs);
+	ifc_index_build(ifc, nifc);
+
+	/* Changes to the interfaces are followed without stopping */
+	relay_loop(ifc, nifc);
+	plog_stop();
+	exit(0);
 }
@@ -0,0 +1,117 @@
+#include <err.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+
+#include "ifc.h"
+#include "nl.h"
+
+int
+nl_open(void)
+{
+	int s = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    NETLINK_ROUTE);
+	if (s == -1) {
+		warn("socket AF_NETLINK");
+		return -1;
+	}
+
+	struct sockaddr_nl snl = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_LINK | RTMGRP_IPV6_IFADDR,
+	};
+	if (bind(s, (struct sockaddr *)&snl, sizeof snl) == -1) {
+		warn("bind AF_NETLINK");
+		(void) close(s);
+		return -1;
+	}
+	return s;
+}
+
+/* Marks the interfaces that have the given index, or name if not NULL */
+static int
+nl_mark(const struct ifc *ifc, unsigned int nifc, char *changed,
+	unsigned int index, const char *name)
+{
+	int n = 0;
+
+	for (unsigned int i = 0; i < nifc; i++)
+		if (!changed[i] && ((index && ifc[i].index == index) ||
+		    (name && strncmp(ifc[i].name, name, IFNAMSIZ) == 0)))
+		{
+			changed[i] = 1;
+			n++;
+		}
+	return n;
+}
+
+/* Returns the interface name in a link message, or NULL */
+static const char *
+nl_ifname(const struct nlmsghdr *nh)
+{
+	const struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	int len = IFLA_PAYLOAD(nh);
+
+	for (const struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, len);
+	     rta = RTA_NEXT(rta, len))
+		if (rta->rta_type == IFLA_IFNAME &&
+		    memchr(RTA_DATA(rta), '\0', RTA_PAYLOAD(rta)))
+			return RTA_DATA(rta);
+	return NULL;
+}
+
+int
+nl_read(int fd, const struct ifc *ifc, unsigned int nifc, char *changed)
+{
+	union {
+		struct nlmsghdr nh;
+		char buf[16384];
+	} u;
+	struct sockaddr_nl from;
+	int marked = 0;
+
+	for (;;) {
+		socklen_t fromlen = sizeof from;
+		int len = recvfrom(fd, &u, sizeof u, 0,
+		    (struct sockaddr *)&from, &fromlen);
+		if (len == -1 && errno == ENOBUFS) {
+			/* Lost events; anything may have changed */
+			memset(changed, 1, nifc);
+			marked = nifc;
+			continue;
+		}
+		if (len == -1 && (errno == EAGAIN || errno == EINTR))
+			break;
+		if (len == -1) {
+			warn("recv AF_NETLINK");
+			return -1;
+		}
+		if (from.nl_pid != 0)
+			continue;	/* Only believe the kernel */
+
+		for (struct nlmsghdr *nh = &u.nh; NLMSG_OK(nh, len);
+		     nh = NLMSG_NEXT(nh, len))
+			switch (nh->nlmsg_type) {
+			case RTM_NEWLINK:
+			case RTM_DELLINK: ;
+				const struct ifinfomsg *ifi = NLMSG_DATA(nh);
+				marked += nl_mark(ifc, nifc, changed,
+				    ifi->ifi_index, nl_ifname(nh));
+				break;
+			case RTM_NEWADDR:
+			case RTM_DELADDR: ;
+				const struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+				if (ifa->ifa_family == AF_INET6 &&
+				    ifa->ifa_scope == RT_SCOPE_LINK)
+					marked += nl_mark(ifc, nifc, changed,
+					    ifa->ifa_index, NULL);
+				break;
+			}
+	}
+	return marked;
+}
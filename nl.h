@@ -0,0 +1,16 @@
+/*
+ * RTNETLINK link and IPv6 address events, so that the relay can
+ * follow changes to its interfaces without stopping.
+ */
+
+struct ifc;
+
+/* Opens a netlink socket subscribed to link and IPv6 address events.
+ * Returns the non-blocking socket, or -1 on error. */
+int nl_open(void);
+
+/* Reads the events waiting on socket fd, and sets changed[i] for each
+ * interface ifc[i] they may affect. If events were lost, every
+ * interface is marked.
+ * Returns the number of interfaces marked, or -1 on error. */
+int nl_read(int fd, const struct ifc *ifc, unsigned int nifc, char *changed);
@@ -0,0 +1,149 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pcap.h"
+
+#define PCAP_MAGIC_USEC	0xa1b2c3d4
+#define PCAP_MAGIC_NSEC	0xa1b23c4d
+#define PCAP_CIGAM_USEC	0xd4c3b2a1	/* Other byte order */
+#define PCAP_CIGAM_NSEC	0x4d3cb2a1
+#define LINKTYPE_ETHERNET 1
+
+struct pcap_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_rec {
+	uint32_t ts_sec;
+	uint32_t ts_frac;	/* usec or nsec */
+	uint32_t caplen;
+	uint32_t len;
+};
+
+static uint32_t
+swap32(const struct pcap_file *pc, uint32_t v)
+{
+	return pc->swap ? __builtin_bswap32(v) : v;
+}
+
+int
+pcap_open_read(struct pcap_file *pc, const char *path)
+{
+	struct pcap_hdr hdr;
+
+	pc->f = fopen(path, "rb");
+	if (!pc->f)
+		return -1;
+	if (fread(&hdr, sizeof hdr, 1, pc->f) != 1)
+		goto bad;
+	pc->swap = 0;
+	switch (hdr.magic) {
+	case PCAP_CIGAM_USEC:
+		pc->swap = 1;
+		/* FALLTHROUGH */
+	case PCAP_MAGIC_USEC:
+		pc->nsec = 0;
+		break;
+	case PCAP_CIGAM_NSEC:
+		pc->swap = 1;
+		/* FALLTHROUGH */
+	case PCAP_MAGIC_NSEC:
+		pc->nsec = 1;
+		break;
+	default:
+		goto bad;
+	}
+	if (swap32(pc, hdr.linktype) != LINKTYPE_ETHERNET)
+		goto bad;
+	pc->snaplen = swap32(pc, hdr.snaplen);
+	return 0;
+bad:
+	fclose(pc->f);
+	pc->f = NULL;
+	errno = EINVAL;
+	return -1;
+}
+
+int
+pcap_read(struct pcap_file *pc, void *buf, unsigned int size,
+	struct timespec *ts)
+{
+	struct pcap_rec rec;
+
+	if (fread(&rec, sizeof rec, 1, pc->f) != 1)
+		return ferror(pc->f) ? -1 : 0;
+	uint32_t caplen = swap32(pc, rec.caplen);
+	uint32_t keep = caplen < size ? caplen : size;
+	if (fread(buf, 1, keep, pc->f) != keep ||
+	    (caplen > keep && fseek(pc->f, caplen - keep, SEEK_CUR) == -1))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if (ts) {
+		ts->tv_sec = swap32(pc, rec.ts_sec);
+		ts->tv_nsec = swap32(pc, rec.ts_frac) * (pc->nsec ? 1 : 1000);
+	}
+	return keep;
+}
+
+int
+pcap_open_write(struct pcap_file *pc, const char *path)
+{
+	struct pcap_hdr hdr = {
+		.magic = PCAP_MAGIC_NSEC,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = 65535,
+		.linktype = LINKTYPE_ETHERNET,
+	};
+
+	pc->f = fopen(path, "wb");
+	if (!pc->f)
+		return -1;
+	pc->swap = 0;
+	pc->nsec = 1;
+	pc->snaplen = hdr.snaplen;
+	if (fwrite(&hdr, sizeof hdr, 1, pc->f) != 1) {
+		fclose(pc->f);
+		pc->f = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int
+pcap_write(struct pcap_file *pc, const struct iovec *iov, int iovcnt,
+	const struct timespec *ts)
+{
+	struct pcap_rec rec = {
+		.ts_sec = ts ? ts->tv_sec : 0,
+		.ts_frac = ts ? ts->tv_nsec : 0,
+	};
+
+	for (int i = 0; i < iovcnt; i++)
+		rec.len += iov[i].iov_len;
+	rec.caplen = rec.len;
+	if (fwrite(&rec, sizeof rec, 1, pc->f) != 1)
+		return -1;
+	for (int i = 0; i < iovcnt; i++)
+		if (iov[i].iov_len &&
+		    fwrite(iov[i].iov_base, iov[i].iov_len, 1, pc->f) != 1)
+			return -1;
+	return 0;
+}
+
+void
+pcap_close(struct pcap_file *pc)
+{
+	if (pc->f)
+		fclose(pc->f);
+	pc->f = NULL;
+}
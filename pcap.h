@@ -0,0 +1,38 @@
+/*
+ * Minimal reader and writer for classic libpcap capture files of
+ * ethernet frames (LINKTYPE_ETHERNET). Files are read in either byte
+ * order and with microsecond or nanosecond timestamps, and written
+ * in native byte order with nanosecond timestamps.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/uio.h>
+
+struct pcap_file {
+	FILE *f;
+	int swap;		/* File is in the other byte order */
+	int nsec;		/* Timestamps are in nanoseconds */
+	unsigned int snaplen;
+};
+
+/* Opens a capture file for reading.
+ * Returns 0 on success, -1 on error. */
+int pcap_open_read(struct pcap_file *pc, const char *path);
+
+/* Reads the next frame into buf[size], truncating it if necessary.
+ * If ts is not NULL, it receives the frame's timestamp.
+ * Returns the number of bytes stored, 0 at end of file, or -1 on error. */
+int pcap_read(struct pcap_file *pc, void *buf, unsigned int size,
+	struct timespec *ts);
+
+/* Creates a capture file for writing.
+ * Returns 0 on success, -1 on error. */
+int pcap_open_write(struct pcap_file *pc, const char *path);
+
+/* Appends a frame made of the buffers iov[0..iovcnt) to the file.
+ * Returns 0 on success, -1 on error. */
+int pcap_write(struct pcap_file *pc, const struct iovec *iov, int iovcnt,
+	const struct timespec *ts);
+
+void pcap_close(struct pcap_file *pc);
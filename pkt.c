@@ -1,17 +1,104 @@
 #include <errno.h>
+#include <stddef.h>
+#include <time.h>
 
+#include "csum.h"
 #include "pkt.h"
 
-/* Received into pkt->sll and pkt->raw[], using the previous alignment offset */
+void
+pkt_init(struct pkt *pkt)
+{
+	pkt->raw = pkt->buf;
+	pkt->rawsize = sizeof pkt->buf;
+	pkt->rawoff = PKT_RXOFF;
+	pkt->rawlen = 0;
+	pkt->ip6_hdr = NULL;
+	pkt->udphdr = NULL;
+	pkt->data = NULL;
+	pkt->datalen = 0;
+	pkt->hdr = NULL;
+	pkt->hdrlen = 0;
+	pkt->csum_ok = 0;
+	pkt->rxtime = 0;
+	pkt->nvlan = 0;
+	pkt->nopts = -1;
+}
+
+/* Rebases a header pointer from one L2 buffer to another */
+#define REBASE(p, from, to) \
+	((p) ? (void *)((to) + ((char *)(p) - (from))) : NULL)
+
+void
+pkt_own(struct pkt *pkt)
+{
+	char *from = pkt->raw;
+
+	if (from == pkt->buf)
+		return;
+	/* Keep the alignment, with full headroom */
+	unsigned int newoff = PKT_HEADROOM + (pkt->rawoff & 3);
+	memcpy(&pkt->buf[newoff], &from[pkt->rawoff], pkt->rawlen);
+	from += pkt->rawoff - newoff;
+	pkt->rawoff = newoff;
+	pkt->ip6_hdr = REBASE(pkt->ip6_hdr, from, pkt->buf);
+	pkt->udphdr = REBASE(pkt->udphdr, from, pkt->buf);
+	pkt->data = REBASE(pkt->data, from, pkt->buf);
+	pkt->raw = pkt->buf;
+	pkt->rawsize = sizeof pkt->buf;
+}
+
+#define PKT_CMSG_ALIGN	__attribute__((aligned(__alignof__(struct cmsghdr))))
+
+void
+pkt_cmsg(struct pkt *pkt, struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+
+	pkt->rxtime = 0;
+	pkt->nvlan = 0;
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_TIMESTAMPNS)
+		{
+			struct timespec ts;
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof ts);
+			pkt->rxtime = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+		} else if (cmsg->cmsg_level == SOL_PACKET &&
+		    cmsg->cmsg_type == PACKET_AUXDATA)
+		{
+			struct tpacket_auxdata aux;
+			memcpy(&aux, CMSG_DATA(cmsg), sizeof aux);
+			if (aux.tp_status & TP_STATUS_VLAN_VALID)
+				pkt->vlan[pkt->nvlan++] = aux.tp_vlan_tci;
+		}
+}
+
+/* Received into pkt->sll and pkt->raw[], after the headroom */
 int
 pkt_recv(int fd, struct pkt *pkt)
 {
-	socklen_t slen = sizeof pkt->sll;
-	ssize_t len = recvfrom(fd, &pkt->raw[pkt->rawoff],
-		sizeof pkt->raw - pkt->rawoff, 0,
-		(struct sockaddr *)&pkt->sll, &slen);
-	if (len >= 0)
+	char control[PKT_CMSG_SPACE] PKT_CMSG_ALIGN;
+
+	if (pkt->raw != pkt->buf)
+		pkt_init(pkt);	/* Stop borrowing a ring frame */
+	pkt->rawoff = PKT_RXOFF;
+	struct iovec iov = {
+		.iov_base = &pkt->raw[pkt->rawoff],
+		.iov_len = pkt->rawsize - pkt->rawoff,
+	};
+	struct msghdr msg = {
+		.msg_name = &pkt->sll,
+		.msg_namelen = sizeof pkt->sll,
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof control,
+	};
+	ssize_t len = recvmsg(fd, &msg, 0);
+	if (len >= 0) {
 		pkt->rawlen = len;
+		pkt_cmsg(pkt, &msg);
+	}
 
 	/* Packet has not been scanned */
 	pkt->ip6_hdr = NULL;
@@ -22,55 +109,162 @@ pkt_recv(int fd, struct pkt *pkt)
 	return len;
 }
 
-/* One's checksum of 16-bit words. len must be even */
-static uint32_t
-sum16(const void *data, unsigned int len)
+int
+pkt_recv_batch(int fd, struct pkt *pkts, unsigned int n)
 {
-	uint32_t sum = 0;
-	const uint16_t *p = data;
+	struct mmsghdr msg[n];
+	struct iovec iov[n];
+	char control[n][PKT_CMSG_SPACE] PKT_CMSG_ALIGN;
+
+	for (unsigned int i = 0; i < n; i++) {
+		struct pkt *pkt = &pkts[i];
+		if (pkt->raw != pkt->buf)
+			pkt_init(pkt);
+		pkt->rawoff = PKT_RXOFF;
+		iov[i].iov_base = &pkt->raw[pkt->rawoff];
+		iov[i].iov_len = pkt->rawsize - pkt->rawoff;
+		msg[i].msg_hdr = (struct msghdr) {
+			.msg_name = &pkt->sll,
+			.msg_namelen = sizeof pkt->sll,
+			.msg_iov = &iov[i],
+			.msg_iovlen = 1,
+			.msg_control = control[i],
+			.msg_controllen = sizeof control[i],
+		};
+	}
+
+	int ret = recvmmsg(fd, msg, n, MSG_DONTWAIT, NULL);
+	if (ret == -1)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
 
-	while (len) {
-		sum += *p++;
-		len -= 2;
+	for (int i = 0; i < ret; i++) {
+		struct pkt *pkt = &pkts[i];
+		pkt->rawlen = msg[i].msg_len;
+		pkt_cmsg(pkt, &msg[i].msg_hdr);
+		pkt->ip6_hdr = NULL;
+		pkt->udphdr = NULL;
+		pkt->data = NULL;
+		pkt->datalen = 0;
 	}
-	return sum;
+	return ret;
+}
+
+/* Partial sum of the IPv6 pseudo-header and the UDP header,
+ * excluding the UDP checksum field */
+static uint32_t
+udp6_header_sum(const struct pkt *pkt)
+{
+	uint32_t sum;
+
+	/* We can sum in network-endian, because math */
+	sum = csum_partial(&pkt->ip6_hdr->ip6_src, 2 * 16,
+	    htons(IPPROTO_UDP));
+	sum = csum_partial(&pkt->ip6_hdr->ip6_plen, 2, sum);
+	return csum_partial(pkt->udphdr, 6, sum);
 }
 
 /* Compute the IPv6 UDP checksum of the packet. */
 uint16_t
 udp6_checksum(const struct pkt *pkt)
 {
-	uint32_t sum;
+	uint32_t sum = udp6_header_sum(pkt);
+	unsigned int off = 0;
 
-	/* We can sum in network-endian, because math */
-	sum = sum16(&pkt->ip6_hdr->ip6_src, 16) +
-	      sum16(&pkt->ip6_hdr->ip6_dst, 16) +
-	      sum16(&pkt->ip6_hdr->ip6_plen, 2) +
-	      htons(IPPROTO_UDP) +
-	      sum16(pkt->udphdr, 6) +
-	      sum16(pkt->data, pkt->datalen & ~1);
-	if (pkt->datalen & 1) {
-		unsigned char last[2] = { pkt->data[pkt->datalen - 1], 0 };
-		sum += sum16(last, sizeof last);
+	if (pkt->hdr) {
+		/* Start of the payload in the split header */
+		char *start = (char *)(pkt->udphdr + 1);
+		off = pkt->hdr + pkt->hdrlen - start;
+		sum = csum_partial(start, off, sum);
 	}
+	return csum_finish(csum_add(sum,
+	    csum_at(csum_partial(pkt->data, pkt->datalen, 0), off)));
+}
+
+uint32_t
+pkt_payload_sum(const struct pkt *pkt)
+{
+	/* The checksum covers the headers and the payload */
+	return csum_sub((uint16_t)~pkt->udphdr->uh_sum,
+	    udp6_header_sum(pkt));
+}
 
-	/* Roll over the carries */
-	if (sum > 0xffff) {
-		sum = (sum & 0xffff) + (sum >> 16);
-		if (sum > 0xffff)
-			sum = (sum & 0xffff) + 1;
+void
+pkt_set_payload_sum(struct pkt *pkt, uint32_t sum)
+{
+	pkt->udphdr->uh_sum = csum_finish(csum_add(sum,
+	    udp6_header_sum(pkt)));
+	pkt->csum_ok = 1;
+}
+
+void
+pkt_set_src(struct pkt *pkt, const struct in6_addr *src)
+{
+	if (pkt->csum_ok)
+		pkt->udphdr->uh_sum = csum_replace(pkt->udphdr->uh_sum,
+		    &pkt->ip6_hdr->ip6_src, src, sizeof *src);
+	pkt->ip6_hdr->ip6_src = *src;
+}
+
+void
+pkt_iov(const struct pkt *pkt, struct iovec iov[2])
+{
+	if (pkt->hdr) {
+		iov[0].iov_base = pkt->hdr;
+		iov[0].iov_len = pkt->hdrlen;
+	} else {
+		iov[0].iov_base = &pkt->raw[pkt->rawoff];
+		iov[0].iov_len = pkt->data - &pkt->raw[pkt->rawoff];
 	}
-	sum ^= 0xffff;
-	return sum ? sum : 0xffff;
+	iov[1].iov_base = pkt->data;
+	iov[1].iov_len = pkt->datalen;
+}
+
+unsigned int
+pkt_framelen(const struct pkt *pkt)
+{
+	if (pkt->hdr)
+		return pkt->hdrlen + pkt->datalen;
+	return pkt->data + pkt->datalen - &pkt->raw[pkt->rawoff];
 }
 
 /* Update checksum and send the packet */
 int
 pkt_send(int fd, struct pkt *pkt)
 {
-	if (pkt->udphdr)
+	if (!pkt->udphdr)
+		return send(fd, &pkt->raw[pkt->rawoff], pkt->rawlen, 0);
+	if (!pkt->csum_ok)
 		pkt->udphdr->uh_sum = udp6_checksum(pkt);
-	return send(fd, &pkt->raw[pkt->rawoff], pkt->rawlen, 0);
+
+	struct iovec iov[2];
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+	pkt_iov(pkt, iov);
+	return sendmsg(fd, &msg, 0);
+}
+
+/* Moves the 802.1Q/802.1ad tags at the front of an ethernet frame
+ * into pkt->vlan[], sliding the MAC addresses up over them, and sets
+ * sll_protocol to the ethertype that follows */
+static void
+pkt_pop_vlan(struct pkt *pkt)
+{
+	char *frame = &pkt->raw[pkt->rawoff];
+	uint16_t type, tci;
+
+	if (pkt->sll.sll_hatype != ARPHRD_ETHER)
+		return;
+	while (pkt->rawlen >= ETHER_HDR_LEN + 4 && pkt->nvlan < 2) {
+		memcpy(&type, frame + 12, 2);
+		if (type != htons(ETH_P_8021Q) && type != htons(ETH_P_8021AD))
+			break;
+		memcpy(&tci, frame + 14, 2);
+		pkt->vlan[pkt->nvlan++] = ntohs(tci);
+		memmove(frame + 4, frame, 12);
+		frame += 4;
+		pkt->rawoff += 4;
+		pkt->rawlen -= 4;
+	}
+	memcpy(&pkt->sll.sll_protocol, frame + 12, 2);
 }
 
 /* Scan pkt for IPv6 and UDP headers, and update pointers */
@@ -80,9 +274,21 @@ pkt_scan_udp(struct pkt *pkt)
 	unsigned int p = pkt->rawoff;
 	unsigned int pmax = pkt->rawlen + pkt->rawoff;
 
-	if (pkt->sll.sll_family != AF_PACKET ||
-	    pkt->sll.sll_protocol != ntohs(ETH_P_IPV6))
-		return -1;
+	pkt->csum_ok = 0;
+	pkt->hdr = NULL;
+	pkt->hdrlen = 0;
+	pkt->nopts = -1;
+	if (pkt->sll.sll_family != AF_PACKET)
+		goto not_udp;
+	if (pkt->sll.sll_protocol == htons(ETH_P_8021Q) ||
+	    pkt->sll.sll_protocol == htons(ETH_P_8021AD))
+	{
+		pkt_pop_vlan(pkt);
+		p = pkt->rawoff;
+		pmax = pkt->rawlen + pkt->rawoff;
+	}
+	if (pkt->sll.sll_protocol != htons(ETH_P_IPV6))
+		goto not_udp;
 
 	switch (pkt->sll.sll_hatype) {
 	case ARPHRD_ETHER:
@@ -90,18 +296,20 @@ pkt_scan_udp(struct pkt *pkt)
 		break;
 	/* TODO: 802.11 */
 	default:
-		return -1;
+		goto not_udp;
 	}
 	if (p > pmax)
-		return -1;
+		goto not_udp;
 
 	/* Make sure that rawoff aligns the rest of the packet to
 	 * a 4-byte boundary. */
 	if (p & 3) {
-		unsigned int newoff = 4 - ((p - pkt->rawoff) & 3);
+		unsigned int hdrlen = p - pkt->rawoff;
+		unsigned int newoff = 4 - (hdrlen & 3);
+		pkt_own(pkt);
 		memmove(&pkt->raw[newoff], &pkt->raw[pkt->rawoff],
 		    pkt->rawlen);
-		p = p - pkt->rawoff + newoff;
+		p = hdrlen + newoff;
 		pkt->rawoff = newoff;
 		pmax = pkt->rawlen + pkt->rawoff;
 	}
@@ -109,28 +317,53 @@ pkt_scan_udp(struct pkt *pkt)
 	/* Expect IPv6/UDP without options */
 	pkt->ip6_hdr = (struct ip6_hdr *)&pkt->raw[p];
 	if ((p += sizeof (struct ip6_hdr)) > pmax)
-		return -1;
+		goto not_udp;
 	if (p + ntohs(pkt->ip6_hdr->ip6_plen) > pmax)
-		return -1;
+		goto not_udp;
 	pmax = p + ntohs(pkt->ip6_hdr->ip6_plen);
 	if (pkt->ip6_hdr->ip6_nxt != IPPROTO_UDP)
-		return -1;
+		goto not_udp;
 	pkt->udphdr = (struct udphdr *)&pkt->raw[p];
 	if (p + ntohs(pkt->udphdr->uh_ulen) > pmax)
-		return -1;
+		goto not_udp;
 	if ((p += sizeof (struct udphdr)) > pmax)
-		return -1;
+		goto not_udp;
 	pkt->data = &pkt->raw[p];
 	pkt->datalen = ntohs(pkt->udphdr->uh_ulen) - sizeof (struct udphdr);
 
-	if (udp6_checksum(pkt) != pkt->udphdr->uh_sum)
+	if (udp6_checksum(pkt) != pkt->udphdr->uh_sum) {
+		errno = EBADMSG;
 		return -1;
+	}
+	pkt->csum_ok = 1;
 
 	return 0; // ntohs(pkt->udphdr->uh_ulen);
+
+not_udp:
+	errno = EPROTO;
+	return -1;
+}
+
+/* Moves the L2, IPv6 and UDP headers by delta bytes within pkt->raw[],
+ * growing (delta < 0) or shrinking the UDP payload at its start. */
+static void
+pkt_move_headers(struct pkt *pkt, int delta)
+{
+	char *hdr = &pkt->raw[pkt->rawoff];
+
+	memmove(hdr + delta, hdr, pkt->data - hdr);
+	pkt->rawoff += delta;
+	pkt->rawlen -= delta;
+	pkt->ip6_hdr = (struct ip6_hdr *)((char *)pkt->ip6_hdr + delta);
+	pkt->udphdr = (struct udphdr *)((char *)pkt->udphdr + delta);
+	pkt->data += delta;
 }
 
 /* Inserts len bytes of uninitialised data into the UDP payload
- * at offset off. Shifts other data upwards and updates length headers. */
+ * at offset off. Shifts other data upwards and updates length headers.
+ * Insertions at the start of the payload, and removal of the start
+ * of the payload, instead move the (shorter) headers into or out of
+ * the headroom in front of them. The headers may then be unaligned. */
 void *
 pkt_insert_udp_data(struct pkt *pkt, unsigned int off, int len)
 {
@@ -138,10 +371,23 @@ pkt_insert_udp_data(struct pkt *pkt, unsigned int off, int len)
 		errno = EINVAL;
 		return NULL;
 	}
-	if (len > 0 && pkt->rawoff + pkt->rawlen + len > sizeof pkt->raw) {
+	if ((off == 0 && len > 0 && (unsigned int)len <= pkt->rawoff) ||
+	    (int)off + len == 0)
+	{
+		pkt->csum_ok = 0;
+		pkt_move_headers(pkt, -len);
+		pkt->datalen += len;
+		pkt->udphdr->uh_ulen = htons((int)ntohs(pkt->udphdr->uh_ulen) + len);
+		pkt->ip6_hdr->ip6_plen = htons((int)ntohs(pkt->ip6_hdr->ip6_plen) + len);
+		return pkt->data;
+	}
+	if (len > 0 && pkt->rawoff + pkt->rawlen + len > pkt->rawsize)
+		pkt_own(pkt);
+	if (len > 0 && pkt->rawoff + pkt->rawlen + len > pkt->rawsize) {
 		errno = ENOMEM;
 		return NULL;
 	}
+	pkt->csum_ok = 0;	/* Caller may use pkt_set_payload_sum() */
 	memmove(pkt->data + ((int)off + len), pkt->data + off,
 		&pkt->raw[pkt->rawoff + pkt->rawlen] - (pkt->data + off));
 	pkt->rawlen += len;
@@ -151,6 +397,17 @@ pkt_insert_udp_data(struct pkt *pkt, unsigned int off, int len)
 	return pkt->data + off;
 }
 
+uint64_t
+pkt_time(const struct pkt *pkt)
+{
+	struct timespec ts;
+
+	if (pkt->rxtime)
+		return pkt->rxtime;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 const char *
 pkt_lladdr(const struct pkt *pkt)
 {
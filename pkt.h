@@ -14,43 +14,146 @@
 #include <net/ethernet.h>
 #include <netinet/udp.h>
 #include <netinet/ip6.h>
+#include <sys/uio.h>		/* struct iovec */
 #include <arpa/inet.h>		/* htonl(), ntohl() */
 #include <linux/if_packet.h>	/* sockaddr_ll */
 #include <linux/if_ether.h>	/* ETH_P_* */
 #include <linux/if_arp.h>	/* ARPHRD_* */
 
+/* Space kept in front of received frames. The headers are moved back
+ * into it to insert data at the start of the UDP payload, so that the
+ * payload itself need not move. */
+#define PKT_HEADROOM	256
+
+/* Offset at which frames are received: after the headroom, and
+ * placing the IPv6 header behind an ethernet header 4-byte aligned */
+#define PKT_RXOFF	(PKT_HEADROOM + 2)
+
+/* Largest headers that can be built apart from the payload */
+#define PKT_HDR_MAX	256
+
+/* A DHCPv6 option found in pkt->data[] by dhcp_index() */
+struct pkt_opt {
+	uint16_t code;
+	uint16_t len;
+	uint16_t off;		/* Of its data, from pkt->data */
+	uint16_t depth;		/* Of the message holding it (see msg[]) */
+};
+#define PKT_OPTS	32	/* Options indexed, at most */
+#define PKT_MSGS	8	/* Nested messages indexed, at most */
+
 struct pkt {
 	struct sockaddr_ll sll; /* (Not used when sending) */
-	struct ip6_hdr *ip6_hdr;/* NULL or points into data */
-	struct udphdr *udphdr;	/* NULL or points into data */
-	char *data;		/* NULL or points into data */
+	struct ip6_hdr *ip6_hdr;/* NULL or points into raw or hdr */
+	struct udphdr *udphdr;	/* NULL or points into raw or hdr */
+	char *data;		/* NULL or points into raw */
 	unsigned int datalen;
+	char *hdr;		/* NULL or hdrbuf: headers built apart from data */
+	unsigned int hdrlen;
+	int csum_ok;		/* udphdr->uh_sum is valid for the packet */
+	uint64_t rxtime;	/* Receive time in ns (CLOCK_REALTIME), or 0 */
+	uint16_t vlan[2];	/* 802.1Q TCIs received, outer first */
+	unsigned int nvlan;	/* (The tags are not in raw[]) */
 	unsigned int rawoff;    /* L2 padding offset */
 	unsigned int rawlen;	/* L2 packet size (excludes rawoff) */
-	char raw[65536+4];	/* L2 packet data (starts at rawoff) */
+	char *raw;		/* L2 packet data (starts at rawoff) */
+	/* Index of the DHCPv6 message in data[], built by dhcp_index():
+	 * msg[0] is the whole message, msg[d + 1] the one in msg[d]'s
+	 * RELAY_MSG option. The index is reset by pkt_scan_udp(); it is
+	 * not updated when data[] is moved. */
+	int nopts;		/* -1 until indexed */
+	unsigned int nmsgs;
+	struct { uint16_t off, len; } msg[PKT_MSGS];
+	struct pkt_opt opt[PKT_OPTS];
+	unsigned int rawsize;	/* Usable size of raw[] */
+	char hdrbuf[PKT_HDR_MAX];
+	char buf[PKT_HEADROOM+65536+4]; /* Own storage; raw may instead borrow a frame */
 };
-#define PKT_INIT { .rawoff = 0 }
 
-/* Scans an L2 packet and sets the header pointers.
- * On entry, the sll, rawlen, rawoff and raw[] fields of pkt must be set.
+/* Initialises pkt so that raw points to its own storage */
+void pkt_init(struct pkt *pkt);
+
+/*
+ * A packet's L2 frame is normally contiguous in raw[]: the L2, IPv6 and
+ * UDP headers, then the UDP payload at data. A packet may instead be
+ * "split" (hdr != NULL): its frame is then hdr[0..hdrlen), holding
+ * all headers and the start of the UDP payload, followed by
+ * data[0..datalen), which is left where it was received.
+ */
+
+/* Scans an L2 packet and sets the header pointers. VLAN tags still in
+ * the frame are first moved into pkt->vlan[].
+ * On entry, the sll, rawlen, rawoff, raw[] and nvlan fields of pkt
+ * must be set.
  * On success the fields ip6_hdr, udphdr, data and datalen
  * will be set, and point into pkt->raw[].
- * Returns 0 on success, -1 if this is not a valid udp packet. */
+ * Returns 0 on success, -1 if this is not a valid udp packet
+ * (errno EPROTO) or its checksum is wrong (errno EBADMSG). */
 int pkt_scan_udp(struct pkt *pkt);
 
-/* Recieves from AF_PACKET into a packet structure.
+/* Copies a borrowed frame (see ring_recv()) into pkt->buf, so that
+ * it may be modified beyond its original extent. */
+void pkt_own(struct pkt *pkt);
+
+/* Space for the SO_TIMESTAMPNS and PACKET_AUXDATA control messages,
+ * which CMSG_SPACE() rounds up to keep arrays of them aligned */
+#define PKT_CMSG_SPACE	(CMSG_SPACE(sizeof (struct timespec)) + \
+			 CMSG_SPACE(sizeof (struct tpacket_auxdata)))
+
+/* Sets the receive timestamp and VLAN tag of a packet from the
+ * control messages received with it */
+void pkt_cmsg(struct pkt *pkt, struct msghdr *msg);
+
+/* Recieves from AF_PACKET into a packet structure, with the
+ * kernel's receive timestamp if the socket has SO_TIMESTAMPNS,
+ * and the VLAN tag it removed if the socket has PACKET_AUXDATA.
  * Returns -1 on error, 0 if socket closed. */
 int pkt_recv(int fd, struct pkt *pkt);
 
-/* Updates UDP packet checksum and transmits it as L2 packet */
+/* Receives up to n packets with one recvmmsg() call, without blocking,
+ * like pkt_recv().
+ * Returns the number of packets received (0 if none were waiting),
+ * or -1 on error. */
+int pkt_recv_batch(int fd, struct pkt *pkts, unsigned int n);
+
+/* Computes the UDPv6 checksum of a scanned packet */
+uint16_t udp6_checksum(const struct pkt *pkt);
+
+/* Returns the partial checksum of the UDP payload (see csum.h),
+ * derived from the headers and a valid UDP checksum field,
+ * i.e. when pkt->csum_ok is set. */
+uint32_t pkt_payload_sum(const struct pkt *pkt);
+
+/* Sets the UDP checksum field from the partial checksum of the
+ * payload and the current headers, and sets pkt->csum_ok. */
+void pkt_set_payload_sum(struct pkt *pkt, uint32_t sum);
+
+/* Changes the IPv6 source address, updating a valid UDP checksum
+ * incrementally. */
+void pkt_set_src(struct pkt *pkt, const struct in6_addr *src);
+
+/* Sets iov[0..1] to the frame's headers and payload. */
+void pkt_iov(const struct pkt *pkt, struct iovec iov[2]);
+
+/* Returns the length of the frame, as transmitted */
+unsigned int pkt_framelen(const struct pkt *pkt);
+
+/* Updates UDP packet checksum (unless pkt->csum_ok)
+ * and transmits it as L2 packet */
 int pkt_send(int fd, struct pkt *pkt);
 
 /* Inserts len bytes of data into the UDP payloat at offset off.
  * If len is negative, then removes the -len bytes before offset off.
- * Shifts remaining data and updates headers.
+ * Shifts remaining data, or moves the headers into or out of the
+ * headroom when data is added or removed at the start of the payload,
+ * and updates headers. Clears pkt->csum_ok.
  * Returns NULL on error, or (if len>0) a pointer to insert len bytes of data,
  * otherwise a meaningless non-NULL pointer on success. */
 void *pkt_insert_udp_data(struct pkt *pkt, unsigned int off, int len);
 
+/* Returns the packet's receive time (pkt->rxtime), or if it has none,
+ * the time now, in ns (CLOCK_REALTIME) */
+uint64_t pkt_time(const struct pkt *pkt);
+
 /* Returns pkt->sll.sll_addr as a static string */
 const char *pkt_lladdr(const struct pkt *pkt);
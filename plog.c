@@ -0,0 +1,287 @@
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+
+#include "dumphex.h"
+#include "ifc.h"
+#include "pkt.h"
+#include "plog.h"
+
+const unsigned char plog_level[PLOG_MAX] = {
+	[PLOG_CLIENT] = 2,
+	[PLOG_RELAY] = 1,
+	[PLOG_SERVER] = 2,
+	[PLOG_REPLY] = 1,
+	[PLOG_IFID] = 0,
+	[PLOG_DISCARD] = 2,
+	[PLOG_HOPS] = 1,
+	[PLOG_DUP] = 2,
+	[PLOG_BIG] = 0,
+	[PLOG_BAD_RELAY] = 1,
+	[PLOG_BAD_IFID] = 0,
+	[PLOG_NO_OPTS] = 0,
+	[PLOG_BEFORE_WRAP] = 2,
+	[PLOG_AFTER_WRAP] = 2,
+};
+
+#define PLOG_RING	1024	/* Records per worker */
+
+/* A worker's ring. The worker advances head and the logger tail;
+ * they are kept on separate cache lines. */
+struct ring {
+	unsigned long head;
+	unsigned long drops;	/* Records that did not fit */
+	_Alignas(64) unsigned long tail;
+	unsigned long drops_seen;
+	_Alignas(64) struct plog_rec rec[PLOG_RING];
+};
+
+static _Thread_local struct ring *plog_self;
+static struct ring *rings;
+static unsigned int nrings;
+static const struct ifc *plog_ifc;
+static pthread_t logger;
+static int wakefd = -1;
+static int sleeping;		/* The logger waits on wakefd */
+static volatile int stopping;
+
+/* Formats a record; name and to are its interfaces' names */
+static void
+plog_format(const struct plog_rec *rec, const char *name, const char *to)
+{
+	static const char hex[] = "0123456789abcdef";
+	char mac[3 * 8], *p = mac;
+	char addr[INET6_ADDRSTRLEN];
+
+	for (unsigned int i = 0; i < rec->halen; i++) {
+		if (i) *p++ = ':';
+		*p++ = hex[rec->mac[i] >> 4];
+		*p++ = hex[rec->mac[i] & 0xf];
+	}
+	*p = '\0';
+
+	flockfile(stderr);	/* Keep a record's lines together */
+	switch (rec->event) {
+	case PLOG_CLIENT:
+		fprintf(stderr, "%s: message from client %s\n", name, mac);
+		break;
+	case PLOG_RELAY:
+		fprintf(stderr, "%s->%s: relaying client %s\n", name, to, mac);
+		break;
+	case PLOG_SERVER:
+		fprintf(stderr, "%s: message from server %s\n", name, mac);
+		break;
+	case PLOG_REPLY:
+		fprintf(stderr, "%s<-%s: server %s reply to %s\n", to, name,
+		    mac, inet_ntop(AF_INET6, &rec->dst, addr, sizeof addr));
+		break;
+	case PLOG_IFID:
+		warnx("%s: unexpected interface-id %.*s from %s", name,
+		    (int)rec->sniplen, (const char *)rec->snip, mac);
+		break;
+	case PLOG_DISCARD:
+		fprintf(stderr, "%s: discarding message type %u\n", name,
+		    rec->type);
+		break;
+	case PLOG_HOPS:
+		fprintf(stderr, "%s: too many nested forwards (%u) from %s\n",
+		    name, rec->hops, mac);
+		break;
+	case PLOG_DUP:
+		fprintf(stderr, "%s: duplicate message from %s\n", name, mac);
+		break;
+	case PLOG_BIG:
+		warnx("%s: big packet? from %s", name, mac);
+		break;
+	case PLOG_BAD_RELAY:
+		fprintf(stderr, "%s: bad DHCPv6 relay packet from %s\n",
+		    name, mac);
+		break;
+	case PLOG_BAD_IFID:
+		warnx("%s: oversized interface-id from %s", name, mac);
+		break;
+	case PLOG_NO_OPTS:
+		warnx("%s: missing relay options from %s", name, mac);
+		break;
+	case PLOG_BEFORE_WRAP:
+		dumphex(stderr, "before-wrap", rec->snip, rec->sniplen);
+		break;
+	case PLOG_AFTER_WRAP:
+		dumphex(stderr, "after-wrap", rec->snip, rec->sniplen);
+		break;
+	}
+	funlockfile(stderr);
+}
+
+void
+plog_pkt(enum plog_event ev, const struct ifc *ifc, const struct ifc *to,
+	const struct pkt *pkt, const void *snip, unsigned int len)
+{
+	struct ring *r = plog_self;
+	struct plog_rec buf, *rec = &buf;
+	unsigned long head = 0;
+
+	if (r) {
+		head = r->head;
+		if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >=
+		    PLOG_RING) {
+			__atomic_store_n(&r->drops, r->drops + 1,
+			    __ATOMIC_RELAXED);
+			return;
+		}
+		rec = &r->rec[head % PLOG_RING];
+	}
+
+	rec->event = ev;
+	rec->ifc = ifc->num;
+	rec->to = to ? to->num : 0;
+	rec->halen = pkt->sll.sll_halen < 8 ? pkt->sll.sll_halen : 8;
+	memcpy(rec->mac, pkt->sll.sll_addr, rec->halen);
+	rec->type = pkt->datalen > 0 ? pkt->data[0] : 0;
+	rec->hops = pkt->datalen > 1 ? pkt->data[1] : 0;
+	rec->len = pkt->datalen < 0xffff ? pkt->datalen : 0xffff;
+	if (pkt->ip6_hdr)
+		rec->dst = pkt->ip6_hdr->ip6_dst;
+	rec->sniplen = len < PLOG_SNIP ? len : PLOG_SNIP;
+	memcpy(rec->snip, snip, rec->sniplen);
+
+	if (!r) {
+		plog_format(rec, ifc->name, to ? to->name : NULL);
+		return;
+	}
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&sleeping, 0, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+		if (write(wakefd, &one, sizeof one) == -1)
+			; /* It is awake anyway */
+	}
+}
+
+/* Formats the waiting records of every ring.
+ * Returns the number formatted. */
+static unsigned long
+plog_drain(void)
+{
+	unsigned long n = 0;
+
+	for (unsigned int w = 0; w < nrings; w++) {
+		struct ring *r = &rings[w];
+		unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		unsigned long tail = r->tail;
+
+		for (; tail != head; tail++) {
+			const struct plog_rec *rec = &r->rec[tail % PLOG_RING];
+			plog_format(rec, plog_ifc[rec->ifc].name,
+			    plog_ifc[rec->to].name);
+			n++;
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+		unsigned long drops = __atomic_load_n(&r->drops,
+		    __ATOMIC_RELAXED);
+		if (drops != r->drops_seen) {
+			warnx("worker %u: %lu log records dropped", w,
+			    drops - r->drops_seen);
+			r->drops_seen = drops;
+		}
+	}
+	return n;
+}
+
+static void *
+plog_thread(void *arg)
+{
+	for (;;) {
+		if (plog_drain())
+			continue;
+		if (stopping)
+			break;
+		/* Sleep, unless a record came in meanwhile */
+		__atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+		if (plog_drain()) {
+			__atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		uint64_t count;
+		if (read(wakefd, &count, sizeof count) == -1 &&
+		    errno != EINTR)
+		{
+			warn("plog read");
+			break;
+		}
+		__atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+	}
+	plog_drain();
+	return NULL;
+}
+
+int
+plog_start(const struct ifc *ifc, unsigned int nworkers)
+{
+	rings = aligned_alloc(64, nworkers * sizeof *rings);
+	if (!rings) {
+		warn("plog rings");
+		return -1;
+	}
+	memset(rings, 0, nworkers * sizeof *rings);
+	nrings = nworkers;
+	plog_ifc = ifc;
+	wakefd = eventfd(0, EFD_CLOEXEC);
+	if (wakefd == -1) {
+		warn("eventfd");
+		goto fail;
+	}
+	/* The logger starts with the relay's signals blocked, so that they
+	 * reach worker 0 */
+	sigset_t mask, omask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, &omask);
+	int error = pthread_create(&logger, NULL, plog_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+	if (error) {
+		errno = error;
+		warn("pthread_create");
+		close(wakefd);
+		goto fail;
+	}
+	return 0;
+fail:
+	free(rings);
+	rings = NULL;
+	nrings = 0;
+	return -1;
+}
+
+void
+plog_bind(unsigned int worker)
+{
+	plog_self = worker < nrings ? &rings[worker] : NULL;
+}
+
+void
+plog_stop(void)
+{
+	uint64_t one = 1;
+
+	if (!rings)
+		return;
+	stopping = 1;
+	if (write(wakefd, &one, sizeof one) == -1)
+		warn("plog write");
+	pthread_join(logger, NULL);
+	close(wakefd);
+	plog_self = NULL;
+	free(rings);
+	rings = NULL;
+	nrings = 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * Per-packet log messages, kept off the relay's hot path. Workers
+ * append compact binary records to their own single-producer ring,
+ * without locks or system calls (unless the logger is asleep), and
+ * a logger thread formats them onto stderr. When a ring is full,
+ * records are dropped and counted rather than waiting; the logger
+ * reports how many. A thread without a ring, such as one outside
+ * relay_loop(), formats its records itself.
+ */
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+struct ifc;
+struct pkt;
+
+enum plog_event {
+	PLOG_CLIENT,		/* Message from a client */
+	PLOG_RELAY,		/* Relaying it to a server */
+	PLOG_SERVER,		/* Message from a server */
+	PLOG_REPLY,		/* Relaying the reply to a client */
+	PLOG_IFID,		/* Reply for an unknown interface-ID */
+	PLOG_DISCARD,		/* Message type not relayed */
+	PLOG_HOPS,		/* Too many nested RELAY-FORWs */
+	PLOG_DUP,		/* Retransmission (see dedup.h) */
+	PLOG_BIG,		/* Too big to wrap */
+	PLOG_BAD_RELAY,		/* Not a RELAY-REPL */
+	PLOG_BAD_IFID,		/* Oversized interface-ID */
+	PLOG_NO_OPTS,		/* No interface-ID or relay message */
+	PLOG_BEFORE_WRAP,	/* The message, before it is wrapped */
+	PLOG_AFTER_WRAP,	/* The RELAY-FORW header */
+	PLOG_MAX
+};
+
+/* The verbose_level at which each event is logged; 0 for warnings */
+extern const unsigned char plog_level[PLOG_MAX];
+
+/* Bytes of payload kept in a record */
+#define PLOG_SNIP	80
+
+struct plog_rec {
+	uint8_t event;		/* enum plog_event */
+	uint8_t halen;
+	uint8_t type;		/* DHCPv6 msg-type, or 0 */
+	uint8_t hops;		/* hop-count of a relay message */
+	uint16_t ifc;		/* Positions of the interfaces */
+	uint16_t to;
+	uint16_t len;		/* Of the DHCPv6 message */
+	uint16_t sniplen;
+	uint8_t mac[8];		/* Of the sender */
+	struct in6_addr dst;	/* IPv6 destination */
+	uint8_t snip[PLOG_SNIP];
+};
+
+extern int verbose_level;	/* (verbose.h) */
+
+/* Logs an event about a packet received on ifc (and relayed to the
+ * interface to, if not NULL), if verbose_level calls for it, with up
+ * to PLOG_SNIP bytes of snip[0..len). */
+#define plog(ev, ifc, to, pkt, snip, len) do { \
+		if (verbose_level >= plog_level[ev]) \
+			plog_pkt(ev, ifc, to, pkt, snip, len); \
+	} while (0)
+void plog_pkt(enum plog_event ev, const struct ifc *ifc, const struct ifc *to,
+	const struct pkt *pkt, const void *snip, unsigned int len);
+
+/* Starts the logger thread, with rings for nworkers workers. Records
+ * name interfaces by their position in ifc[], which must outlive it.
+ * Returns 0 on success, -1 on error. */
+int plog_start(const struct ifc *ifc, unsigned int nworkers);
+
+/* Makes the calling thread log into the given worker's ring */
+void plog_bind(unsigned int worker);
+
+/* Formats the records left in the rings, and stops the logger */
+void plog_stop(void);
@@ -0,0 +1,183 @@
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dhcp.h"
+#include "ifc.h"
+#include "pkt.h"
+#include "policy.h"
+
+#define OPTION_CLIENTID		1
+
+enum policy_mode policy_mode = POLICY_ALL;
+
+/* Outstanding transactions: a direct-mapped table, in which a new
+ * transaction displaces any older one in its slot. A clock hand
+ * sweeps POLICY_SWEEP slots per new transaction for ones that have
+ * timed out, so that the counts do not drift up. */
+#define POLICY_BITS	10
+#define POLICY_SLOTS	(1u << POLICY_BITS)
+#define POLICY_SWEEP	2
+
+struct txn {
+	uint32_t tag;		/* 0 if free */
+	unsigned int server;
+	uint64_t expires;
+};
+
+struct policy {
+	uint64_t *seed;			/* [nifc] hash of each name */
+	unsigned int *outstanding;	/* [nifc] */
+	unsigned int hand;
+	struct txn txn[POLICY_SLOTS];
+};
+
+static uint64_t
+mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+/* FNV-1a */
+static uint64_t
+hash_bytes(const void *data, size_t len)
+{
+	const unsigned char *b = data;
+	uint64_t h = 0xcbf29ce484222325ull;
+
+	while (len--)
+		h = (h ^ *b++) * 0x100000001b3ull;
+	return h;
+}
+
+struct policy *
+policy_new(const struct ifc *ifc, unsigned int nifc)
+{
+	if (policy_mode == POLICY_ALL)
+		return NULL;
+
+	struct policy *p = calloc(1, sizeof *p);
+	if (!p || !(p->seed = calloc(nifc, sizeof *p->seed)) ||
+	    !(p->outstanding = calloc(nifc, sizeof *p->outstanding)))
+		err(1, "calloc");
+	/* Servers are known by name, so that every worker and every
+	 * restart agrees on a client's server */
+	for (unsigned int i = 0; i < nifc; i++)
+		p->seed[i] = hash_bytes(ifc[i].name, strlen(ifc[i].name));
+	return p;
+}
+
+void
+policy_free(struct policy *p)
+{
+	if (p) {
+		free(p->seed);
+		free(p->outstanding);
+		free(p);
+	}
+}
+
+/* Returns a client message's transaction-id, with bit 24 set so that
+ * it is never 0 */
+static uint32_t
+msg_xid(const char *msg)
+{
+	return 1u << 24 | (uint8_t)msg[1] << 16 | (uint8_t)msg[2] << 8 |
+	    (uint8_t)msg[3];
+}
+
+void
+policy_key(struct pkt *pkt, struct policy_key *key)
+{
+	unsigned int depth;
+	const char *msg = dhcp_client_msg(pkt, &depth);
+	const struct pkt_opt *duid = msg ? dhcp_opt(pkt, depth,
+	    OPTION_CLIENTID) : NULL;
+
+	key->hash = duid ? hash_bytes(pkt->data + duid->off, duid->len)
+	    : hash_bytes(pkt->sll.sll_addr, pkt->sll.sll_halen);
+	key->xid = msg ? msg_xid(msg) : 0;
+	key->time = pkt_time(pkt);
+}
+
+/* Returns the slot and tag of a client interface's transaction */
+static struct txn *
+txn_find(struct policy *p, unsigned int i, uint32_t xid, uint32_t *tag)
+{
+	uint64_t h = mix((uint64_t)i << 32 | xid);
+
+	*tag = (h >> 32) | 1;
+	return &p->txn[h & (POLICY_SLOTS - 1)];
+}
+
+static void
+txn_end(struct policy *p, struct txn *t)
+{
+	if (t->tag) {
+		p->outstanding[t->server]--;
+		t->tag = 0;
+	}
+}
+
+int
+policy_choose(struct policy *p, unsigned int i,
+	const struct policy_key *key, const unsigned int *servers,
+	unsigned int n)
+{
+	int best = -1;
+	uint64_t best_score = 0;
+
+	/* The highest score wins, after the fewest outstanding */
+	for (unsigned int k = 0; k < n; k++) {
+		unsigned int s = servers[k];
+		uint64_t score = mix(key->hash ^ p->seed[s]);
+		if (best != -1) {
+			if (policy_mode == POLICY_LEAST &&
+			    p->outstanding[s] != p->outstanding[best]) {
+				if (p->outstanding[s] > p->outstanding[best])
+					continue;
+			} else if (score <= best_score)
+				continue;
+		}
+		best = s;
+		best_score = score;
+	}
+	if (best == -1 || policy_mode != POLICY_LEAST || !key->xid)
+		return best;
+
+	for (unsigned int k = 0; k < POLICY_SWEEP; k++) {
+		struct txn *t = &p->txn[p->hand++ & (POLICY_SLOTS - 1)];
+		if (t->tag && t->expires <= key->time)
+			txn_end(p, t);
+	}
+	uint32_t tag;
+	struct txn *t = txn_find(p, i, key->xid, &tag);
+	txn_end(p, t);	/* A retransmission, or displaced */
+	t->tag = tag;
+	t->server = best;
+	t->expires = key->time + POLICY_TIMEOUT;
+	p->outstanding[best]++;
+	return best;
+}
+
+void
+policy_reply(struct policy *p, unsigned int s, unsigned int i,
+	struct pkt *pkt)
+{
+	unsigned int depth;
+	uint32_t tag;
+
+	if (policy_mode != POLICY_LEAST)
+		return;
+	const char *msg = dhcp_client_msg(pkt, &depth);
+	if (!msg)
+		return;
+	struct txn *t = txn_find(p, i, msg_xid(msg), &tag);
+	if (t->tag == tag && t->server == s)
+		txn_end(p, t);
+}
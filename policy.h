@@ -0,0 +1,55 @@
+/*
+ * Policies for choosing which servers a client's message is relayed
+ * to (-p). By default it goes to every server interface. Otherwise it
+ * goes to one:
+ *  - hash: chosen by rendezvous hashing of the client's DUID (or its
+ *    link-layer address if it sent none), so that a client sticks to a
+ *    server while the set of servers stays the same;
+ *  - least: the one with the fewest transactions outstanding, ties
+ *    broken as for hash. A transaction is outstanding from the time it
+ *    is relayed until a reply with its transaction-id is relayed back
+ *    to the client's interface, or until POLICY_TIMEOUT.
+ * Each worker keeps its own counts, so least needs a single worker:
+ * a reply is unwrapped by whichever worker its server's flow reaches.
+ */
+
+#include <stdint.h>
+
+struct ifc;
+struct pkt;
+
+enum policy_mode { POLICY_ALL, POLICY_HASH, POLICY_LEAST };
+extern enum policy_mode policy_mode;
+
+#define POLICY_TIMEOUT	2000000000ull	/* ns */
+
+struct policy;
+
+/* What a policy needs from a client's message, taken before it is
+ * wrapped */
+struct policy_key {
+	uint64_t hash;		/* Of its DUID or link-layer address */
+	uint32_t xid;		/* 0 if it has no transaction-id */
+	uint64_t time;		/* When it was received */
+};
+
+/* Creates a worker's policy state for the interfaces.
+ * Returns NULL if every server is to be sent every message. */
+struct policy *policy_new(const struct ifc *ifc, unsigned int nifc);
+
+void policy_free(struct policy *p);
+
+/* Describes a message from a client */
+void policy_key(struct pkt *pkt, struct policy_key *key);
+
+/* Chooses one of the servers[0..n) (positions of interfaces) for a
+ * message from a client on interface i, and counts it as outstanding.
+ * Returns its position, or -1 if n is 0. */
+int policy_choose(struct policy *p, unsigned int i,
+	const struct policy_key *key, const unsigned int *servers,
+	unsigned int n);
+
+/* Notes a message that server interface s relayed for client interface
+ * i, unwrapped, ending the transaction it answers. */
+void policy_reply(struct policy *p, unsigned int s, unsigned int i,
+	struct pkt *pkt);
@@ -0,0 +1,140 @@
+#include <err.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "pkt.h"
+#include "ring.h"
+
+unsigned int ring_block_size = 1 << 17;
+unsigned int ring_block_nr;
+
+/* Frames are variable-sized in TPACKET_V3, but the kernel
+ * still insists on a nominal frame size for its sanity checks. */
+#define RING_FRAME_SIZE		2048
+
+/* How long a partly-filled block may wait before it is retired
+ * to userspace. Bounds the latency added by the ring. */
+#define RING_BLOCK_TIMEOUT_MS	4
+
+static struct tpacket_block_desc *
+ring_block(const struct ring *ring, unsigned int i)
+{
+	return (struct tpacket_block_desc *)
+	    (ring->map + (size_t)i * ring->block_size);
+}
+
+int
+ring_setup(int s, struct ring *ring)
+{
+	int version = TPACKET_V3;
+	if (setsockopt(s, SOL_PACKET, PACKET_VERSION,
+	    &version, sizeof version) == -1)
+	{
+		warn("setsockopt PACKET_VERSION");
+		return -1;
+	}
+
+	/* Leave headroom in front of each frame, see pkt_insert_udp_data() */
+	unsigned int reserve = PKT_HEADROOM;
+	if (setsockopt(s, SOL_PACKET, PACKET_RESERVE,
+	    &reserve, sizeof reserve) == -1)
+	{
+		warn("setsockopt PACKET_RESERVE");
+		return -1;
+	}
+
+	struct tpacket_req3 req = {
+	    .tp_block_size = ring_block_size,
+	    .tp_block_nr = ring_block_nr,
+	    .tp_frame_size = RING_FRAME_SIZE,
+	    .tp_frame_nr = ring_block_size / RING_FRAME_SIZE * ring_block_nr,
+	    .tp_retire_blk_tov = RING_BLOCK_TIMEOUT_MS,
+	};
+	if (setsockopt(s, SOL_PACKET, PACKET_RX_RING, &req, sizeof req) == -1)
+	{
+		warn("setsockopt PACKET_RX_RING");
+		return -1;
+	}
+
+	size_t size = (size_t)ring_block_size * ring_block_nr;
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_LOCKED | MAP_POPULATE, s, 0);
+	if (map == MAP_FAILED) {
+		/* MAP_LOCKED may exceed RLIMIT_MEMLOCK; retry without */
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, s, 0);
+		if (map == MAP_FAILED) {
+			warn("mmap rx ring");
+			return -1;
+		}
+	}
+
+	ring->map = map;
+	ring->block_size = ring_block_size;
+	ring->block_nr = ring_block_nr;
+	ring->block = 0;
+	ring->frames_left = 0;
+	ring->frame = NULL;
+	return 0;
+}
+
+void
+ring_close(struct ring *ring)
+{
+	if (ring->map)
+		munmap(ring->map, (size_t)ring->block_size * ring->block_nr);
+	ring->map = NULL;
+}
+
+int
+ring_recv(struct ring *ring, struct pkt *pkt)
+{
+	struct tpacket_block_desc *bd = ring_block(ring, ring->block);
+
+	if (!ring->frames_left && ring->frame) {
+		/* Finished with the current block; give it back */
+		__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+		    __ATOMIC_RELEASE);
+		ring->block = (ring->block + 1) % ring->block_nr;
+		ring->frame = NULL;
+		bd = ring_block(ring, ring->block);
+	}
+
+	if (!ring->frame) {
+		if (!(__atomic_load_n(&bd->hdr.bh1.block_status,
+		    __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+			return 0;	/* Nothing ready */
+		ring->frames_left = bd->hdr.bh1.num_pkts;
+		ring->frame = (struct tpacket3_hdr *)
+		    ((char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+		if (!ring->frames_left)
+			return ring_recv(ring, pkt);	/* Empty block */
+	}
+
+	struct tpacket3_hdr *hdr = ring->frame;
+	ring->frames_left--;
+	ring->frame = (struct tpacket3_hdr *)
+	    ((char *)hdr + hdr->tp_next_offset);
+
+	/* The sockaddr_ll follows the aligned frame header */
+	memcpy(&pkt->sll, (char *)hdr + TPACKET_ALIGN(sizeof *hdr),
+	    sizeof pkt->sll);
+
+	/* Borrow the frame; the kernel aligns its network header.
+	 * Everything in front of tp_mac, including this header, may
+	 * be reused as headroom. */
+	pkt->raw = (char *)hdr;
+	pkt->rawoff = hdr->tp_mac;
+	pkt->rawlen = hdr->tp_snaplen;
+	pkt->rawsize = hdr->tp_mac + hdr->tp_snaplen;
+	pkt->rxtime = hdr->tp_sec * 1000000000ull + hdr->tp_nsec;
+	pkt->nvlan = 0;
+	if (hdr->tp_status & TP_STATUS_VLAN_VALID)
+		pkt->vlan[pkt->nvlan++] = hdr->hv1.tp_vlan_tci;
+	pkt->ip6_hdr = NULL;
+	pkt->udphdr = NULL;
+	pkt->data = NULL;
+	pkt->datalen = 0;
+	return pkt->rawlen;
+}
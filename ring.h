@@ -0,0 +1,38 @@
+/*
+ * A TPACKET_V3 receive ring mapped from an AF_PACKET socket.
+ * The kernel fills whole blocks of frames; the relay then walks
+ * the frames of each block in place and hands the block back
+ * once the last frame has been handled. This avoids one
+ * recvfrom() syscall and one copy per received packet.
+ */
+
+struct pkt;
+struct tpacket_block_desc;
+struct tpacket3_hdr;
+
+struct ring {
+	char *map;			/* mmap()ed blocks, or NULL */
+	unsigned int block_size;
+	unsigned int block_nr;
+	unsigned int block;		/* Index of the current block */
+	unsigned int frames_left;	/* Unread frames in current block */
+	struct tpacket3_hdr *frame;	/* Next frame in current block */
+};
+#define RING_INIT { .map = NULL }
+
+/* Ring geometry requested with -r; ring_block_nr == 0 disables rings */
+extern unsigned int ring_block_size;
+extern unsigned int ring_block_nr;
+
+/* Attaches a receive ring of ring_block_nr blocks to socket s.
+ * Must be called before the socket is bound.
+ * Returns 0 on success, -1 on error. */
+int ring_setup(int s, struct ring *ring);
+
+/* Unmaps the ring. The socket is not closed. */
+void ring_close(struct ring *ring);
+
+/* Points pkt at the next received frame of the ring, without copying.
+ * The frame stays valid until the next call to ring_recv().
+ * Returns the frame length, or 0 if the ring is empty. */
+int ring_recv(struct ring *ring, struct pkt *pkt);
@@ -1,5 +1,6 @@
 #include <err.h>
 #include <errno.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #include <arpa/inet.h> /* htons */
@@ -9,67 +10,26 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include "ring.h"
 #include "sock.h"
 
-#define lengthof(A) (sizeof (A) / sizeof (A)[0])
-
-/*
- * DHCPv6 filter for client-facing ethernet interfaces.
- * [sll_hatype == ARPHRD_ETHER]
- */
-static struct sock_filter ether_client_filter[] = {
-	/* "ip6 dst ff02::1:2 && udp dst port 547" */
-	{ 0x28, 0, 0, 0x0000000c },
-	{ 0x15, 0, 13, 0x000086dd },
-	{ 0x20, 0, 0, 0x00000026 },
-	{ 0x15, 0, 11, 0xff020000 },
-	{ 0x20, 0, 0, 0x0000002a },
-	{ 0x15, 0, 9, 0x00000000 },
-	{ 0x20, 0, 0, 0x0000002e },
-	{ 0x15, 0, 7, 0x00000000 },
-	{ 0x20, 0, 0, 0x00000032 },
-	{ 0x15, 0, 5, 0x00010002 },
-	{ 0x30, 0, 0, 0x00000014 },
-	{ 0x15, 0, 3, 0x00000011 },
-	{ 0x28, 0, 0, 0x00000038 },
-	{ 0x15, 0, 1, 0x00000223 },
-	{ 0x6, 0, 0, 0x00040000 },
-	{ 0x6, 0, 0, 0x00000000 },
-};
-const struct sock_fprog ether_client_fprog = {
-	lengthof(ether_client_filter),
-	ether_client_filter
-};
-
-/*
- * DHCPv6 filter for server-facing ethernet interfaces
- * [sll_hatype == ARPHRD_ETHER]
- */
-static struct sock_filter ether_server_filter[] = {
-	/* "ip6 dst net fe80::/10 && ip6 src net fe80::/10 && udp dst port 547" */
-	{ 0x28, 0, 0, 0x0000000c },
-	{ 0x15, 0, 11, 0x000086dd },
-	{ 0x20, 0, 0, 0x00000026 },
-	{ 0x54, 0, 0, 0xffc00000 },
-	{ 0x15, 0, 8, 0xfe800000 },
-	{ 0x20, 0, 0, 0x00000016 },
-	{ 0x54, 0, 0, 0xffc00000 },
-	{ 0x15, 0, 5, 0xfe800000 },
-	{ 0x30, 0, 0, 0x00000014 },
-	{ 0x15, 0, 3, 0x00000011 },
-	{ 0x28, 0, 0, 0x00000038 },
-	{ 0x15, 0, 1, 0x00000223 },
-	{ 0x6, 0, 0, 0x00040000 },
-	{ 0x6, 0, 0, 0x00000000 },
-};
-const struct sock_fprog ether_server_fprog = {
-	lengthof(ether_server_filter),
-	ether_server_filter
-};
+int sock_timestamps;
 
+int
+sock_attach_filter(int s, const struct sock_fprog *fprog)
+{
+	if (setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, fprog,
+	    sizeof *fprog) == -1)
+	{
+		warn("setsockopt SO_ATTACH_FILTER");
+		return -1;
+	}
+	return 0;
+}
 
 int
-sock_open(unsigned int ifindex, const struct sock_fprog *fprog)
+sock_open(unsigned int ifindex, const struct sock_fprog *fprog,
+	struct ring *ring, unsigned int fanout, int trunk)
 {
 	if (!ifindex) {
 		errno = EINVAL;
@@ -82,9 +42,31 @@ sock_open(unsigned int ifindex, const struct sock_fprog *fprog)
 		return -1;
 	}
 
+	/* The ring must exist before packets can arrive on the socket */
+	if (ring && ring_setup(s, ring) == -1)
+		goto fail;
+
+	/* Ring frames are always timestamped */
+	int one = 1;
+	if (!ring && sock_timestamps && setsockopt(s, SOL_SOCKET,
+	    SO_TIMESTAMPNS, &one, sizeof one) == -1)
+	{
+		warn("setsockopt SO_TIMESTAMPNS");
+		goto fail;
+	}
+
+	/* Trunks see the tags the kernel removes from frames */
+	if (trunk && setsockopt(s, SOL_PACKET, PACKET_AUXDATA,
+	    &one, sizeof one) == -1)
+	{
+		warn("setsockopt PACKET_AUXDATA");
+		goto fail;
+	}
+
+	/* Frames with an inner VLAN tag are not IPv6 to the kernel */
 	struct sockaddr_ll sll = {
 	    .sll_family = AF_PACKET,
-	    .sll_protocol = htons(ETH_P_IPV6),
+	    .sll_protocol = htons(trunk ? ETH_P_ALL : ETH_P_IPV6),
 	    .sll_ifindex = ifindex
 	};
 	if (bind(s, (struct sockaddr *)&sll, sizeof sll) == -1) {
@@ -103,16 +85,151 @@ sock_open(unsigned int ifindex, const struct sock_fprog *fprog)
 		goto fail;
 	}
 
-	if (fprog && setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, fprog,
-	    sizeof *fprog) == -1)
+	if (fprog && sock_attach_filter(s, fprog) == -1)
+		goto fail;
+
+	/* Fanout groups can only be joined by bound sockets */
+	if (fanout && setsockopt(s, SOL_PACKET, PACKET_FANOUT,
+	    &fanout, sizeof fanout) == -1)
 	{
-		warn("setsockopt SO_ATTACH_FILTER");
+		warn("setsockopt PACKET_FANOUT");
 		goto fail;
 	}
 
 	return s;
 
 fail:
+	if (ring)
+		ring_close(ring);
 	(void) close(s);
 	return -1;
 }
+
+int
+sock_error(int s)
+{
+	int error = 0;
+	socklen_t len = sizeof error;
+
+	if (getsockopt(s, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+		return errno;
+	return error;
+}
+
+/* Loads a big-endian value of size bytes from frame[off] */
+static int
+filter_load(const unsigned char *frame, unsigned int len, uint32_t off,
+	unsigned int size, uint32_t *val)
+{
+	if (off > len || size > len - off)
+		return -1;
+	*val = 0;
+	while (size--)
+		*val = (*val << 8) | frame[off++];
+	return 0;
+}
+
+/* Loads one of the kernel's ancillary values (SKF_AD_*) */
+static int
+filter_load_ad(const struct sockaddr_ll *sll, uint32_t ad, uint32_t *val)
+{
+	switch (ad) {
+	case SKF_AD_PROTOCOL: *val = ntohs(sll->sll_protocol); break;
+	case SKF_AD_PKTTYPE:  *val = sll->sll_pkttype; break;
+	case SKF_AD_IFINDEX:  *val = sll->sll_ifindex; break;
+	case SKF_AD_HATYPE:   *val = sll->sll_hatype; break;
+	default: return -1;
+	}
+	return 0;
+}
+
+unsigned int
+sock_filter_run(const struct sock_fprog *fprog, const void *frame,
+	unsigned int len, const struct sockaddr_ll *sll)
+{
+	static const unsigned int size[4] = { 4, 2, 1, 0 }; /* BPF_W,H,B */
+	uint32_t A = 0, X = 0, M[BPF_MEMWORDS] = { 0 };
+	uint32_t v;
+
+	for (unsigned int pc = 0; pc < fprog->len; pc++) {
+		const struct sock_filter *f = &fprog->filter[pc];
+		uint32_t src = BPF_SRC(f->code) == BPF_X ? X : f->k;
+
+		switch (BPF_CLASS(f->code)) {
+		case BPF_LD:
+			switch (BPF_MODE(f->code)) {
+			case BPF_ABS:
+				if (f->k >= (uint32_t)SKF_AD_OFF) {
+					if (filter_load_ad(sll,
+					    f->k - SKF_AD_OFF, &A) == -1)
+						return 0;
+					break;
+				}
+				/* FALLTHROUGH */
+			case BPF_IND:
+				if (filter_load(frame, len, f->k +
+				    (BPF_MODE(f->code) == BPF_IND ? X : 0),
+				    size[BPF_SIZE(f->code) >> 3], &A) == -1)
+					return 0;
+				break;
+			case BPF_IMM: A = f->k; break;
+			case BPF_LEN: A = len; break;
+			case BPF_MEM: A = M[f->k % BPF_MEMWORDS]; break;
+			default: return 0;
+			}
+			break;
+		case BPF_LDX:
+			switch (BPF_MODE(f->code)) {
+			case BPF_MSH:
+				if (filter_load(frame, len, f->k, 1, &v) == -1)
+					return 0;
+				X = (v & 0xf) << 2;
+				break;
+			case BPF_IMM: X = f->k; break;
+			case BPF_LEN: X = len; break;
+			case BPF_MEM: X = M[f->k % BPF_MEMWORDS]; break;
+			default: return 0;
+			}
+			break;
+		case BPF_ST:  M[f->k % BPF_MEMWORDS] = A; break;
+		case BPF_STX: M[f->k % BPF_MEMWORDS] = X; break;
+		case BPF_ALU:
+			switch (BPF_OP(f->code)) {
+			case BPF_ADD: A += src; break;
+			case BPF_SUB: A -= src; break;
+			case BPF_MUL: A *= src; break;
+			case BPF_DIV: if (!src) return 0; A /= src; break;
+			case BPF_MOD: if (!src) return 0; A %= src; break;
+			case BPF_AND: A &= src; break;
+			case BPF_OR:  A |= src; break;
+			case BPF_XOR: A ^= src; break;
+			case BPF_LSH: A <<= src & 31; break;
+			case BPF_RSH: A >>= src & 31; break;
+			case BPF_NEG: A = -A; break;
+			default: return 0;
+			}
+			break;
+		case BPF_JMP: ;
+			int cond;
+			switch (BPF_OP(f->code)) {
+			case BPF_JA:   pc += f->k; continue;
+			case BPF_JEQ:  cond = A == src; break;
+			case BPF_JGT:  cond = A > src; break;
+			case BPF_JGE:  cond = A >= src; break;
+			case BPF_JSET: cond = (A & src) != 0; break;
+			default: return 0;
+			}
+			pc += cond ? f->jt : f->jf;
+			break;
+		case BPF_RET:
+			return BPF_RVAL(f->code) == BPF_A ? A : f->k;
+		case BPF_MISC:
+			if (BPF_MISCOP(f->code) == BPF_TAX)
+				X = A;
+			else
+				A = X;
+			break;
+		}
+	}
+	return 0;
+}
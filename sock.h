@@ -1,8 +1,35 @@
+struct ring;
 struct sock_fprog;
+struct sockaddr_ll;
 
-/* 802.3 packet filters for DHCPv6 client and server messages */
-extern const struct sock_fprog ether_client_fprog;
-extern const struct sock_fprog ether_server_fprog;
+/* Whether sock_open() asks for kernel receive timestamps */
+extern int sock_timestamps;
 
-/* Opens an AF_PACKET socket on the interface and attaches a packet filter */
-int sock_open(unsigned int ifindex, const struct sock_fprog *fprog);
+/* Opens an AF_PACKET socket on the interface and attaches a packet filter
+ * (see filter_compile()).
+ * If ring is not NULL, a memory-mapped receive ring is also set up.
+ * If fanout is not 0, the socket joins that PACKET_FANOUT group
+ * (see SOCK_FANOUT()).
+ * If trunk is set, the socket receives VLAN-tagged frames, with the
+ * tag the kernel removed from each (see pkt_recv()). */
+int sock_open(unsigned int ifindex, const struct sock_fprog *fprog,
+	struct ring *ring, unsigned int fanout, int trunk);
+
+/* Attaches a packet filter to socket s, atomically replacing any
+ * filter it had.
+ * Returns 0 on success, -1 on error. */
+int sock_attach_filter(int s, const struct sock_fprog *fprog);
+
+/* Returns and clears the socket's pending error, such as ENETDOWN
+ * while its interface is down, or 0 if none. */
+int sock_error(int s);
+
+/* PACKET_FANOUT argument for a group id and mode */
+#define SOCK_FANOUT(id, mode) (((mode) << 16) | ((id) & 0xffff))
+
+/* Runs a classic socket filter over an L2 frame in userspace, as the
+ * kernel would for sockets that have no real interface. Ancillary
+ * loads (SKF_AD_*) come from sll.
+ * Returns the number of bytes of the frame to accept, 0 to drop it. */
+unsigned int sock_filter_run(const struct sock_fprog *fprog,
+	const void *frame, unsigned int len, const struct sockaddr_ll *sll);
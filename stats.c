@@ -0,0 +1,136 @@
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <net/if.h>
+#include <sys/mman.h>
+
+#include "ifc.h"
+#include "stats.h"
+
+const char *const stat_names[STAT_MAX] = {
+	[STAT_RX] = "rx",
+	[STAT_RELAYED] = "relayed",
+	[STAT_TX] = "tx",
+	[STAT_TX_ERR] = "tx_err",
+	[STAT_NOT_UDP] = "not_udp",
+	[STAT_BAD_CSUM] = "bad_csum",
+	[STAT_MSG_TYPE] = "msg_type",
+	[STAT_HOPS] = "hops",
+	[STAT_MALFORMED] = "malformed",
+	[STAT_BIG] = "big",
+	[STAT_IFID] = "unknown_ifid",
+	[STAT_VLAN] = "unknown_vlan",
+	[STAT_LIMIT_CLIENT] = "client_limit",
+	[STAT_LIMIT_IFC] = "ifc_limit",
+	[STAT_DUP] = "duplicate",
+};
+
+_Thread_local uint64_t *stats_self;
+_Thread_local uint64_t *stats_hist;
+_Thread_local enum stat_id stat_last;
+static struct stats_hdr *stats;
+
+#define ALIGN64(n)	(((n) + 63) & ~(size_t)63)
+
+/* Offset of the first worker's counters */
+static size_t
+stats_base(const struct stats_hdr *h)
+{
+	return ALIGN64(sizeof *h + (size_t)h->nifc * IFNAMSIZ);
+}
+
+/* Size of each worker's counters and histograms */
+static size_t
+stats_stride(const struct stats_hdr *h)
+{
+	return ALIGN64((size_t)h->nifc *
+	    (h->nstats + DIR_MAX * h->nbuckets) * sizeof (uint64_t));
+}
+
+uint64_t *
+stats_counters(const struct stats_hdr *h, unsigned int worker)
+{
+	return (uint64_t *)((char *)h + stats_base(h) +
+	    worker * stats_stride(h));
+}
+
+uint64_t *
+stats_hists(const struct stats_hdr *h, unsigned int worker)
+{
+	return stats_counters(h, worker) + (size_t)h->nifc * h->nstats;
+}
+
+const char *
+stats_ifname(const struct stats_hdr *h, unsigned int i)
+{
+	return (const char *)(h + 1) + i * IFNAMSIZ;
+}
+
+int
+stats_open(const char *path, struct ifc *ifc, unsigned int nifc,
+	unsigned int nworkers)
+{
+	struct stats_hdr h = {
+		.magic = STATS_MAGIC,
+		.version = STATS_VERSION,
+		.nifc = nifc,
+		.nworkers = nworkers,
+		.nstats = STAT_MAX,
+		.pid = getpid(),
+		.nbuckets = HIST_BUCKETS,
+	};
+	int fd = -1;
+
+	h.size = stats_base(&h) + nworkers * stats_stride(&h);
+	char tmp[path ? strlen(path) + 5 : 1];
+	if (path) {
+		/* Fill in a new file, then replace any old one with it */
+		snprintf(tmp, sizeof tmp, "%s.new", path);
+		fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd == -1 || ftruncate(fd, h.size) == -1) {
+			warn("%s", tmp);
+			goto fail;
+		}
+	}
+	void *map = mmap(NULL, h.size, PROT_READ | PROT_WRITE,
+	    path ? MAP_SHARED : MAP_SHARED | MAP_ANONYMOUS, fd, 0);
+	if (map == MAP_FAILED) {
+		warn("mmap stats");
+		goto fail;
+	}
+	memcpy(map, &h, sizeof h);
+	for (unsigned int i = 0; i < nifc; i++) {
+		ifc[i].num = i;
+		strncpy((char *)stats_ifname(map, i), ifc[i].name,
+		    IFNAMSIZ - 1);
+	}
+	if (path && rename(tmp, path) == -1) {
+		warn("%s", path);
+		munmap(map, h.size);
+		goto fail;
+	}
+	if (fd != -1)
+		close(fd);
+	stats = map;
+	return 0;
+
+fail:
+	if (fd != -1) {
+		unlink(tmp);
+		close(fd);
+	}
+	return -1;
+}
+
+void
+stats_bind(unsigned int worker)
+{
+	if (stats && worker < stats->nworkers) {
+		stats_self = stats_counters(stats, worker);
+		stats_hist = stats_hists(stats, worker);
+	} else
+		stats_self = stats_hist = NULL;
+}
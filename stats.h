@@ -0,0 +1,144 @@
+/*
+ * Per-interface counters and latency histograms. Each relay worker
+ * increments its own copy of them without locks; readers such as
+ * dhcp6relay-stat add up the workers' copies. They live in a shared
+ * memory mapping of a stats file when one is given (-S), otherwise
+ * in anonymous memory.
+ */
+
+#include <stdint.h>
+
+struct ifc;
+
+enum stat_id {
+	STAT_RX,		/* Frames received */
+	STAT_RELAYED,		/* Received frames that were relayed */
+	STAT_TX,		/* Frames sent */
+	STAT_TX_ERR,		/* Frames that could not be sent */
+	/* Reasons that received frames were dropped */
+	STAT_NOT_UDP,		/* Not an IPv6 UDP packet */
+	STAT_BAD_CSUM,		/* Bad UDP checksum */
+	STAT_MSG_TYPE,		/* Message type not relayed from clients */
+	STAT_HOPS,		/* Too many nested RELAY-FORWs */
+	STAT_MALFORMED,		/* Bad DHCPv6 or RELAY-REPL message */
+	STAT_BIG,		/* Too big to wrap */
+	STAT_IFID,		/* Unknown or closed interface-ID */
+	STAT_VLAN,		/* No virtual client for a trunk's VLAN */
+	STAT_LIMIT_CLIENT,	/* Over the client's rate limit */
+	STAT_LIMIT_IFC,		/* Over the interface's rate limit */
+	STAT_DUP,		/* Retransmission within the dedup window */
+	STAT_MAX
+};
+#define STAT_DROP_FIRST	STAT_NOT_UDP
+
+/* Relay directions, for latency histograms */
+enum stat_dir {
+	DIR_C2S,		/* Client to server (RELAY-FORW) */
+	DIR_S2C,		/* Server to client */
+	DIR_MAX
+};
+
+/*
+ * Log-linear latency histograms, from the kernel's receive timestamp
+ * to the return from the send call. Latencies are counted in units
+ * of 1 << HIST_SHIFT ns. Units below 8 have their own buckets; each
+ * power of two above that is split into 8 linear buckets, so a
+ * bucket's width is at most 1/8 of its value. Latencies beyond the
+ * last bucket (over two minutes) are counted in it.
+ */
+#define HIST_SHIFT	6
+#define HIST_SUB	3		/* log2 of buckets per power of two */
+#define HIST_MAXEXP	30
+#define HIST_BUCKETS	((HIST_MAXEXP - HIST_SUB + 2) << HIST_SUB)
+
+/* Returns the bucket counting a latency of ns nanoseconds */
+static inline unsigned int
+hist_bucket(uint64_t ns)
+{
+	uint64_t v = ns >> HIST_SHIFT;
+
+	if (v < (1u << HIST_SUB))
+		return v;
+	unsigned int e = 63 - __builtin_clzll(v);
+	if (e > HIST_MAXEXP)
+		return HIST_BUCKETS - 1;
+	return ((e - HIST_SUB + 1) << HIST_SUB) +
+	    ((v >> (e - HIST_SUB)) & ((1u << HIST_SUB) - 1));
+}
+
+/* Returns the smallest latency, in ns, counted by a bucket */
+static inline uint64_t
+hist_value(unsigned int b)
+{
+	if (b < (1u << HIST_SUB))
+		return (uint64_t)b << HIST_SHIFT;
+	unsigned int e = (b >> HIST_SUB) + HIST_SUB - 1;
+	uint64_t sub = b & ((1u << HIST_SUB) - 1);
+	return (((uint64_t)1 << e) + (sub << (e - HIST_SUB))) << HIST_SHIFT;
+}
+
+/* Short names of the counters, e.g. "bad_csum" */
+extern const char *const stat_names[STAT_MAX];
+
+/* Layout of the stats file */
+#define STATS_MAGIC	0x64367374	/* "d6st" */
+#define STATS_VERSION	2
+struct stats_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nifc;
+	uint32_t nworkers;
+	uint32_t nstats;		/* STAT_MAX */
+	uint32_t pid;
+	uint64_t size;			/* Of the whole file */
+	uint32_t nbuckets;		/* HIST_BUCKETS */
+	uint32_t unused;
+	/* Followed by char name[nifc][IFNAMSIZ], then for each worker,
+	 * 64-byte aligned, uint64_t count[nifc][nstats] and
+	 * uint64_t hist[nifc][DIR_MAX][nbuckets] */
+};
+
+/* Returns a worker's counters within a mapped stats file */
+uint64_t *stats_counters(const struct stats_hdr *h, unsigned int worker);
+
+/* Returns a worker's histograms within a mapped stats file */
+uint64_t *stats_hists(const struct stats_hdr *h, unsigned int worker);
+
+/* Returns the name of interface i within a mapped stats file */
+const char *stats_ifname(const struct stats_hdr *h, unsigned int i);
+
+/* Creates the counters for nworkers workers and the interfaces,
+ * numbering them (ifc->num). If path is not NULL, they are
+ * published in that file.
+ * Returns 0 on success, -1 on error. */
+int stats_open(const char *path, struct ifc *ifc, unsigned int nifc,
+	unsigned int nworkers);
+
+/* Makes the calling thread count into the given worker's counters */
+void stats_bind(unsigned int worker);
+
+/* The calling thread's counters and histograms, or NULL if it
+ * does not count */
+extern _Thread_local uint64_t *stats_self;
+extern _Thread_local uint64_t *stats_hist;
+
+/* Adds n to one of an interface's counters */
+#define stat_add(ifc, s, n) do { \
+		if (stats_self) \
+			stats_self[(ifc)->num * STAT_MAX + (s)] += (n); \
+	} while (0)
+#define stat_inc(ifc, s) do { \
+		stat_last = (s); \
+		stat_add(ifc, s, 1); \
+	} while (0)
+
+/* The counter last incremented with stat_inc() by the calling thread,
+ * counted or not: after relaying a frame, why it was dropped */
+extern _Thread_local enum stat_id stat_last;
+
+/* Counts a latency of ns nanoseconds relaying from interface ifc */
+#define stat_latency(ifc, dir, ns) do { \
+		if (stats_hist) \
+			stats_hist[((ifc)->num * DIR_MAX + (dir)) * \
+			    HIST_BUCKETS + hist_bucket(ns)]++; \
+	} while (0)
@@ -0,0 +1,112 @@
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ifc.h"
+#include "io.h"
+#include "pkt.h"
+#include "stats.h"
+#include "txq.h"
+
+int
+txq_add(struct txq *q, struct pkt *pkt, const struct ifc *from,
+	const struct ifc *to)
+{
+	struct iovec frame[2], *iov;
+	unsigned int taglen = 4 * to->vlan_n;
+
+	pkt_iov(pkt, frame);
+	if (frame[0].iov_len < ETHER_ADDR_LEN * 2 ||
+	    frame[0].iov_len + taglen > TXQ_BYTES)
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+	/* Make room before taking the next slot */
+	if (q->n == TXQ_MAX ||
+	    q->used + frame[0].iov_len + taglen > TXQ_BYTES)
+		txq_flush(q);
+	iov = q->iov[q->n];
+	iov[0] = frame[0];
+	iov[1] = frame[1];
+	if (!q->buf && !(q->buf = malloc(TXQ_BYTES)))
+		return -1;
+
+	if (!pkt->csum_ok)
+		pkt->udphdr->uh_sum = udp6_checksum(pkt);
+
+	/* Copy the headers, 4-byte aligned within buf, tagging frames
+	 * for a trunk's virtual client after the MAC addresses */
+	char *hdr = q->buf + q->used;
+	const char *from_hdr = iov[0].iov_base;
+	memcpy(hdr, from_hdr, ETHER_ADDR_LEN * 2);
+	for (unsigned int k = 0; k < to->vlan_n; k++) {
+		uint16_t tag[2] = {
+			/* 802.1ad S-tag outside a C-tag */
+			htons(k + 1 < to->vlan_n ? ETH_P_8021AD : ETH_P_8021Q),
+			htons(to->vlan[k])
+		};
+		memcpy(hdr + ETHER_ADDR_LEN * 2 + 4 * k, tag, sizeof tag);
+	}
+	memcpy(hdr + ETHER_ADDR_LEN * 2 + taglen,
+	    from_hdr + ETHER_ADDR_LEN * 2,
+	    iov[0].iov_len - ETHER_ADDR_LEN * 2);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len += taglen;
+	q->used += (iov[0].iov_len + 3) & ~3u;
+
+	q->rxtime[q->n] = pkt->rxtime;
+	q->from[q->n] = from;
+	q->msg[q->n++] = (struct mmsghdr) {
+		.msg_hdr = { .msg_iov = iov, .msg_iovlen = 2 }
+	};
+	return 0;
+}
+
+int
+txq_flush(struct txq *q)
+{
+	unsigned int sent = 0;
+
+	while (sent < q->n) {
+		int ret = q->io->ops->send(q->io, &q->msg[sent], q->n - sent);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("%s send", q->io->name);
+			break;	/* Drop the rest of the batch */
+		}
+		sent += ret;
+	}
+	if (sent && stats_hist) {
+		/* Relay latency, up to the return from the send call */
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		uint64_t now = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+		for (unsigned int k = 0; k < sent; k++)
+			if (q->rxtime[k] && q->rxtime[k] <= now)
+				stat_latency(q->from[k],
+				    q->from[k]->side == CLIENT
+				    ? DIR_C2S : DIR_S2C,
+				    now - q->rxtime[k]);
+	}
+	if (q->n) {
+		q->batches++;
+		q->frames += sent;
+		q->dropped += q->n - sent;
+	}
+	q->n = 0;
+	q->used = 0;
+	return sent;
+}
+
+void
+txq_free(struct txq *q)
+{
+	free(q->buf);
+	q->buf = NULL;
+	q->n = 0;
+	q->used = 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * A transmit queue collects the frames destined for one interface
+ * during a poll wakeup, so that they can be handed to its I/O backend
+ * together, e.g. with a single sendmmsg() call instead of one send()
+ * each.
+ * Only the headers of each frame are copied into the queue; the
+ * payload is referenced in place, so the packet buffer must not be
+ * reused until the queue has been flushed.
+ */
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+struct ifc;
+struct io;
+struct pkt;
+
+#define TXQ_MAX		64		/* Frames per batch */
+#define TXQ_BYTES	(TXQ_MAX * 256)	/* Header storage per batch */
+
+struct txq {
+	struct io *io;			/* Destination */
+	unsigned int n;			/* Number of queued frames */
+	unsigned int used;		/* Bytes used in buf[] */
+	unsigned long batches;		/* Statistics */
+	unsigned long frames;
+	unsigned long dropped;		/* Frames that failed to send */
+	struct mmsghdr msg[TXQ_MAX];
+	struct iovec iov[TXQ_MAX][2];	/* Headers, payload */
+	uint64_t rxtime[TXQ_MAX];	/* For latency histograms */
+	const struct ifc *from[TXQ_MAX];
+	char *buf;			/* TXQ_BYTES, allocated on first use */
+};
+#define TXQ_INIT(d) { .io = (d), .n = 0, .used = 0, .buf = NULL }
+
+/* Updates the packet's UDP checksum (unless pkt->csum_ok) and appends
+ * its L2 frame to the queue, flushing it first if it is full.
+ * The frame's headers are copied, but its payload is not.
+ * from is the interface the packet was received on, and to the one
+ * it is for; if that is a trunk's virtual client, the frame is
+ * tagged with its VLANs.
+ * Returns 0 on success, -1 on error. */
+int txq_add(struct txq *q, struct pkt *pkt, const struct ifc *from,
+	const struct ifc *to);
+
+/* Sends all the queued frames, and counts the latency of those
+ * with a receive timestamp (see stat_latency()). On a send error, the
+ * rest of the batch is dropped and counted in q->dropped.
+ * Returns the number of frames sent. */
+int txq_flush(struct txq *q);
+
+/* Releases the queue's storage, dropping unsent frames */
+void txq_free(struct txq *q);
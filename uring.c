@@ -0,0 +1,277 @@
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "pkt.h"
+#include "uring.h"
+
+unsigned int uring_bufs;
+
+/* Buffer group of the provided buffers */
+#define URING_BGID	0
+
+/* Entries in the submission queue; only the RECVMSG request is made */
+#define URING_SQ_ENTRIES	2
+
+/* Space in front of each frame for its sockaddr_ll, kept so that the
+ * IPv6 header behind an ethernet header is 4-byte aligned */
+#define URING_NAMELEN	(sizeof (struct sockaddr_ll) + 2)
+
+/* Offset of the frame within each buffer */
+#define URING_RXOFF	(sizeof (struct io_uring_recvmsg_out) + \
+			 URING_NAMELEN + PKT_CMSG_SPACE)
+
+static int
+io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(SYS_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+	unsigned int flags)
+{
+	return syscall(SYS_io_uring_enter, fd, to_submit, min_complete,
+	    flags, NULL, 0);
+}
+
+static int
+io_uring_register(int fd, unsigned int opcode, void *arg,
+	unsigned int nr_args)
+{
+	return syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Hands the buffers lent since the last call back to the kernel */
+static void
+uring_release(struct uring *ur)
+{
+	unsigned short mask = uring_bufs - 1;
+
+	for (unsigned int k = 0; k < ur->nlent; k++) {
+		unsigned short bid = ur->lent[k];
+		struct io_uring_buf *b = &ur->br->bufs[(ur->br_tail + k) & mask];
+		b->addr = (uintptr_t)(ur->bufs + (size_t)bid * URING_BUF_SIZE);
+		b->len = URING_BUF_SIZE;
+		b->bid = bid;
+	}
+	ur->br_tail += ur->nlent;
+	ur->nlent = 0;
+	__atomic_store_n(&ur->br->tail, ur->br_tail, __ATOMIC_RELEASE);
+}
+
+/* Submits the multishot RECVMSG request */
+static int
+uring_arm(struct uring *ur)
+{
+	unsigned int tail = *ur->sq_tail;
+	unsigned int i = tail & *ur->sq_mask;
+	struct io_uring_sqe *sqe = &ur->sqes[i];
+
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = ur->s;
+	sqe->addr = (uintptr_t)&ur->msg;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	ur->sq_array[i] = i;
+	__atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	if (io_uring_enter(ur->fd, 1, 0, 0) != 1)
+		return -1;
+	ur->armed = 1;
+	return 0;
+}
+
+int
+uring_open(struct uring *ur, int s)
+{
+	struct io_uring_params p = {
+		.flags = IORING_SETUP_CQSIZE,
+		.cq_entries = 2 * uring_bufs,	/* Frames and errors */
+	};
+
+	*ur = (struct uring)URING_INIT;
+	ur->s = s;
+	ur->fd = io_uring_setup(URING_SQ_ENTRIES, &p);
+	if (ur->fd == -1)
+		return -1;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		errno = EOPNOTSUPP;
+		goto fail;
+	}
+
+	/* The queues share a mapping; the SQEs have their own */
+	ur->sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+	ur->cq_size = p.cq_off.cqes +
+	    p.cq_entries * sizeof (struct io_uring_cqe);
+	if (ur->cq_size > ur->sq_size)
+		ur->sq_size = ur->cq_size;
+	ur->sq_map = mmap(NULL, ur->sq_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+	if (ur->sq_map == MAP_FAILED) {
+		ur->sq_map = NULL;
+		goto fail;
+	}
+	ur->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED) {
+		ur->sqes = NULL;
+		goto fail;
+	}
+	char *sq = ur->sq_map, *cq = ur->sq_map;
+	ur->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ur->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	ur->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	ur->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ur->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ur->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* Provide every buffer */
+	ur->br_size = uring_bufs * sizeof (struct io_uring_buf);
+	ur->br = mmap(NULL, ur->br_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ur->bufs = mmap(NULL, (size_t)uring_bufs * URING_BUF_SIZE,
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ur->lent = calloc(uring_bufs, sizeof *ur->lent);
+	if (ur->br == MAP_FAILED || ur->bufs == MAP_FAILED || !ur->lent) {
+		if (ur->br == MAP_FAILED)
+			ur->br = NULL;
+		if (ur->bufs == MAP_FAILED)
+			ur->bufs = NULL;
+		goto fail;
+	}
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (uintptr_t)ur->br,
+		.ring_entries = uring_bufs,
+		.bgid = URING_BGID,
+	};
+	if (io_uring_register(ur->fd, IORING_REGISTER_PBUF_RING,
+	    &reg, 1) == -1)
+		goto fail;
+	for (unsigned int k = 0; k < uring_bufs; k++)
+		ur->lent[k] = k;
+	ur->nlent = uring_bufs;
+	uring_release(ur);
+
+	/* Each buffer holds a struct io_uring_recvmsg_out, the name and
+	 * control space given here, then the frame */
+	ur->msg.msg_namelen = URING_NAMELEN;
+	ur->msg.msg_controllen = PKT_CMSG_SPACE;
+	if (uring_arm(ur) == -1)
+		goto fail;
+
+	/* A kernel without multishot RECVMSG rejects it at once */
+	unsigned int head = *ur->cq_head;
+	if (head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &ur->cqes[head & *ur->cq_mask];
+		if (cqe->res == -EINVAL) {
+			errno = EINVAL;
+			goto fail;
+		}
+	}
+	return 0;
+
+fail: ;
+	int error = errno;
+	uring_close(ur);
+	errno = error;
+	return -1;
+}
+
+void
+uring_close(struct uring *ur)
+{
+	if (ur->fd != -1)
+		close(ur->fd);
+	if (ur->sq_map)
+		munmap(ur->sq_map, ur->sq_size);
+	if (ur->sqes)
+		munmap(ur->sqes, ur->sqes_size);
+	if (ur->br)
+		munmap(ur->br, ur->br_size);
+	if (ur->bufs)
+		munmap(ur->bufs, (size_t)uring_bufs * URING_BUF_SIZE);
+	free(ur->lent);
+	*ur = (struct uring)URING_INIT;
+}
+
+/* Borrows the frame received into buffer bid, of len bytes in all.
+ * Returns 0 if it was truncated and should be dropped. */
+static int
+uring_pkt(struct uring *ur, unsigned int bid, unsigned int len,
+	struct pkt *pkt)
+{
+	char *buf = ur->bufs + (size_t)bid * URING_BUF_SIZE;
+	struct io_uring_recvmsg_out out;
+
+	memcpy(&out, buf, sizeof out);
+	if (len < URING_RXOFF || (out.flags & MSG_TRUNC))
+		return 0;
+	memset(&pkt->sll, 0, sizeof pkt->sll);
+	memcpy(&pkt->sll, buf + sizeof out,
+	    out.namelen < sizeof pkt->sll ? out.namelen : sizeof pkt->sll);
+	struct msghdr msg = {
+		.msg_control = buf + sizeof out + URING_NAMELEN,
+		.msg_controllen = out.controllen,
+	};
+	pkt_cmsg(pkt, &msg);
+
+	/* What precedes the frame, and the rest of the buffer, may
+	 * be reused (see pkt_insert_udp_data()) */
+	pkt->raw = buf;
+	pkt->rawoff = URING_RXOFF;
+	pkt->rawlen = len - URING_RXOFF;
+	pkt->rawsize = URING_BUF_SIZE;
+	pkt->ip6_hdr = NULL;
+	pkt->udphdr = NULL;
+	pkt->data = NULL;
+	pkt->datalen = 0;
+	return 1;
+}
+
+int
+uring_recv(struct uring *ur, struct pkt *pkts, unsigned int n)
+{
+	unsigned int head = *ur->cq_head;
+	unsigned int tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+	unsigned int k = 0;
+	int error = 0;
+
+	uring_release(ur);
+	while (k < n && head != tail) {
+		struct io_uring_cqe *cqe = &ur->cqes[head++ & *ur->cq_mask];
+
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			ur->armed = 0;
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			ur->lent[ur->nlent++] = bid;
+			if (cqe->res > 0 && uring_pkt(ur, bid, cqe->res,
+			    &pkts[k]))
+				k++;
+		} else if (cqe->res < 0 && cqe->res != -ENOBUFS &&
+		    cqe->res != -ENETDOWN)
+			error = -cqe->res;
+		/* Out of buffers, or the link went down (which the
+		 * socket reports once): rearm below */
+	}
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+	if (error && !k) {
+		errno = error;
+		return -1;
+	}
+	if (!ur->armed && uring_arm(ur) == -1)
+		return k ? (int)k : -1;
+	return k;
+}
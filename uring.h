@@ -0,0 +1,57 @@
+/*
+ * Receiving from an AF_PACKET socket through io_uring (-u). A single
+ * multishot RECVMSG request stays armed on the socket, and the kernel
+ * completes it once per frame into a ring of buffers provided by the
+ * relay, so frames arrive without a syscall each. The relay polls the
+ * io_uring's fd instead of the socket's, walks the completions in
+ * place, and hands each buffer back once the frame in it has been
+ * relayed. Kernels older than 6.0 lack some of this; uring_open()
+ * then fails and the socket is read as without -u.
+ */
+
+struct io_uring_buf_ring;
+struct io_uring_cqe;
+struct io_uring_sqe;
+struct pkt;
+
+/* Buffers per socket requested with -u; 0 disables io_uring */
+extern unsigned int uring_bufs;
+
+struct uring {
+	int fd;				/* The io_uring, or -1 */
+	int s;				/* The socket */
+	int armed;			/* The RECVMSG request is pending */
+	/* Submission and completion queues, shared with the kernel */
+	void *sq_map;			/* Also holds the completion queue */
+	size_t sq_size, cq_size;
+	unsigned int *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Provided buffers */
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	unsigned short br_tail;		/* Buffers handed to the kernel */
+	char *bufs;			/* uring_bufs of URING_BUF_SIZE */
+	unsigned short *lent;		/* Buffers holding received frames */
+	unsigned int nlent;
+	struct msghdr msg;		/* Layout of each buffer */
+};
+#define URING_INIT { .fd = -1, .s = -1 }
+
+/* Size of each buffer: a jumbo frame and what precedes it */
+#define URING_BUF_SIZE	16384
+
+/* Sets up an io_uring of uring_bufs buffers receiving from socket s.
+ * Returns 0 on success, -1 on error (errno ENOSYS, EINVAL or
+ * EOPNOTSUPP if the kernel cannot). */
+int uring_open(struct uring *ur, int s);
+
+/* Releases the io_uring and its buffers. The socket is not closed. */
+void uring_close(struct uring *ur);
+
+/* Points pkts[] at up to n frames received since the last call, without
+ * copying. The frames stay valid until the next call.
+ * Returns the number of frames, 0 if none are waiting, or -1 on error. */
+int uring_recv(struct uring *ur, struct pkt *pkts, unsigned int n);
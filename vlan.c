@@ -0,0 +1,95 @@
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ifc.h"
+#include "pkt.h"
+#include "vlan.h"
+
+/* Parses the VLAN IDs after a trunk's name and a dot.
+ * Returns the number of tags (1 or 2), or 0 if it is not a VLAN of it. */
+static unsigned int
+vlan_parse(const char *name, const char *trunk, uint16_t vid[2])
+{
+	size_t len = strlen(trunk);
+	unsigned int n = 0;
+
+	if (strncmp(name, trunk, len) != 0)
+		return 0;
+	const char *p = name + len;
+	while (n < 2 && *p == '.') {
+		char *e;
+		unsigned long v = strtoul(p + 1, &e, 10);
+		if (e == p + 1 || v == 0 || v >= VLAN_VIDS - 1)
+			return 0;
+		vid[n++] = v;
+		p = e;
+	}
+	return *p == '\0' ? n : 0;
+}
+
+int
+vlan_build(struct ifc *ifc, unsigned int nifc)
+{
+	for (unsigned int t = 0; t < nifc; t++) {
+		if (ifc[t].side != TRUNK)
+			continue;
+		struct vlan_map *map = malloc(sizeof *map);
+		if (!map)
+			return -1;
+		for (unsigned int v = 0; v < VLAN_VIDS; v++) {
+			map->ifc[v] = -1;
+			map->inner[v] = NULL;
+		}
+		ifc[t].vlan_map = map;
+
+		for (unsigned int i = 0; i < nifc; i++) {
+			uint16_t vid[2];
+			unsigned int n;
+			int *slot;
+
+			if (ifc[i].side != CLIENT || ifc[i].vlan_n ||
+			    !(n = vlan_parse(ifc[i].name, ifc[t].name, vid)))
+				continue;
+			if (n == 1)
+				slot = &map->ifc[vid[0]];
+			else {
+				int **inner = &map->inner[vid[0]];
+				if (!*inner) {
+					*inner = malloc(VLAN_VIDS * sizeof **inner);
+					if (!*inner)
+						return -1;
+					for (unsigned int v = 0; v < VLAN_VIDS; v++)
+						(*inner)[v] = -1;
+				}
+				slot = &(*inner)[vid[1]];
+			}
+			if (*slot != -1) {
+				warnx("%s: same VLAN as %s", ifc[i].name,
+				    ifc[*slot].name);
+				return -1;
+			}
+			*slot = i;
+			ifc[i].trunk = t;
+			ifc[i].vlan_n = n;
+			memcpy(ifc[i].vlan, vid, sizeof vid);
+		}
+	}
+	return 0;
+}
+
+int
+vlan_find(const struct ifc *trunk, const struct pkt *pkt)
+{
+	const struct vlan_map *map = trunk->vlan_map;
+
+	switch (pkt->nvlan) {
+	case 1:
+		return map->ifc[pkt->vlan[0] & 0xfff];
+	case 2: ;
+		const int *inner = map->inner[pkt->vlan[0] & 0xfff];
+		return inner ? inner[pkt->vlan[1] & 0xfff] : -1;
+	default:
+		return -1;
+	}
+}
@@ -0,0 +1,30 @@
+/*
+ * Trunks (-T) carry many client VLANs over one socket on a parent
+ * port. A client interface named <trunk>.<vid> or <trunk>.<outer>.<inner>
+ * (802.1ad QinQ) is then virtual: it has no socket of its own, and its
+ * frames are received and sent, tagged, through the trunk's.
+ */
+
+#include <stdint.h>
+
+struct ifc;
+struct pkt;
+
+#define VLAN_VIDS	4096
+
+/* Flat tables from VLAN ID to a virtual client's position in the
+ * interface table, or -1 */
+struct vlan_map {
+	int ifc[VLAN_VIDS];		/* Single-tagged clients */
+	int *inner[VLAN_VIDS];		/* NULL, or inner VID tables for QinQ */
+};
+
+/* Makes each CLIENT interface named after a TRUNK interface a virtual
+ * client of it, and builds the trunks' maps.
+ * Returns 0 on success, -1 on error. */
+int vlan_build(struct ifc *ifc, unsigned int nifc);
+
+/* Finds the virtual client that a received packet on a trunk is for,
+ * by the tags in pkt->vlan[].
+ * Returns its position, or -1 if there is none. */
+int vlan_find(const struct ifc *trunk, const struct pkt *pkt);
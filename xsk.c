@@ -0,0 +1,474 @@
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_xdp.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "pkt.h"
+#include "xsk.h"
+
+/* The UMEM is split into frames, half of them for receiving */
+#define XSK_FRAME_SIZE	4096
+#define XSK_RX_FRAMES	512
+#define XSK_TX_FRAMES	512
+#define XSK_FRAMES	(XSK_RX_FRAMES + XSK_TX_FRAMES)
+
+/* Space the kernel leaves in front of received frames, after its own
+ * XDP_PACKET_HEADROOM, placing the IPv6 header behind an ethernet
+ * header 4-byte aligned */
+#define XSK_HEADROOM	2
+
+/* Queues of an interface that may have a socket */
+#define XSK_QUEUES	64
+
+/* A ring shared with the kernel */
+struct xsk_ring {
+	uint32_t *producer;
+	uint32_t *consumer;
+	void *desc;		/* struct xdp_desc[], or uint64_t[] for UMEM */
+	uint32_t size;
+	void *map;
+	size_t map_len;
+};
+
+struct xsk {
+	int fd;
+	struct xdp_ifc *xi;
+	unsigned int queue;
+	char *umem;
+	struct xsk_ring rx, tx, fill, comp;
+	uint64_t lent[XSK_RX_FRAMES];	/* Frames received, not released */
+	unsigned int nlent;
+	uint64_t free[XSK_TX_FRAMES];	/* Frames free for sending */
+	unsigned int nfree;
+};
+
+/* The XDP program of an interface, shared by its sockets */
+struct xdp_ifc {
+	unsigned int ifindex;
+	int map_fd;		/* XSKMAP from queue to socket */
+	int prog_fd;
+	int link_fd;		/* Attaches prog_fd until closed */
+	uint64_t queues;	/* Those with a socket */
+	struct xdp_ifc *next;
+};
+static struct xdp_ifc *xdp_ifcs;
+static pthread_mutex_t xdp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(SYS_bpf, cmd, attr, sizeof *attr);
+}
+
+/* Offsets within an untagged ethernet frame */
+#define OFF_TYPE	12
+#define OFF_NXT		(ETH_HLEN + 6)
+#define OFF_UDP_DPORT	(ETH_HLEN + 40 + 2)
+
+#define PASS		0x7fff	/* Jump offset patched to the final pass */
+
+#define INSN(c, d, s, o, i) ((struct bpf_insn){ \
+	.code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+/* r4 = the frame's halfword or byte at off, in network order */
+#define LDH(off)	INSN(BPF_LDX | BPF_H | BPF_MEM, 4, 2, off, 0)
+#define LDB(off)	INSN(BPF_LDX | BPF_B | BPF_MEM, 4, 2, off, 0)
+/* Passes the frame to the stack unless r4 == k */
+#define NEED(k)		INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, PASS, k)
+
+/* Loads the XDP program, which redirects IPv6 UDP frames to the
+ * DHCPv6 server port into the socket in map_fd for their queue, if
+ * there is one. The relay's socket filter does the rest of the work,
+ * in userspace. Returns the program's fd, or -1 on error. */
+static int
+xdp_load(int map_fd)
+{
+	struct bpf_insn insn[] = {
+		/* r2 = data, r3 = data_end */
+		INSN(BPF_LDX | BPF_W | BPF_MEM, 2, 1,
+		    offsetof(struct xdp_md, data), 0),
+		INSN(BPF_LDX | BPF_W | BPF_MEM, 3, 1,
+		    offsetof(struct xdp_md, data_end), 0),
+		/* Long enough for the headers tested */
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),
+		INSN(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, OFF_UDP_DPORT + 2),
+		INSN(BPF_JMP | BPF_JGT | BPF_X, 4, 3, PASS, 0),
+		LDH(OFF_TYPE),
+		NEED(htons(ETH_P_IPV6)),
+		LDB(OFF_NXT),
+		NEED(IPPROTO_UDP),
+		LDH(OFF_UDP_DPORT),
+		NEED(htons(547)),
+		/* return bpf_redirect_map(map, rx_queue_index, XDP_PASS) */
+		INSN(BPF_LDX | BPF_W | BPF_MEM, 2, 1,
+		    offsetof(struct xdp_md, rx_queue_index), 0),
+		INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0,
+		    map_fd),
+		INSN(0, 0, 0, 0, 0),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS),
+		INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+		INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		/* Passed */
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS),
+		INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+	unsigned int len = sizeof insn / sizeof insn[0];
+
+	for (unsigned int pc = 0; pc < len; pc++)
+		if (insn[pc].off == PASS)
+			insn[pc].off = len - 2 - (pc + 1);
+
+	union bpf_attr attr = {
+		.prog_type = BPF_PROG_TYPE_XDP,
+		.insns = (uintptr_t)insn,
+		.insn_cnt = len,
+		.license = (uintptr_t)"BSD",
+	};
+	return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+/* Returns the interface's program, loading and attaching it if this
+ * is its first socket. Called with xdp_lock held. */
+static struct xdp_ifc *
+xdp_get(unsigned int ifindex)
+{
+	struct xdp_ifc *xi;
+
+	for (xi = xdp_ifcs; xi; xi = xi->next)
+		if (xi->ifindex == ifindex)
+			return xi;
+	if (!(xi = calloc(1, sizeof *xi)))
+		return NULL;
+	xi->ifindex = ifindex;
+	xi->prog_fd = xi->link_fd = -1;
+
+	union bpf_attr attr = {
+		.map_type = BPF_MAP_TYPE_XSKMAP,
+		.key_size = sizeof (uint32_t),
+		.value_size = sizeof (uint32_t),
+		.max_entries = XSK_QUEUES,
+	};
+	xi->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+	if (xi->map_fd == -1)
+		goto fail;
+	xi->prog_fd = xdp_load(xi->map_fd);
+	if (xi->prog_fd == -1)
+		goto fail;
+	/* In the driver if it supports XDP, else generically */
+	attr = (union bpf_attr) { .link_create = {
+		.prog_fd = xi->prog_fd,
+		.target_ifindex = ifindex,
+		.attach_type = BPF_XDP,
+	} };
+	xi->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+	if (xi->link_fd == -1)
+		goto fail;
+	xi->next = xdp_ifcs;
+	xdp_ifcs = xi;
+	return xi;
+
+fail: ;
+	int error = errno;
+	if (xi->prog_fd != -1)
+		close(xi->prog_fd);
+	if (xi->map_fd != -1)
+		close(xi->map_fd);
+	free(xi);
+	errno = error;
+	return NULL;
+}
+
+/* Detaches the program once it has no sockets. Called with xdp_lock
+ * held. */
+static void
+xdp_put(struct xdp_ifc *xi)
+{
+	if (xi->queues)
+		return;
+	for (struct xdp_ifc **p = &xdp_ifcs; *p; p = &(*p)->next)
+		if (*p == xi) {
+			*p = xi->next;
+			break;
+		}
+	close(xi->link_fd);
+	close(xi->prog_fd);
+	close(xi->map_fd);
+	free(xi);
+}
+
+/* Maps one of the socket's rings, of size entries */
+static int
+ring_map(int fd, struct xsk_ring *r, const struct xdp_ring_offset *off,
+	uint32_t size, size_t entry, off_t pgoff)
+{
+	r->size = size;
+	r->map_len = off->desc + size * entry;
+	r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, pgoff);
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		return -1;
+	}
+	r->producer = (uint32_t *)((char *)r->map + off->producer);
+	r->consumer = (uint32_t *)((char *)r->map + off->consumer);
+	r->desc = (char *)r->map + off->desc;
+	return 0;
+}
+
+static void
+ring_unmap(struct xsk_ring *r)
+{
+	if (r->map)
+		munmap(r->map, r->map_len);
+	r->map = NULL;
+}
+
+/* Sets up the socket's UMEM and rings, and binds it to a queue */
+static int
+xsk_setup(struct xsk *x, unsigned int ifindex)
+{
+	x->umem = mmap(NULL, (size_t)XSK_FRAMES * XSK_FRAME_SIZE,
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (x->umem == MAP_FAILED) {
+		x->umem = NULL;
+		return -1;
+	}
+	struct xdp_umem_reg reg = {
+		.addr = (uintptr_t)x->umem,
+		.len = (size_t)XSK_FRAMES * XSK_FRAME_SIZE,
+		.chunk_size = XSK_FRAME_SIZE,
+		.headroom = XSK_HEADROOM,
+	};
+	int rx = XSK_RX_FRAMES, tx = XSK_TX_FRAMES;
+	int s = x->fd;
+	if (setsockopt(s, SOL_XDP, XDP_UMEM_REG, &reg, sizeof reg) == -1 ||
+	    setsockopt(s, SOL_XDP, XDP_UMEM_FILL_RING, &rx, sizeof rx) == -1 ||
+	    setsockopt(s, SOL_XDP, XDP_UMEM_COMPLETION_RING,
+	    &tx, sizeof tx) == -1 ||
+	    setsockopt(s, SOL_XDP, XDP_RX_RING, &rx, sizeof rx) == -1 ||
+	    setsockopt(s, SOL_XDP, XDP_TX_RING, &tx, sizeof tx) == -1)
+		return -1;
+
+	struct xdp_mmap_offsets off;
+	socklen_t len = sizeof off;
+	if (getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) == -1 ||
+	    ring_map(x->fd, &x->rx, &off.rx, rx, sizeof (struct xdp_desc),
+	    XDP_PGOFF_RX_RING) == -1 ||
+	    ring_map(x->fd, &x->tx, &off.tx, tx, sizeof (struct xdp_desc),
+	    XDP_PGOFF_TX_RING) == -1 ||
+	    ring_map(x->fd, &x->fill, &off.fr, rx, sizeof (uint64_t),
+	    XDP_UMEM_PGOFF_FILL_RING) == -1 ||
+	    ring_map(x->fd, &x->comp, &off.cr, tx, sizeof (uint64_t),
+	    XDP_UMEM_PGOFF_COMPLETION_RING) == -1)
+		return -1;
+
+	/* The first frames receive, the rest send */
+	for (unsigned int k = 0; k < XSK_RX_FRAMES; k++)
+		x->lent[x->nlent++] = (uint64_t)k * XSK_FRAME_SIZE;
+	xsk_release(x);
+	for (unsigned int k = 0; k < XSK_TX_FRAMES; k++)
+		x->free[x->nfree++] = (uint64_t)(XSK_RX_FRAMES + k) *
+		    XSK_FRAME_SIZE;
+
+	/* Zero-copy if the driver can */
+	struct sockaddr_xdp sxdp = {
+		.sxdp_family = AF_XDP,
+		.sxdp_flags = XDP_ZEROCOPY,
+		.sxdp_ifindex = ifindex,
+		.sxdp_queue_id = x->queue,
+	};
+	if (bind(x->fd, (struct sockaddr *)&sxdp, sizeof sxdp) == -1) {
+		sxdp.sxdp_flags = XDP_COPY;
+		if (bind(x->fd, (struct sockaddr *)&sxdp, sizeof sxdp) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+struct xsk *
+xsk_open(unsigned int ifindex)
+{
+	struct xsk *x = calloc(1, sizeof *x);
+	int error;
+
+	if (!x)
+		return NULL;
+	x->fd = -1;
+	x->queue = XSK_QUEUES;		/* None yet */
+	pthread_mutex_lock(&xdp_lock);
+	if (!(x->xi = xdp_get(ifindex))) {
+		error = errno;
+		pthread_mutex_unlock(&xdp_lock);
+		free(x);
+		errno = error;
+		return NULL;
+	}
+	if (!~x->xi->queues) {
+		errno = EBUSY;
+		goto fail;
+	}
+	x->queue = __builtin_ctzll(~x->xi->queues);
+	x->xi->queues |= (uint64_t)1 << x->queue;
+
+	x->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (x->fd == -1 || xsk_setup(x, ifindex) == -1)
+		goto fail;
+	union bpf_attr attr = {
+		.map_fd = x->xi->map_fd,
+		.key = (uintptr_t)&x->queue,
+		.value = (uintptr_t)&x->fd,
+	};
+	if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1)
+		goto fail;
+	pthread_mutex_unlock(&xdp_lock);
+	return x;
+
+fail:
+	error = errno;
+	pthread_mutex_unlock(&xdp_lock);
+	xsk_close(x);
+	errno = error;
+	return NULL;
+}
+
+void
+xsk_close(struct xsk *x)
+{
+	if (!x)
+		return;
+	pthread_mutex_lock(&xdp_lock);
+	if (x->queue < XSK_QUEUES) {
+		union bpf_attr attr = {
+			.map_fd = x->xi->map_fd,
+			.key = (uintptr_t)&x->queue,
+		};
+		(void) sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+		x->xi->queues &= ~((uint64_t)1 << x->queue);
+	}
+	xdp_put(x->xi);
+	pthread_mutex_unlock(&xdp_lock);
+
+	if (x->fd != -1)
+		close(x->fd);
+	ring_unmap(&x->rx);
+	ring_unmap(&x->tx);
+	ring_unmap(&x->fill);
+	ring_unmap(&x->comp);
+	if (x->umem)
+		munmap(x->umem, (size_t)XSK_FRAMES * XSK_FRAME_SIZE);
+	free(x);
+}
+
+int
+xsk_fd(const struct xsk *x)
+{
+	return x->fd;
+}
+
+int
+xsk_recv(struct xsk *x, struct pkt *pkt)
+{
+	uint32_t cons = *x->rx.consumer;
+
+	if (cons == __atomic_load_n(x->rx.producer, __ATOMIC_ACQUIRE))
+		return 0;
+	const struct xdp_desc *d = (struct xdp_desc *)x->rx.desc +
+	    (cons & (x->rx.size - 1));
+	uint64_t frame = d->addr & ~(uint64_t)(XSK_FRAME_SIZE - 1);
+	uint32_t len = d->len;
+	__atomic_store_n(x->rx.consumer, cons + 1, __ATOMIC_RELEASE);
+	x->lent[x->nlent++] = frame;
+
+	/* Borrow the frame; everything else in it is headroom */
+	pkt->raw = x->umem + frame;
+	pkt->rawoff = d->addr - frame;
+	pkt->rawlen = len;
+	pkt->rawsize = XSK_FRAME_SIZE;
+	pkt->nvlan = 0;
+	pkt->ip6_hdr = NULL;
+	pkt->udphdr = NULL;
+	pkt->data = NULL;
+	pkt->datalen = 0;
+	return len;
+}
+
+void
+xsk_release(struct xsk *x)
+{
+	/* There is always room: the fill ring holds every RX frame */
+	uint32_t prod = *x->fill.producer;
+
+	for (unsigned int k = 0; k < x->nlent; k++)
+		((uint64_t *)x->fill.desc)[(prod + k) & (x->fill.size - 1)] =
+		    x->lent[k];
+	__atomic_store_n(x->fill.producer, prod + x->nlent, __ATOMIC_RELEASE);
+	x->nlent = 0;
+}
+
+/* Takes back the frames the kernel has sent */
+static void
+xsk_reap(struct xsk *x)
+{
+	uint32_t cons = *x->comp.consumer;
+	uint32_t prod = __atomic_load_n(x->comp.producer, __ATOMIC_ACQUIRE);
+
+	for (; cons != prod; cons++)
+		x->free[x->nfree++] =
+		    ((uint64_t *)x->comp.desc)[cons & (x->comp.size - 1)];
+	__atomic_store_n(x->comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+int
+xsk_send(struct xsk *x, struct mmsghdr *msg, unsigned int n)
+{
+	uint32_t prod = *x->tx.producer;
+	unsigned int k;
+
+	xsk_reap(x);
+	if (!x->nfree) {
+		/* Have the kernel finish what it was sending */
+		(void) sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+		xsk_reap(x);
+	}
+	for (k = 0; k < n && x->nfree; k++) {
+		const struct msghdr *m = &msg[k].msg_hdr;
+		uint64_t frame = x->free[x->nfree - 1];
+		size_t len = 0;
+
+		for (size_t i = 0; i < m->msg_iovlen; i++)
+			len += m->msg_iov[i].iov_len;
+		if (len > XSK_FRAME_SIZE) {
+			errno = EMSGSIZE;
+			break;
+		}
+		for (size_t i = 0, off = 0; i < m->msg_iovlen; i++) {
+			memcpy(x->umem + frame + off, m->msg_iov[i].iov_base,
+			    m->msg_iov[i].iov_len);
+			off += m->msg_iov[i].iov_len;
+		}
+		x->nfree--;
+		((struct xdp_desc *)x->tx.desc)[(prod + k) &
+		    (x->tx.size - 1)] = (struct xdp_desc){
+			.addr = frame, .len = len };
+	}
+	if (!k) {
+		if (!x->nfree)
+			errno = ENOBUFS;
+		return n ? -1 : 0;
+	}
+	__atomic_store_n(x->tx.producer, prod + k, __ATOMIC_RELEASE);
+	(void) sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+	return k;
+}
@@ -0,0 +1,45 @@
+/*
+ * AF_XDP sockets for client interfaces (-x). An XDP program on the
+ * interface redirects IPv6 UDP frames to port 547 into an XDP socket
+ * bound to the receive queue they arrived on; every other frame goes
+ * on to the kernel's stack as before. The relay reads the redirected
+ * frames in place from the socket's UMEM, the memory it shares with
+ * the kernel, and copies the frames it sends on the interface into
+ * the UMEM for the kernel to transmit. Where the driver allows, no
+ * copy is made between the NIC and the UMEM (zero-copy mode).
+ *
+ * The program is loaded once per interface and shared by the sockets
+ * on its queues; each socket opened on an interface takes the next
+ * queue. Frames on queues without a socket still reach AF_PACKET.
+ */
+
+struct mmsghdr;
+struct pkt;
+struct xsk;
+
+/* Opens an XDP socket on the interface's next free queue, attaching
+ * the XDP program to it first if needed.
+ * Returns NULL on error, with errno set (e.g. EINVAL if there is no
+ * such queue, or EPERM without the privilege to load programs). */
+struct xsk *xsk_open(unsigned int ifindex);
+
+/* Closes the socket, detaching the program after the last one */
+void xsk_close(struct xsk *x);
+
+/* Returns the socket's fd, to poll for received frames */
+int xsk_fd(const struct xsk *x);
+
+/* Points pkt->raw at the next received frame in the UMEM, with
+ * headroom in front of it, without copying. The frame stays valid
+ * until xsk_release().
+ * Returns the frame length, or 0 if none are waiting. */
+int xsk_recv(struct xsk *x, struct pkt *pkt);
+
+/* Hands the frames received since the last call back to the kernel */
+void xsk_release(struct xsk *x);
+
+/* Copies the frames described by msg[0..n) into the UMEM and has the
+ * kernel send them.
+ * Returns the number of frames sent, or -1 on error (errno ENOBUFS
+ * if the UMEM has no room for any). */
+int xsk_send(struct xsk *x, struct mmsghdr *msg, unsigned int n);